@@ -3,6 +3,20 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -14,9 +28,91 @@
 #define WINDOW_WIDTH    (BOARD_WIDTH + 300)
 #define WINDOW_HEIGHT   (BOARD_WIDTH)
 
-#define MAX_PGN_LEN     8192
 #define MAX_MOVES       256
 
+#define PGN_MAX_TAGS    32
+#define PGN_MAX_PLIES   1024
+#define PGN_SAN_LEN     12
+#define PGN_READ_BUF    (1 << 16)
+#define PGN_NOTE_LEN    96 // NAG and comment written after one move
+
+#define START_FEN       "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+#define FEN_MAX_LEN     96
+#define SAVE_FILE       "chess_save.bin"
+#define SESSION_MAGIC   "CHSS"
+#define SESSION_VERSION 2
+
+#define KEY_HISTORY_SIZE  1024 // ring of recent position keys, power of two
+#define FIFTY_MOVE_PLIES  100
+
+#define KEYFRAME_INTERVAL 16 // plies between stored positions in the move history
+
+#define JOURNAL_FILE             "chess_journal.bin"
+#define JOURNAL_CHECKPOINT_FILE  "chess_journal.ckpt"
+#define JOURNAL_MAGIC            "CHJL"
+#define JOURNAL_VERSION          1
+#define JOURNAL_GROUP_MOVES      32  // moves per fsync with JOURNAL_SYNC_GROUP
+#define JOURNAL_CHECKPOINT_PLIES 200 // journal length that triggers a checkpoint
+
+#define GAME_DB_MAGIC   "CHDB"
+#define GAME_DB_VERSION 2
+#define GAME_DB_BYTE_ORDER 0x01020304u // as written by this machine; a reader with the other order rejects the file
+
+#define POSITION_INDEX_MAGIC   "CHPI"
+#define POSITION_INDEX_VERSION 2
+#define POSITION_INDEX_CHUNK   256 // games claimed per worker step
+#define POSITION_INDEX_RUN     (1 << 22) // records a worker sorts in memory before spilling a run (64 MB)
+#define POSITION_INDEX_READ    4096      // records buffered per spilled run while merging
+
+#define SEARCH_MAX_PLY    64
+#define MATE_SCORE        100000
+#define MATE_BOUND        (MATE_SCORE - SEARCH_MAX_PLY) // scores beyond this are mates
+#define INF_SCORE         1000000
+#define ASPIRATION_WINDOW 50 // centipawns either side of the previous iteration's score
+#define TT_DEFAULT_MB     16
+#define MULTI_PV_MAX      8
+#define BENCH_DEPTH       6   // depth of the "bench" node-count signature
+#define MICROBENCH_MS     200 // time spent on each micro benchmark
+#define MICROBENCH_REPS   64  // operations per position between clock reads
+
+#define PAWN_HASH_ENTRIES 4096 // per thread, power of two
+
+#define TUNE_MAX_FEATURES 48   // nonzero weight coefficients a position can have
+#define TUNE_CHUNK        4096 // positions claimed per worker step
+#define TUNE_MIN_PLY      16   // earlier PGN positions are opening theory, not evaluation
+#define TUNE_EPOCHS       200
+#define TUNE_RATE         1.0  // Adam step size, centipawns
+#define TUNE_DROPPED      255
+
+#define DATAGEN_NODES         5000    // search budget per move
+#define DATAGEN_RANDOM_PLIES  8       // random moves before the engines take over
+#define DATAGEN_SHARD_RECORDS 1000000 // records per shard file (40 MB)
+
+#define ANALYSIS_LINES     3 // lines shown in the side panel
+#define ANALYSIS_DEPTH     5
+#define ANALYSIS_PV_MOVES  4 // moves of each line that fit the panel
+
+#define MATE_MAX_MOVES 16 // longest mate solveMate() looks for
+#define MATE_TT_MB     16
+#define PN_INF         100000000u
+
+#define TRACE_RING_EVENTS  65536 // per thread; the oldest events are overwritten
+#define TRACE_FILE         "chess_trace.json"
+#define FRAME_GRAPH_FRAMES 120   // frames shown by the frame-time graph
+#define FRAME_DELAY_MS     20    // sleep at the end of every window frame
+
+#define INPUT_RECORDING_HEADER "# chess input recording 1"
+#define REPLAY_IDLE_FRAMES     3 // most frames replayed for a pause between inputs
+
+#define MATCH_MAX_PLIES    400  // longer games are adjudicated drawn
+#define MATCH_RESIGN_SCORE 1000 // centipawns both engines must agree on...
+#define MATCH_RESIGN_PLIES 8    // ...for this many plies in a row to end the game
+
+#define ANNOTATE_INACCURACY 50  // centipawns lost by a move marked ?!
+#define ANNOTATE_MISTAKE    100 // ... marked ?
+#define ANNOTATE_BLUNDER    200 // ... marked ??
+#define ANNOTATE_SCORE_CAP  600 // won is won: scores are clamped before comparing
+
 // -------------------------
 // Enumerations and Typedefs
 // -------------------------
@@ -29,21 +125,561 @@ typedef enum {
 typedef struct {
     int from_r, from_c;
     int to_r, to_c;
+    char promo; // 'Q', 'R', 'B', 'N' or 0
 } Move;
 
+// Everything makeMove() changes that unmakeMove() cannot recompute.
+typedef struct {
+    Move move;
+    char moved;
+    char captured;
+    int capRow, capCol; // differs from the target square for en passant
+    int epRow, epCol;
+    unsigned char castling;
+    int halfmove;
+    Uint64 key;
+    Uint64 pawnKey;
+} Undo;
+
+// 16-bit move as stored in the move history: from square (bits 0-5), to
+// square (6-11) and promotion piece (12-14, index into PROMO_PIECES).
+typedef unsigned short PackedMove;
+
+// The part of the game state needed to replay moves from a given point.
+typedef struct {
+    char board[BOARD_SIZE][BOARD_SIZE];
+    int turn;
+    int epRow, epCol;
+    unsigned char castling;
+    int halfmove;
+} Position;
+
+// A position in 34 bytes, as the tuner and training data keep millions of
+// them: two squares per byte (0 empty, else zobristPieceIndex() + 1, low
+// nibble first), side to move and castling rights. Move counters are not kept.
+typedef struct {
+    Uint8 squares[32];
+    Uint8 flags; // bit 0 Black to move, bits 1-4 castlingRightsIndex()
+    Sint8 epCol; // -1 if none
+} PackedPosition;
+
+// Position (and captured-piece counts) stored every KEYFRAME_INTERVAL plies.
+typedef struct {
+    Position pos;
+    int whiteCapCount, blackCapCount;
+} Keyframe;
+
+// A line left behind by playing a different move while reviewing. It is kept
+// whole from the start position, so it stays valid whichever line is shown.
+typedef struct {
+    PackedMove *moves;
+    int count;
+} Variation;
+
+// Moves played since `start`, growing as needed, with an undo record per ply
+// and keyframes so the board can be moved to any ply in constant time.
+// cursor is the ply shown on the board; it is below count while reviewing.
+// The other lines of the game are kept in variations.
+typedef struct {
+    Position start;
+    PackedMove *moves;
+    Undo *undo;
+    Keyframe *keyframes; // keyframes[k] is the position after (k + 1) * KEYFRAME_INTERVAL plies
+    int count;
+    int cursor;
+    int capacity;
+    Variation *variations;
+    int variationCount, variationCapacity;
+} MoveHistory;
+
+// Game database file layout (native byte order, recorded in byteOrder):
+// header, move streams, tag pool of "Name\0Value\0" pairs, then one
+// fixed-width index entry per game.
+typedef struct {
+    char magic[4];
+    Uint32 version;
+    Uint32 gameCount;
+    Uint32 byteOrder; // GAME_DB_BYTE_ORDER
+    Uint64 movesOffset;
+    Uint64 moveCount;
+    Uint64 tagsOffset;
+    Uint64 tagBytes;
+    Uint64 indexOffset;
+    Uint64 reserved2;
+} GameDBHeader;
+
+typedef struct {
+    Uint32 moveOffset; // in moves, from the start of the move streams
+    Uint32 tagOffset;  // in bytes, from the start of the tag pool
+    Uint16 plyCount;
+    Uint16 tagBytes;
+    Uint8 result;      // 0 = *, 1 = 1-0, 2 = 0-1, 3 = 1/2-1/2
+    Uint8 flags;
+    Uint16 reserved;
+} GameIndexEntry;
+
+typedef struct {
+    FILE *file;
+    FILE *tags;
+    GameIndexEntry *index;
+    long count, capacity;
+    Uint64 moveCount;
+    Uint64 tagBytes;
+} GameDBWriter;
+
+// A whole file mapped read-only.
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+#ifdef _WIN32
+    HANDLE fileHandle;
+    HANDLE mapHandle;
+#endif
+} MappedFile;
+
+typedef struct {
+    MappedFile map;
+    const GameDBHeader *header;
+    const GameIndexEntry *index;
+    const PackedMove *moves;
+    const char *tags;
+} GameDB;
+
+// Position index layout (native byte order, recorded in byteOrder): header,
+// entries grouped by position, then the key table sorted by Zobrist key, each
+// key pointing at its run of entries. gameCount is that of the database the
+// index was built from, so a mismatched pair is rejected.
+typedef struct {
+    char magic[4];
+    Uint32 version;
+    Uint32 byteOrder; // GAME_DB_BYTE_ORDER
+    Uint32 gameCount;
+    Uint64 keyCount;
+    Uint64 keysOffset;
+    Uint64 entryCount;
+    Uint64 entriesOffset;
+    Uint64 reserved[2];
+} PositionIndexHeader;
+
+typedef struct {
+    Uint64 key;
+    Uint64 first;
+    Uint64 count;
+} PositionKey;
+
+typedef struct {
+    Uint32 game; // 0-based database id
+    Uint16 ply;
+    PackedMove next; // 0 at the end of the game
+} PositionEntry;
+
+// Unpacked (key, game, ply, next move) record used while building.
+typedef struct {
+    Uint64 key;
+    Uint32 game;
+    Uint16 ply;
+    PackedMove next;
+} PositionRecord;
+
+typedef struct {
+    MappedFile map;
+    const PositionIndexHeader *header;
+    const PositionKey *keys;
+    const PositionEntry *entries;
+} PositionIndex;
+
+typedef struct {
+    PackedMove move;
+    long games;
+    long scored;      // games with a decisive or drawn result
+    double points;    // White's points in scored games
+    long rated;
+    double ratingSum;
+} PositionMoveStats;
+
+typedef enum {
+    JOURNAL_SYNC_NONE,  // flush to the OS only: survives a crash of the process
+    JOURNAL_SYNC_GROUP, // fsync every JOURNAL_GROUP_MOVES moves or 250 ms
+    JOURNAL_SYNC_ALWAYS // fsync after every move
+} JournalSync;
+
+// Journal file: header, then one PackedMove per ply played after baseCount.
+typedef struct {
+    char magic[4];
+    Uint32 version;
+    Uint32 baseCount; // plies already covered by the checkpoint file
+    Uint32 reserved;
+    Position start;
+} JournalHeader;
+
+typedef struct {
+    FILE *file; // NULL when journaling is off
+    int unsynced;
+    int sinceCheckpoint;
+    Uint64 lastSync;
+} MoveJournal;
+
+// Growable byte buffer for output that is built off the main thread.
+typedef struct {
+    char *data;
+    size_t len, cap;
+} TextBuffer;
+
+typedef enum {
+    SAN_OK,
+    SAN_BAD_SYNTAX,
+    SAN_NO_PIECE,      // no piece of that kind can reach the square
+    SAN_AMBIGUOUS,     // several legal moves match
+    SAN_ILLEGAL,       // only candidates leave the king in check
+    SAN_BAD_PROMOTION  // missing, misplaced or invalid promotion piece
+} SANError;
+
+typedef struct {
+    char name[32];
+    char value[128];
+} PGNTag;
+
+// One parsed game: tag pairs plus the mainline in SAN. Comments, NAGs and
+// variations are consumed by the parser and only counted.
+typedef struct {
+    long number; // 1-based position of the game in its file
+    PGNTag tags[PGN_MAX_TAGS];
+    int tagCount;
+    char san[PGN_MAX_PLIES][PGN_SAN_LEN];
+    int plyCount;
+    char result[8];
+    int commentCount;
+    int variationCount;
+    bool truncated; // more tags or plies than fit
+} PGNGame;
+
+// Return false to stop parsing after this game.
+typedef bool (*PGNGameCallback)(const PGNGame *game, void *ctx);
+
+typedef struct {
+    FILE *file; // NULL when parsing an in-memory buffer
+    const char *p, *end;
+    long long bytes;
+    char buf[PGN_READ_BUF];
+} PGNReader;
+
+// Bounded producer/consumer queue handing parsed games to worker threads.
+typedef struct {
+    PGNGame *slots;
+    int capacity;
+    int head, count;
+    bool closed;
+    SDL_mutex *lock;
+    SDL_cond *notEmpty;
+    SDL_cond *notFull;
+} PGNGameQueue;
+
+// Search features, each of which can be switched off to measure what it buys.
+typedef struct {
+    bool pvs;             // zero-window searches after the first move
+    bool aspiration;      // narrow root window around the previous iteration
+    bool nullMove;        // null-move pruning, verified when zugzwang is likely
+    bool lmr;             // late move reductions for quiet moves
+    bool checkExtensions; // search one ply deeper when in check
+    bool futility;        // skip quiet moves that cannot lift eval to alpha
+} SearchOptions;
+
+typedef enum {
+    TT_NONE,
+    TT_EXACT,
+    TT_LOWER, // score is at least this (fail high)
+    TT_UPPER  // score is at most this (fail low)
+} TTBound;
+
+typedef struct {
+    Uint64 key;
+    int score; // mate scores are stored relative to the entry's node
+    PackedMove move;
+    signed char depth;
+    unsigned char bound;
+} TTEntry;
+
+// Power-of-two array of entries indexed by the low bits of the key.
+typedef struct {
+    TTEntry *entries;
+    Uint64 mask;
+} TransTable;
+
+// Stages of the move picker, in the order alphabeta() tries them.
+typedef enum {
+    STAGE_HASH,
+    STAGE_GOOD_NOISY, // captures that do not lose material, and promotions
+    STAGE_KILLERS,
+    STAGE_QUIET,
+    STAGE_BAD_NOISY,  // captures SEE says lose material
+    STAGE_DONE
+} MoveStage;
+
+// Yields one node's moves stage by stage, generating noisy and quiet moves
+// only when their stage is reached. Noisy moves fill moves[0..noisyEnd),
+// quiet ones are appended after them.
+typedef struct {
+    MoveStage stage;
+    int color, ply;
+    PackedMove hashMove;
+    PackedMove killers[2]; // cleared unless tried, quiets skip the ones left
+    Move moves[MAX_MOVES];
+    int scores[MAX_MOVES];
+    int noisyEnd, count;
+    int next, badNext;
+} MovePicker;
+
+// One root move with its score and principal variation (pv[0] is the move).
+typedef struct {
+    int depth;
+    int score;
+    int length;
+    PackedMove pv[SEARCH_MAX_PLY];
+} PVLine;
+
+// Called by analyzePosition() after each completed depth with the lines
+// ranked best first.
+typedef void (*PVCallback)(int depth, const PVLine *lines, int count, void *ctx);
+
+// Work done by one analyzePosition() call. Counters live per thread while the
+// search runs; mergeSearchStats() adds searches together.
+typedef struct {
+    Uint64 nodes;            // alphabeta and quiescence nodes
+    Uint64 qnodes;           // quiescence nodes alone
+    Uint64 evalCalls;
+    Uint64 movegenCalls;     // including the mobility term of the evaluation
+    Uint64 ttProbes, ttHits, ttStores;
+    Uint64 pawnProbes, pawnHits;
+    Uint64 cutoffs;          // beta cutoffs in alphabeta
+    Uint64 firstMoveCutoffs; // ...by the first legal move tried
+    Uint64 pickerNodes;              // alphabeta nodes that went on to try moves
+    Uint64 stageReached[STAGE_DONE]; // ...and whose move picker got to that stage
+    int depth;               // last completed iteration
+    int seldepth;            // deepest ply reached, quiescence included
+    double seconds;
+    Uint64 depthNodes[SEARCH_MAX_PLY]; // per iteration
+    double depthSeconds[SEARCH_MAX_PLY];
+} SearchStats;
+
+// Thread that searches the side panel analysis so a search never holds up a
+// frame. The GUI posts the position on the board with the keys before it (for
+// repetitions) and picks up the result of the last search that ran to the end.
+typedef struct {
+    SDL_Thread *thread;
+    SDL_mutex *lock; // guards everything below but stop
+    SDL_cond *wake;
+    Position pos;
+    Uint64 keys[KEY_HISTORY_SIZE]; // oldest first
+    int keyCount;
+    Uint64 key; // identifies the request, positionKey ^ ply
+    bool pending, quit;
+    SDL_atomic_t stop; // set when a newer request makes the running search useless
+    PVLine lines[ANALYSIS_LINES];
+    int count;
+    SearchStats stats;
+    Uint64 resultKey;
+} AnalysisWorker;
+
+// Evaluation weights in centipawns, each added to the score of the side the
+// term counts for. evaluate() is a sum of weights times counts, which is what
+// traceEvaluation() and the tuner rely on: every term goes through weigh().
+typedef struct {
+    int material[5];    // P N B R Q
+    int pawnSquare[64]; // from White's side, a8 first
+    int passedPawn[8];  // by rank counted from the pawn's own side
+    int doubledPawn;    // per extra pawn on a file
+    int isolatedPawn;
+    int backwardPawn;
+    int shelterAdvanced; // king file pawn pushed one square
+    int shelterMissing;  // ...or gone (or further up)
+    int mobility;        // per pseudo-legal move
+    int center;          // per piece on d4, e4, d5 or e5
+} EvalWeights;
+
+#define EVAL_WEIGHT_COUNT ((int) (sizeof(EvalWeights) / sizeof(int)))
+
+// Coefficient of every weight in one evaluation, White minus Black.
+typedef struct {
+    int coef[EVAL_WEIGHT_COUNT];
+} EvalTrace;
+
+// Pawn structure of one set of pawns; depends on nothing else, so it is
+// cached by pawnKey.
+typedef struct {
+    Uint64 key;
+    Sint16 score;        // doubled, isolated, backward and passed pawns, White minus Black
+    Uint8 shelter[2][8]; // cover of a color's king by file: missing pawns << 4 | advanced pawns
+} PawnHashEntry;
+
+typedef struct {
+    bool found;
+    int mateIn;  // attacker moves
+    PVLine line; // the mating line, attacker and defender moves
+    Uint64 nodes;
+} MateResult;
+
+// One traced zone. name and argName point at string literals.
+typedef struct {
+    const char *name;
+    const char *argName; // NULL when the zone has no argument
+    int value;
+    Uint64 start, end;   // performance counter
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent *events;  // TRACE_RING_EVENTS slots
+    Uint64 written;      // events ever written; the slot is written % size
+    Uint32 threadId;
+    struct TraceRing *next;
+} TraceRing;
+
+// Timings of one replayed input recording, in milliseconds.
+typedef struct {
+    double *inputMillis; // from dispatching each input to presenting its frame
+    int inputs;
+    double *frameMillis; // every replayed frame, inputs and idle ones
+    int frames;
+} ReplayTimings;
+
+// One side of an engine match: search features and per-move limits.
+typedef struct {
+    char name[32];
+    SearchOptions options;
+    int depth;       // 0 = iterate until the node or time limit
+    Uint64 nodes;    // per move, 0 for none
+    int movetime;    // milliseconds per move, 0 for none
+} EngineConfig;
+
+typedef struct {
+    EngineConfig engines[2];
+    char (*openings)[FEN_MAX_LEN];
+    int openingCount; // each opening is played twice, colours swapped
+    int games;
+    int threads;
+    int hashMB;       // per engine per thread
+    bool sprt;        // stop once the test accepts either hypothesis
+    double elo0, elo1;
+    double alpha, beta;
+    FILE *pgnOut;     // NULL for no PGN
+} MatchConfig;
+
+// Counts are from engines[0]'s point of view.
+typedef struct {
+    int games;
+    int wins, draws, losses;
+    int adjudicated;
+    double llr, lowerBound, upperBound;
+    int decision; // 1 = H1 (elo1) accepted, -1 = H0 (elo0) accepted, 0 = open
+    double seconds;
+} MatchResult;
+
+// One nonzero coefficient of a traced evaluation.
+typedef struct {
+    Sint16 coef;
+    Uint8 index; // into EvalWeights viewed as an int array
+} TuneFeature;
+
+// Labelled positions for the tuner. extractTuneFeatures() traces them in
+// chunks of TUNE_CHUNK positions: chunk k's features are stored back to back
+// in features[k], featureCount[i] of them for position i.
+typedef struct {
+    PackedPosition *positions;
+    float *results;      // White's game score: 1, 0.5 or 0
+    Uint8 *featureCount; // TUNE_DROPPED for positions left out
+    TuneFeature **features;
+    int count, capacity;
+    int used;            // positions not dropped
+} TuneSet;
+
+// One position of self-play training data. Shard files are plain arrays of
+// these in the native byte order of the machine that wrote them, so they can
+// be concatenated and any record read by its index.
+typedef struct {
+    PackedPosition pos;
+    Sint16 score;   // search score from White's side, centipawns
+    Uint16 ply;     // plies since the opening position
+    Uint8 result;   // 0 = Black won, 1 = draw, 2 = White won
+    Uint8 reserved;
+} TrainingRecord;
+
+// Streams records to prefix_000.bin, prefix_001.bin, ..., shardRecords per file.
+typedef struct {
+    char prefix[512];
+    FILE *file;
+    int shards;
+    Uint64 inShard, shardRecords, total;
+    bool failed;
+} TrainingWriter;
+
+typedef struct {
+    MappedFile map;
+    const TrainingRecord *records;
+    Uint64 count;
+} TrainingData;
+
+typedef struct {
+    char (*openings)[FEN_MAX_LEN]; // game g starts from opening g % openingCount
+    int openingCount;              // 0 for the standard start position
+    int games;
+    int randomPlies;
+    Uint64 nodes;                  // per move
+    int threads;
+    int hashMB;                    // per thread
+    Uint64 seed;
+} DatagenConfig;
+
+typedef struct {
+    int games;
+    Uint64 positions;
+    Uint64 skipped; // searched positions left out as not quiet
+    double seconds;
+} DatagenResult;
+
 // -------------------------
 // Global Constants
 // -------------------------
 
-static const int PST_PAWN[8][8] = {
-    {0, 0, 0, 0, 0, 0, 0, 0},
-    {50, 50, 50, 50, 50, 50, 50, 50},
-    {10, 10, 20, 30, 30, 20, 10, 10},
-    {5, 5, 10, 25, 25, 10, 5, 5},
-    {0, 0, 0, 20, 20, 0, 0, 0},
-    {5, -5, -10, 0, 0, -10, -5, 5},
-    {5, 10, 10, -20, -20, 10, 10, 5},
-    {0, 0, 0, 0, 0, 0, 0, 0}
+#ifdef EVAL_WEIGHTS_FILE
+#include EVAL_WEIGHTS_FILE // written by the "tune" command
+#else
+static const EvalWeights EVAL_WEIGHTS = {
+    .material = {100, 320, 330, 500, 900},
+    .pawnSquare = {
+        0, 0, 0, 0, 0, 0, 0, 0,
+        50, 50, 50, 50, 50, 50, 50, 50,
+        10, 10, 20, 30, 30, 20, 10, 10,
+        5, 5, 10, 25, 25, 10, 5, 5,
+        0, 0, 0, 20, 20, 0, 0, 0,
+        5, -5, -10, 0, 0, -10, -5, 5,
+        5, 10, 10, -20, -20, 10, 10, 5,
+        0, 0, 0, 0, 0, 0, 0, 0
+    },
+    .passedPawn = {0, 5, 10, 20, 35, 60, 100, 0},
+    .doubledPawn = -15,
+    .isolatedPawn = -15,
+    .backwardPawn = -10,
+    .shelterAdvanced = -10,
+    .shelterMissing = -25,
+    .mobility = 10,
+    .center = 25
+};
+#endif
+
+// Layout of EvalWeights for the tuner's report and generated header.
+static const struct {
+    const char *name;
+    int first, count;
+} EVAL_WEIGHT_FIELDS[] = {
+    {"material", offsetof(EvalWeights, material) / sizeof(int), 5},
+    {"pawnSquare", offsetof(EvalWeights, pawnSquare) / sizeof(int), 64},
+    {"passedPawn", offsetof(EvalWeights, passedPawn) / sizeof(int), 8},
+    {"doubledPawn", offsetof(EvalWeights, doubledPawn) / sizeof(int), 1},
+    {"isolatedPawn", offsetof(EvalWeights, isolatedPawn) / sizeof(int), 1},
+    {"backwardPawn", offsetof(EvalWeights, backwardPawn) / sizeof(int), 1},
+    {"shelterAdvanced", offsetof(EvalWeights, shelterAdvanced) / sizeof(int), 1},
+    {"shelterMissing", offsetof(EvalWeights, shelterMissing) / sizeof(int), 1},
+    {"mobility", offsetof(EvalWeights, mobility) / sizeof(int), 1},
+    {"center", offsetof(EvalWeights, center) / sizeof(int), 1}
 };
 
 static const int VALS[128] = {
@@ -51,13 +687,53 @@ static const int VALS[128] = {
     ['p'] = -100, ['n'] = -320, ['b'] = -330, ['r'] = -500, ['q'] = -900, ['k'] = -20000
 };
 
+static const char *MOVE_STAGE_NAMES[STAGE_DONE] = {"hash", "good noisy", "killers", "quiet", "bad noisy"};
+
+// Futility margins by remaining depth
+static const int FUTILITY_MARGIN[3] = {0, 200, 500};
+
+// Positions searched by the "search" command when no FEN is given.
+static const char *BENCH_FENS[] = {
+    START_FEN,
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "4k3/8/8/8/8/8/4P3/4K3 w - - 0 1",
+    "6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+};
+
+// Exchanges checked by the "see" command: position, capture, expected gain.
+static const struct {
+    const char *fen;
+    const char *san;
+    int expected;
+} SEE_TESTS[] = {
+    {"1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1", "Rxe5", 100},
+    {"4k3/8/3p4/4p3/8/8/8/4QK2 w - - 0 1", "Qxe5", -800},
+    {"4k3/8/3p4/4n3/8/5N2/8/4K3 w - - 0 1", "Nxe5", 0},
+    {"4k3/4r3/8/4r3/8/8/4R3/4R1K1 w - - 0 1", "Rxe5", 500},
+    {"4k3/8/4p3/3p4/4P3/5B2/8/4K3 w - - 0 1", "exd5", 100},
+    {"8/8/8/8/8/4k3/3q4/2BR3K w - - 0 1", "Rxd2", 900},
+    {"8/8/8/8/8/4k3/3q4/3R3K w - - 0 1", "Rxd2", 400},
+    {"4k3/8/8/3pP3/8/8/8/4K3 w - d6 0 1", "exd6", 100},
+    {"1r2k3/P7/8/8/8/8/8/4K3 w - - 0 1", "axb8=Q", 1300},
+    {"4k3/8/8/3b4/4p3/8/8/4R1K1 w - - 0 1", "Rxe4", -400},
+    {"rnbqkbnr/ppp1pppp/8/3p4/4P3/2N5/PPPP1PPP/R1BQKBNR w KQkq - 0 1", "exd5", 100},
+    {"1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1", "Nxe5", -220},
+    {"4q3/1p1pr1k1/1B2rp2/6p1/p3PP2/P3R1P1/1P2R1K1/4Q3 b - - 0 1", "Rxe4", -400},
+    {"3r3k/3r4/2n1n3/8/3p4/2PR4/1B1Q4/3R3K w - - 0 1", "Rxd4", -90},
+};
+
 // -------------------------
 // Global Variables: SDL
 // -------------------------
 
 SDL_Window *window = NULL;
-SDL_Renderer *renderer = NULL;
-SDL_Texture *textures[128];
+_Thread_local SDL_Renderer *renderer = NULL;
+_Thread_local SDL_Texture *textures[128];
+SDL_Surface *pieceAtlas[128]; // shared, read-only after loadPieceAtlas()
 TTF_Font *font = NULL;
 TTF_Font *smallFont = NULL;
 
@@ -77,7 +753,11 @@ SDL_Rect savePGNButton = {WINDOW_WIDTH - 180, 10, 80, 30};
 
 GameState currentState = MAIN_MENU;
 
-char board[BOARD_SIZE][BOARD_SIZE] = {
+// Position and move state is thread-local so that headless worker threads
+// (batch rendering, PGN tools) can each replay their own game.
+_Thread_local bool headless = false; // no game-over exit, no console chatter, no journal
+
+_Thread_local char board[BOARD_SIZE][BOARD_SIZE] = {
     {'r', 'n', 'b', 'q', 'k', 'b', 'n', 'r'},
     {'p', 'p', 'p', 'p', 'p', 'p', 'p', 'p'},
     {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
@@ -88,44 +768,137 @@ char board[BOARD_SIZE][BOARD_SIZE] = {
     {'R', 'N', 'B', 'Q', 'K', 'B', 'N', 'R'}
 };
 
-int selectedRow = -1;
-int selectedCol = -1;
-bool pieceSelected = false;
-int currentTurn = 0; // 0 = White to move, 1 = Black to move
-bool validMoves[BOARD_SIZE][BOARD_SIZE] = {false};
+_Thread_local int selectedRow = -1;
+_Thread_local int selectedCol = -1;
+_Thread_local bool pieceSelected = false;
+_Thread_local int currentTurn = 0; // 0 = White to move, 1 = Black to move
+_Thread_local bool validMoves[BOARD_SIZE][BOARD_SIZE] = {false};
 
-char whiteCaptured[32] = {0}; // pieces captured from White
-char blackCaptured[32] = {0}; // pieces captured from Black
-int whiteCapCount = 0;
-int blackCapCount = 0;
+_Thread_local char whiteCaptured[32] = {0}; // pieces captured from White
+_Thread_local char blackCaptured[32] = {0}; // pieces captured from Black
+_Thread_local int whiteCapCount = 0;
+_Thread_local int blackCapCount = 0;
 
-bool playWithBot = false;
-int botPlaysColor = 1; // 0 = White, 1 = Black
+_Thread_local bool playWithBot = false;
+_Thread_local int botPlaysColor = 1; // 0 = White, 1 = Black
 
 char imageBasePath[256];
 char fontPath[256];
+char pgnFilePath[256] = "game.pgn"; // "Play again" / "Save" target, see --pgn
 
-int enPassantRow = -1;
-int enPassantCol = -1;
+_Thread_local int enPassantRow = -1;
+_Thread_local int enPassantCol = -1;
+_Thread_local int halfmoveClock = 0; // plies since the last capture or pawn move
 
-bool whiteKingMoved = false;
-bool whiteKingsideRookMoved = false;
-bool whiteQueensideRookMoved = false;
-bool blackKingMoved = false;
-bool blackKingsideRookMoved = false;
-bool blackQueensideRookMoved = false;
+// Zobrist key of the board, kept up to date by makeMove()/unmakeMove(), and
+// the keys of the positions before it (game and search alike) in a ring.
+// Entries older than keyFloor are not known (e.g. after a keyframe restore).
+_Thread_local Uint64 positionKey = 0;
+_Thread_local Uint64 pawnKey = 0; // the pawns alone, keys the pawn hash
+_Thread_local Uint64 keyHistory[KEY_HISTORY_SIZE];
+_Thread_local int keyTop = 0;
+_Thread_local int keyFloor = 0;
 
-bool awaitingPromotion = false;
-int promoRow = -1;
-int promoCol = -1;
-char promoColor = ' '; // 'w' or 'b'
-bool promotionJustCompleted = false;
+_Thread_local bool whiteKingMoved = false;
+_Thread_local bool whiteKingsideRookMoved = false;
+_Thread_local bool whiteQueensideRookMoved = false;
+_Thread_local bool blackKingMoved = false;
+_Thread_local bool blackKingsideRookMoved = false;
+_Thread_local bool blackQueensideRookMoved = false;
 
-char pgnMoves[MAX_PGN_LEN] = {0};
-int fullMoveNumber = 1;
+_Thread_local bool awaitingPromotion = false;
+_Thread_local int promoRow = -1;
+_Thread_local int promoCol = -1;
+_Thread_local char promoColor = ' '; // 'w' or 'b'
+_Thread_local bool promotionJustCompleted = false;
 
-static Move moveList[MAX_MOVES];
-static int moveCount = 0;
+_Thread_local Move pendingPromotion; // move waiting for the promotion picker
+
+_Thread_local MoveHistory history;
+
+// Only the GUI thread opens a journal; batch workers never touch theirs.
+_Thread_local MoveJournal journal;
+JournalSync journalSyncPolicy = JOURNAL_SYNC_GROUP;
+
+static _Thread_local Move moveList[MAX_MOVES];
+static _Thread_local int moveCount = 0;
+
+// -------------------------
+// Global Variables: Search
+// -------------------------
+
+_Thread_local SearchOptions searchOptions = {true, true, true, true, true, true};
+_Thread_local TransTable *searchTT = NULL; // table the search uses; threads may share one
+_Thread_local TransTable ownTT;            // allocated on first use when searchTT is unset
+_Thread_local TTEntry noTTEntry;           // one-entry table used when ownTT cannot be allocated
+_Thread_local TransTable noTT;
+_Thread_local Uint64 searchNodes = 0;
+_Thread_local Uint64 searchNodeLimit = 0; // 0 for none
+_Thread_local Uint64 searchDeadline = 0;  // performance counter value, 0 for none
+_Thread_local bool searchStopped = false;
+_Thread_local SDL_atomic_t *searchAbort = NULL; // another thread sets it to stop the search
+static _Thread_local bool searchLimited = false; // limits apply once depth 1 is done
+_Thread_local SearchStats searchStats;           // of the last analyzePosition() call
+static _Thread_local PackedMove killerMoves[SEARCH_MAX_PLY][2];
+static _Thread_local int historyScores[2][64][64];
+static _Thread_local PackedMove pvTable[SEARCH_MAX_PLY][SEARCH_MAX_PLY]; // triangular PV
+static _Thread_local int pvLength[SEARCH_MAX_PLY];
+static _Thread_local PawnHashEntry pawnHash[PAWN_HASH_ENTRIES];
+static _Thread_local EvalTrace *evalTrace = NULL; // set while traceEvaluation() runs
+
+// Side panel analysis (GUI thread): the lines shown, for the position
+// analysisKey, while analysisWorker searches analysisRequest
+bool analysisEnabled = false;
+PVLine analysisLines[ANALYSIS_LINES];
+int analysisCount = 0;
+Uint64 analysisKey = 0;
+Uint64 analysisRequest = 0;
+SearchStats analysisStats;
+AnalysisWorker analysisWorker;
+
+// -------------------------
+// Global Variables: Tracing
+// -------------------------
+
+SDL_atomic_t tracingEnabled; // read by every thread in traceBegin()/traceEnd()
+Uint64 traceEpoch = 0;
+Uint32 traceMainThread = 0;
+static TraceRing *traceRings = NULL; // every thread's ring, guarded by traceLock
+static SDL_mutex *traceLock = NULL;
+static _Thread_local TraceRing *traceRing = NULL;
+
+bool frameGraphEnabled = false;
+float frameTimes[FRAME_GRAPH_FRAMES]; // milliseconds, a ring indexed by frameCount
+int frameCount = 0;
+
+FILE *inputRecording = NULL; // open while the window records its input, see --record
+Uint32 recordingStart = 0;
+
+// -------------------------
+// Global Variables: Attack Tables
+// -------------------------
+
+#define SQ_PIECE(sq) (board[(sq) >> 3][(sq) & 7])
+
+// Directions 0-3 are orthogonal (rook), 4-7 diagonal (bishop)
+static const int RAY_DIRS[8][2] = {
+    {-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {-1, 1}, {1, -1}, {1, 1}
+};
+
+// Squares are indexed r * 8 + c. Filled once by initAttackTables(), read-only after.
+static signed char knightTargets[64][8];
+static int knightTargetCount[64];
+static signed char kingTargets[64][8];
+static int kingTargetCount[64];
+static signed char rays[64][8][7];
+static int rayLength[64][8];
+
+// Zobrist keys, filled once by initZobrist()
+static Uint64 zobristPieces[12][64];
+static Uint64 zobristCastling[16];
+static Uint64 zobristEnPassant[8];
+static Uint64 zobristBlackToMove;
+static Uint64 zobristPawnSeed; // pawnKey of no pawns, so it never matches an empty entry
 
 // -------------------------
 // Function Prototypes
@@ -138,26 +911,145 @@ void loadPaths();
 
 void loadFonts();
 
+void loadPieceAtlas();
+
 void loadPieceTextures();
 
+void freePieceTextures();
+
 void cleanupSDL();
 
+void initHeadless();
+
+void cleanupHeadless();
+
 // Game State Management
 void resetGameState();
 
-void saveGame(const char *filename, int turn);
+bool loadFEN(const char *fen);
+
+int writeFEN(char *buf);
+
+bool writeSession(const char *filename);
+
+bool readSession(const char *filename);
+
+bool saveGame(const char *filename);
+
+bool loadGame(const char *filename);
+
+// Move Journal
+bool parseJournalSync(const char *name, JournalSync *out);
+
+bool startJournal();
+
+void stopJournal(bool discard);
 
-void loadGame(const char *filename, int *turn);
+void journalMove(Move m);
+
+bool recoverJournal();
+
+// Text Buffers
+void textAppend(TextBuffer *tb, const void *data, size_t n);
+
+void textPrintf(TextBuffer *tb, const char *fmt, ...);
+
+void freeTextBuffer(TextBuffer *tb);
+
+// Tracing
+void startTracing();
+
+void stopTracing();
+
+Uint64 traceBegin();
+
+void traceEnd(Uint64 start, const char *name);
+
+void traceEndValue(Uint64 start, const char *name, const char *argName, int value);
+
+bool writeTrace(const char *filename);
+
+void freeTracing();
+
+// Move History
+void savePosition(Position *pos);
+
+void restorePosition(const Position *pos);
+
+void packPosition(PackedPosition *out);
+
+void unpackPosition(const PackedPosition *in);
+
+PackedMove packMove(Move m);
+
+Move unpackMove(PackedMove pm);
+
+void recordMove(const Undo *u);
+
+int countVariations();
+
+bool switchVariation();
+
+void clearVariations();
+
+void freeMoveHistory();
+
+// Move Navigation
+bool stepBackward();
+
+bool stepForward();
+
+void seekPly(int ply);
 
 // PGN and SAN Handling
-void logMoveToPGN(const char *mv, char pieceMoved, bool isCapture, bool isCheck, bool isCheckmate);
+int encodeSAN(Move m, char *buf);
+
+void formatPGNMovetext(TextBuffer *out, const char *result);
+
+void formatAnnotatedMovetext(TextBuffer *out, const char *result, char (*notes)[PGN_NOTE_LEN]);
 
 void savePGN(const char *filename);
 
-void applySANMove(const char *san);
+int findPieceOrigins(char type, int color, int tsq, int *out);
+
+SANError decodeSAN(const char *san, int color, Move *out);
+
+const char *sanErrorString(SANError err);
+
+void applyMove(Move m);
+
+void playMove(Move m);
+
+SANError applySANMove(const char *san);
 
 void playPGNFile(const char *filename);
 
+long parsePGN(PGNReader *r, PGNGameCallback onGame, void *ctx);
+
+long parsePGNFile(const char *filename, PGNGameCallback onGame, void *ctx);
+
+long parsePGNBuffer(const char *data, size_t len, PGNGameCallback onGame, void *ctx);
+
+const char *getPGNTag(const PGNGame *game, const char *name);
+
+void copyPGNGame(PGNGame *dst, const PGNGame *src);
+
+bool setupPGNStart(const PGNGame *game);
+
+int replayPGNGame(const PGNGame *game, int maxPly, void (*onPly)(int ply, void *ctx), void *ctx);
+
+int startWorkers(SDL_Thread **threads, int count, SDL_ThreadFunction fn, const char *name, void *data);
+
+bool initPGNGameQueue(PGNGameQueue *q, int capacity);
+
+void destroyPGNGameQueue(PGNGameQueue *q);
+
+bool pushPGNGame(const PGNGame *game, void *queue);
+
+bool popPGNGame(PGNGameQueue *q, PGNGame *out);
+
+void closePGNGameQueue(PGNGameQueue *q);
+
 // Valid Moves / Move Generation
 int isWhitePiece(char piece);
 
@@ -175,21 +1067,154 @@ void computeValidMoves(int r, int c);
 
 int hasAnyLegalMove(int color);
 
+int generatePseudoMoves(int color, Move *list);
+
+int generateNoisyMoves(int color, Move *list);
+
+int generateQuietMoves(int color, Move *list);
+
+bool isPseudoLegal(Move m, int color);
+
+int generateLegalMoves(int color, Move *list);
+
 void generateMoves(int color);
 
 void movePieceStoringLog(const char *mv);
 
+// Attack Tables / Make-Unmake
+void initAttackTables();
+
+int isSquareAttacked(int r, int c, int byColor);
+
+unsigned char packCastlingRights();
+
+void unpackCastlingRights(unsigned char bits);
+
+void makeMove(Move m, Undo *u);
+
+void unmakeMove(const Undo *u);
+
+void makeNullMove(Undo *u);
+
+void unmakeNullMove(const Undo *u);
+
+bool isMoveLegal(Move m, int color);
+
+bool isCastlingSafe(int row, int toCol, int color);
+
+int see(Move m);
+
+// Zobrist Hashing
+void initZobrist();
+
+int zobristPieceIndex(char p);
+
+int castlingRightsIndex();
+
+Uint64 enPassantKey(int color);
+
+Uint64 computeZobristKey();
+
+Uint64 computePawnKey();
+
+void resetKeyHistory();
+
+int repetitionCount();
+
+const char *drawReason();
+
 // Evaluation and Engine
+void evaluatePawnStructure(PawnHashEntry *e);
+
+const PawnHashEntry *probePawnHash();
+
 int evaluateStatic();
 
 int evaluateDynamic(int color);
 
-int alphabeta(int depth, int alpha, int beta, int color);
+int evaluate(int color);
+
+int traceEvaluation(EvalTrace *trace);
+
+int nonPawnMaterial(int color);
+
+bool initTransTable(TransTable *tt, int megabytes);
+
+void clearTransTable(TransTable *tt);
+
+void freeTransTable(TransTable *tt);
+
+int transTableFill(const TransTable *tt);
+
+int quiesce(int alpha, int beta, int ply);
+
+int alphabeta(int depth, int ply, int alpha, int beta, bool allowNull);
 
-Move findBestMove(int depth, int color, int *outScore);
+void setSearchLimits(Uint64 nodes, int millis);
+
+void mergeSearchStats(SearchStats *total, const SearchStats *s);
+
+double effectiveBranchingFactor(const SearchStats *s);
+
+double statRate(Uint64 part, Uint64 whole);
+
+int formatUCIMove(Move m, char *buf);
+
+void appendSearchStatsJSON(TextBuffer *out, const SearchStats *s);
+
+void printUCIInfo(int depth, const PVLine *lines, int count, void *ctx);
+
+int analyzePosition(int depth, int multiPV, PVLine *lines, PVCallback onDepth, void *ctx);
+
+Move findBestMove(int depth, int *outScore);
+
+int formatScore(int score, char *buf, size_t size);
+
+int formatPVLine(const PVLine *line, int maxMoves, char *buf, size_t size);
 
 void engineMove(int depth);
 
+// Mate Solver
+bool solveMate(int maxMoves, Uint64 maxNodes, MateResult *out);
+
+void freeMateTable();
+
+// Engine Matches
+bool runMatch(const MatchConfig *cfg, MatchResult *out);
+
+double matchElo(const MatchResult *r, double *margin);
+
+// Evaluation Tuning
+bool addTunePosition(TuneSet *set, float result);
+
+int extractTuneFeatures(TuneSet *set, int threads);
+
+double tuneError(TuneSet *set, const double *weights, double k, double *grad, int threads);
+
+double fitTuneScaling(TuneSet *set, const double *weights, int threads);
+
+double tuneEpoch(TuneSet *set, double *weights, double *moments, int epoch, double k, double rate, int threads);
+
+bool writeTunedWeights(const char *path, const double *weights, const char *comment);
+
+void freeTuneSet(TuneSet *set);
+
+// Self-Play Training Data
+void initTrainingWriter(TrainingWriter *w, const char *prefix, Uint64 shardRecords);
+
+bool writeTrainingRecords(TrainingWriter *w, const TrainingRecord *recs, int count);
+
+bool closeTrainingWriter(TrainingWriter *w);
+
+bool openTrainingData(TrainingData *data, const char *path);
+
+void closeTrainingData(TrainingData *data);
+
+bool runDatagen(const DatagenConfig *cfg, TrainingWriter *w, DatagenResult *out);
+
+long long shuffleTrainingData(const char **inputs, int inputCount, const char *outPrefix, Uint64 shardRecords,
+                              Uint64 seed);
+
 // Rendering / UI
 void drawTextWithFont(const char *text, SDL_Rect rect, TTF_Font *fontToUse);
 
@@ -209,28 +1234,111 @@ const char *getGameStatusText();
 
 void drawTurnIndicator(int turn);
 
+void stopAnalysisWorker();
+
+void updateAnalysis();
+
+void drawAnalysis();
+
 void renderBoardWithBack();
 
-// Event Handling
-void handleMouseClick(int mx, int my);
+void recordFrameTime(double millis);
 
-// -------------------------
-// Initialization / Cleanup
-// -------------------------
+void drawFrameGraph();
 
-void initSDL() {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0 || !(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
-        fprintf(stderr, "SDL init error: %s\n", SDL_GetError());
-        exit(1);
-    }
-    if (TTF_Init() == -1) {
-        fprintf(stderr, "TTF init error: %s\n", TTF_GetError());
-        exit(1);
-    }
+void drawFrame();
 
-    window = SDL_CreateWindow(
-        "Chess",
-        SDL_WINDOWPOS_CENTERED,
+// Offscreen Rendering
+bool initOffscreenRenderer(int width, int height);
+
+void cleanupOffscreenRenderer();
+
+bool renderBoardToPNG(const char *path);
+
+void renderBatch(const char *pgnFile, const char *outDir, int threads, int every);
+
+// Game Database
+bool mapFile(MappedFile *mf, const char *path);
+
+void unmapFile(MappedFile *mf);
+
+const char *gameDBResultString(int code);
+
+bool openGameDBWriter(GameDBWriter *w, const char *path);
+
+bool addGameToDB(GameDBWriter *w, const char *tagPool, size_t tagBytes, const PackedMove *moves, int plies,
+                 const char *result);
+
+bool closeGameDBWriter(GameDBWriter *w);
+
+bool openGameDB(GameDB *db, const char *path);
+
+void closeGameDB(GameDB *db);
+
+long gameDBCount(const GameDB *db);
+
+const PackedMove *gameDBMoves(const GameDB *db, long id, int *plies);
+
+const char *gameDBTag(const GameDB *db, long id, const char *name);
+
+bool replayGameDBGame(const GameDB *db, long id, int maxPly);
+
+// Position Index
+bool buildPositionIndex(const char *dbPath, const char *outPath, int threads);
+
+bool openPositionIndex(PositionIndex *idx, const char *path, const GameDB *db);
+
+void closePositionIndex(PositionIndex *idx);
+
+const PositionKey *findPosition(const PositionIndex *idx, Uint64 key);
+
+int positionMoveStats(const PositionIndex *idx, const GameDB *db, Uint64 key, PositionMoveStats *out,
+                      int maxOut, long *games);
+
+// Batch Conversion
+long convertPGNFile(const char *inFile, const char *outFile, const char *errFile, const char *dbFile, int threads);
+
+long annotatePGNFile(const char *inFile, const char *outFile, const char *errFile, const EngineConfig *engine,
+                     int hashMB, int threads);
+
+// Event Handling
+void handleMouseClick(int mx, int my);
+
+void handleKeyDown(SDL_Keycode key);
+
+bool handleEvent(const SDL_Event *e);
+
+// Input Recording
+bool startInputRecording(const char *path);
+
+void stopInputRecording();
+
+void recordInput(const SDL_Event *e);
+
+bool replayInputRecording(const char *path, ReplayTimings *out);
+
+void freeReplayTimings(ReplayTimings *t);
+
+// Command Line
+int runCommandLine(int argc, char *argv[]);
+
+// -------------------------
+// Initialization / Cleanup
+// -------------------------
+
+void initSDL() {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0 || !(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
+        fprintf(stderr, "SDL init error: %s\n", SDL_GetError());
+        exit(1);
+    }
+    if (TTF_Init() == -1) {
+        fprintf(stderr, "TTF init error: %s\n", TTF_GetError());
+        exit(1);
+    }
+
+    window = SDL_CreateWindow(
+        "Chess",
+        SDL_WINDOWPOS_CENTERED,
         SDL_WINDOWPOS_CENTERED,
         WINDOW_WIDTH,
         WINDOW_HEIGHT,
@@ -285,11 +1393,7 @@ void loadFonts() {
     }
 }
 
-void loadPieceTextures() {
-    for (int i = 0; i < 128; i++) {
-        textures[i] = NULL;
-    }
-
+void loadPieceAtlas() {
     char types[] = {'P', 'R', 'N', 'B', 'Q', 'K', 'p', 'r', 'n', 'b', 'q', 'k'};
     int typeCount = sizeof(types) / sizeof(types[0]);
 
@@ -302,14 +1406,34 @@ void loadPieceTextures() {
             fprintf(stderr, "Failed to load %s: %s\n", path, IMG_GetError());
             exit(1);
         }
-        textures[(int) types[i]] = SDL_CreateTextureFromSurface(renderer, surf);
-        SDL_FreeSurface(surf);
+        pieceAtlas[(int) types[i]] = surf;
     }
 }
 
-void cleanupSDL() {
+// Creates the calling thread's textures from the shared atlas, so every
+// renderer (window or offscreen) decodes the PNGs only once.
+void loadPieceTextures() {
+    for (int i = 0; i < 128; i++) {
+        textures[i] = NULL;
+        if (pieceAtlas[i]) {
+            textures[i] = SDL_CreateTextureFromSurface(renderer, pieceAtlas[i]);
+        }
+    }
+}
+
+void freePieceTextures() {
     for (int i = 0; i < 128; i++) {
         if (textures[i]) SDL_DestroyTexture(textures[i]);
+        textures[i] = NULL;
+    }
+}
+
+void cleanupSDL() {
+    stopAnalysisWorker();
+    freePieceTextures();
+    for (int i = 0; i < 128; i++) {
+        if (pieceAtlas[i]) SDL_FreeSurface(pieceAtlas[i]);
+        pieceAtlas[i] = NULL;
     }
     if (smallFont) TTF_CloseFont(smallFont);
     if (font) TTF_CloseFont(font);
@@ -320,6 +1444,25 @@ void cleanupSDL() {
     SDL_Quit();
 }
 
+// Headless tools only need image I/O: no window, fonts or event loop.
+void initHeadless() {
+    if (SDL_Init(0) != 0 || !(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
+        fprintf(stderr, "SDL init error: %s\n", SDL_GetError());
+        exit(1);
+    }
+    loadPaths();
+    loadPieceAtlas();
+}
+
+void cleanupHeadless() {
+    for (int i = 0; i < 128; i++) {
+        if (pieceAtlas[i]) SDL_FreeSurface(pieceAtlas[i]);
+        pieceAtlas[i] = NULL;
+    }
+    IMG_Quit();
+    SDL_Quit();
+}
+
 // -------------------------
 // Game State Management
 // -------------------------
@@ -351,6 +1494,7 @@ void resetGameState() {
     moveCount = 0;
     enPassantRow = -1;
     enPassantCol = -1;
+    halfmoveClock = 0;
     whiteKingMoved = false;
     whiteKingsideRookMoved = false;
     whiteQueensideRookMoved = false;
@@ -362,1034 +1506,7771 @@ void resetGameState() {
     promoCol = -1;
     promoColor = ' ';
     promotionJustCompleted = false;
-    memset(pgnMoves, 0, sizeof(pgnMoves));
-    fullMoveNumber = 1;
+    history.count = history.cursor = 0;
+    clearVariations();
+    savePosition(&history.start);
+    resetKeyHistory();
 }
 
-void saveGame(const char *filename, int turn) {
-    FILE *f = fopen(filename, "w");
-    if (!f) {
-        printf("Error: Could not open %s for saving.\n", filename);
-        return;
-    }
-    for (int r = 0; r < BOARD_SIZE; r++) {
-        for (int c = 0; c < BOARD_SIZE; c++) {
-            fputc(board[r][c], f);
+// Sets up the position from a FEN string. On malformed input the standard
+// starting position is restored and false is returned.
+bool loadFEN(const char *fen) {
+    resetGameState();
+    memset(board, ' ', sizeof(board));
+
+    const char *p = fen;
+    int r = 0, c = 0;
+    for (; *p && *p != ' '; p++) {
+        if (*p == '/') {
+            if (c != BOARD_SIZE) break;
+            r++;
+            c = 0;
+        } else if (*p >= '1' && *p <= '8') {
+            c += *p - '0';
+        } else if (strchr("PNBRQKpnbrqk", *p) && r < BOARD_SIZE && c < BOARD_SIZE) {
+            board[r][c++] = *p;
+        } else {
+            break;
         }
-        fputc('\n', f);
+        if (c > BOARD_SIZE) break;
+    }
+    if ((*p && *p != ' ') || r != BOARD_SIZE - 1 || c != BOARD_SIZE) {
+        resetGameState();
+        return false;
     }
-    fprintf(f, "%d\n", turn);
-    fclose(f);
-    printf("Game saved to %s.\n", filename);
-}
 
-void loadGame(const char *filename, int *turn) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        printf("Error: Could not open %s for loading.\n", filename);
-        return;
+    while (*p == ' ') p++;
+    int side = (*p == 'b') ? 1 : 0;
+    if (*p) p++;
+    while (*p == ' ') p++;
+
+    // Castling rights map onto the "has moved" flags used by isValidMove()
+    whiteKingsideRookMoved = whiteQueensideRookMoved = true;
+    blackKingsideRookMoved = blackQueensideRookMoved = true;
+    for (; *p && *p != ' '; p++) {
+        if (*p == 'K') whiteKingsideRookMoved = false;
+        if (*p == 'Q') whiteQueensideRookMoved = false;
+        if (*p == 'k') blackKingsideRookMoved = false;
+        if (*p == 'q') blackQueensideRookMoved = false;
+    }
+    while (*p == ' ') p++;
+
+    if (p[0] >= 'a' && p[0] <= 'h' && p[1] >= '1' && p[1] <= '8') {
+        enPassantCol = p[0] - 'a';
+        enPassantRow = '8' - p[1];
+    }
+
+    int halfmove = 0, fullmove = 1;
+    while (*p && *p != ' ') p++;
+    if (sscanf(p, "%d %d", &halfmove, &fullmove) != 2 || fullmove < 1) {
+        fullmove = 1;
     }
+    currentTurn = (fullmove - 1) * 2 + side;
+    halfmoveClock = halfmove < 0 ? 0 : halfmove;
+    savePosition(&history.start);
+    resetKeyHistory();
+    return true;
+}
+
+// Writes the current position as FEN into buf (at least FEN_MAX_LEN bytes)
+// and returns its length.
+int writeFEN(char *buf) {
+    int n = 0;
     for (int r = 0; r < BOARD_SIZE; r++) {
+        int empty = 0;
         for (int c = 0; c < BOARD_SIZE; c++) {
-            int ch = fgetc(f);
-            if (ch == EOF) {
-                printf("Error: Incomplete board data.\n");
-                fclose(f);
-                return;
+            if (board[r][c] == ' ') {
+                empty++;
+                continue;
             }
-            board[r][c] = (char) ch;
+            if (empty) buf[n++] = (char) ('0' + empty);
+            empty = 0;
+            buf[n++] = board[r][c];
         }
-        fgetc(f); // consume newline
+        if (empty) buf[n++] = (char) ('0' + empty);
+        if (r < BOARD_SIZE - 1) buf[n++] = '/';
     }
-    if (fscanf(f, "%d", turn) != 1) {
-        printf("Error: Could not read turn number.\n");
+    buf[n++] = ' ';
+    buf[n++] = (currentTurn % 2 == 0) ? 'w' : 'b';
+    buf[n++] = ' ';
+
+    int rights = n;
+    if (!whiteKingMoved && !whiteKingsideRookMoved) buf[n++] = 'K';
+    if (!whiteKingMoved && !whiteQueensideRookMoved) buf[n++] = 'Q';
+    if (!blackKingMoved && !blackKingsideRookMoved) buf[n++] = 'k';
+    if (!blackKingMoved && !blackQueensideRookMoved) buf[n++] = 'q';
+    if (n == rights) buf[n++] = '-';
+    buf[n++] = ' ';
+
+    if (enPassantRow >= 0) {
+        buf[n++] = (char) ('a' + enPassantCol);
+        buf[n++] = (char) ('8' - enPassantRow);
+    } else {
+        buf[n++] = '-';
+    }
+    n += sprintf(buf + n, " %d %d", halfmoveClock, currentTurn / 2 + 1);
+    return n;
+}
+
+// Session snapshot, in native byte order: everything needed to resume a game
+// exactly. Captured pieces, undo records and keyframes are rebuilt by
+// replaying the move history on load.
+typedef struct {
+    char magic[4];
+    Uint32 version;
+    Position start;
+    Sint32 cursor; // ply shown on the board
+    Sint32 playWithBot, botPlaysColor;
+    Sint32 moveCount;
+} SessionHeader;
+
+static bool syncFile(FILE *f) {
+    if (fflush(f) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+static bool replaceFile(const char *tmp, const char *filename) {
+#ifdef _WIN32
+    return MoveFileExA(tmp, filename, MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(tmp, filename) == 0;
+#endif
+}
+
+// The snapshot is assembled in memory, written with a single fwrite to a
+// temporary file, synced and renamed over the target, so a crash never
+// leaves a half-written save behind.
+bool writeSession(const char *filename) {
+    SessionHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SESSION_MAGIC, 4);
+    h.version = SESSION_VERSION;
+    h.start = history.start;
+    h.cursor = history.cursor;
+    h.playWithBot = playWithBot;
+    h.botPlaysColor = botPlaysColor;
+    h.moveCount = history.count;
+
+    TextBuffer out = {0};
+    textAppend(&out, &h, sizeof(h));
+    textAppend(&out, history.moves, history.count * sizeof(PackedMove));
+
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *f = fopen(tmp, "wb");
+    bool ok = f && out.data && fwrite(out.data, 1, out.len, f) == out.len && syncFile(f);
+    if (f) ok = (fclose(f) == 0) && ok;
+    freeTextBuffer(&out);
+    ok = ok && replaceFile(tmp, filename);
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+bool readSession(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    SessionHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, SESSION_MAGIC, 4) == 0 &&
+              h.version == SESSION_VERSION && h.moveCount >= 0;
+    PackedMove *moves = NULL;
+    if (ok && h.moveCount > 0) {
+        moves = malloc(h.moveCount * sizeof(PackedMove));
+        ok = moves && fread(moves, sizeof(PackedMove), h.moveCount, f) == (size_t) h.moveCount;
     }
     fclose(f);
+    if (!ok) {
+        free(moves);
+        return false;
+    }
+
+    resetGameState();
+    history.start = h.start;
+    restorePosition(&h.start);
+    for (int i = 0; i < h.moveCount; i++) {
+        Move m = unpackMove(moves[i]);
+        char p = board[m.from_r][m.from_c];
+        if (p == ' ' || isWhitePiece(p) != (currentTurn % 2 == 0)) {
+            ok = false;
+            break;
+        }
+        playMove(m);
+    }
+    free(moves);
+    if (!ok) {
+        resetGameState();
+        return false;
+    }
+    seekPly(h.cursor);
+    playWithBot = h.playWithBot != 0;
+    botPlaysColor = h.botPlaysColor;
+    return true;
+}
+
+bool saveGame(const char *filename) {
+    Uint64 zone = traceBegin();
+    bool ok = writeSession(filename);
+    traceEnd(zone, "saveGame");
+    if (!ok) {
+        printf("Error: Could not save game to %s.\n", filename);
+        return false;
+    }
+    printf("Game saved to %s.\n", filename);
+    return true;
+}
+
+bool loadGame(const char *filename) {
+    Uint64 zone = traceBegin();
+    bool ok = readSession(filename);
+    traceEnd(zone, "loadGame");
+    if (!ok) {
+        printf("Error: Could not load a saved game from %s.\n", filename);
+        return false;
+    }
     printf("Game loaded from %s.\n", filename);
+    return true;
 }
 
 // -------------------------
-// PGN and SAN Handling
+// Move Journal
 // -------------------------
 
-void logMoveToPGN(const char *mv, char pieceMoved, bool isCapture, bool isCheck, bool isCheckmate) {
-    char buffer[32] = {0};
-    char pieceChar = (tolower(pieceMoved) == 'p') ? '\0' : toupper(pieceMoved);
-    char moveStr[16];
+bool parseJournalSync(const char *name, JournalSync *out) {
+    if (strcmp(name, "none") == 0) *out = JOURNAL_SYNC_NONE;
+    else if (strcmp(name, "group") == 0) *out = JOURNAL_SYNC_GROUP;
+    else if (strcmp(name, "always") == 0) *out = JOURNAL_SYNC_ALWAYS;
+    else return false;
+    return true;
+}
 
-    if (pieceChar) {
-        // e.g., Nf3 → pieceChar = 'N', mv "+2" is target square
-        sprintf(moveStr, "%c%s", pieceChar, mv + 2);
+// Starts a fresh journal for the game on the board. A game that already has
+// moves (resumed or recovered) is checkpointed first so the journal only has
+// to hold what comes after; a new game removes any stale checkpoint. The new
+// journal is written and synced under a temporary name and renamed over the
+// old one, so a crash at any point leaves either the old journal or the new
+// one next to the checkpoint.
+bool startJournal() {
+    if (headless) return false;
+    stopJournal(false);
+    if (history.count > 0) {
+        if (!writeSession(JOURNAL_CHECKPOINT_FILE)) return false;
     } else {
-        // pawn move: "e4"
-        sprintf(moveStr, "%s", mv + 2);
+        remove(JOURNAL_CHECKPOINT_FILE);
     }
 
-    if (isCapture) {
-        if (pieceChar == '\0') {
-            // pawn capture: exd5
-            sprintf(moveStr, "%cxe%c", mv[0], mv[2]);
-        } else {
-            // piece capture: Nxe5
-            sprintf(moveStr, "%cxe%c", pieceChar, mv[2]);
-        }
+    JournalHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, 4);
+    h.version = JOURNAL_VERSION;
+    h.baseCount = (Uint32) history.count;
+    h.start = history.start;
+
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", JOURNAL_FILE);
+    FILE *f = fopen(tmp, "wb");
+    bool ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && syncFile(f);
+    if (f) ok = (fclose(f) == 0) && ok;
+    ok = ok && replaceFile(tmp, JOURNAL_FILE);
+    f = ok ? fopen(JOURNAL_FILE, "ab") : NULL;
+    if (!f) {
+        remove(tmp);
+        printf("Warning: could not open %s, moves will not be journaled.\n", JOURNAL_FILE);
+        return false;
     }
 
-    if (isCheckmate) {
-        strcat(moveStr, "#");
-    } else if (isCheck) {
-        strcat(moveStr, "+");
+    journal.file = f;
+    journal.unsynced = 0;
+    journal.sinceCheckpoint = 0;
+    journal.lastSync = SDL_GetPerformanceCounter();
+    return true;
+}
+
+// Closes the journal. With discard the game is over (or abandoned) and the
+// journal and checkpoint are deleted so the next start does not recover it.
+void stopJournal(bool discard) {
+    if (journal.file) {
+        syncFile(journal.file);
+        fclose(journal.file);
+        journal.file = NULL;
     }
+    if (discard && !headless) {
+        // Checkpoint first: on its own it would be recovered as a live game
+        remove(JOURNAL_CHECKPOINT_FILE);
+        remove(JOURNAL_FILE);
+    }
+}
 
-    if (currentTurn % 2 == 0) {
-        // White's move → add "n. Move"
-        sprintf(buffer, "%d. %s ", fullMoveNumber++, moveStr);
+// Appends one move. Every record reaches the OS immediately; fsync follows
+// journalSyncPolicy, with GROUP committing batches of moves (or after a short
+// interval) so bulk play does not pay a disk flush per ply.
+void journalMove(Move m) {
+    PackedMove pm = packMove(m);
+    if (fwrite(&pm, sizeof(pm), 1, journal.file) != 1) {
+        printf("Warning: journal write failed, journaling stopped.\n");
+        stopJournal(false);
+        return;
+    }
+    journal.unsynced++;
+    journal.sinceCheckpoint++;
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    bool due = journalSyncPolicy == JOURNAL_SYNC_ALWAYS ||
+               (journalSyncPolicy == JOURNAL_SYNC_GROUP &&
+                (journal.unsynced >= JOURNAL_GROUP_MOVES ||
+                 now - journal.lastSync >= SDL_GetPerformanceFrequency() / 4));
+    if (due) {
+        Uint64 zone = traceBegin();
+        syncFile(journal.file);
+        traceEnd(zone, "journal fsync");
+        journal.unsynced = 0;
+        journal.lastSync = now;
     } else {
-        // Black's move → just add the move
-        sprintf(buffer, "%s ", moveStr);
+        fflush(journal.file);
     }
 
-    strcat(pgnMoves, buffer);
+    // Bound recovery time: fold the journal into a snapshot now and then
+    if (journal.sinceCheckpoint >= JOURNAL_CHECKPOINT_PLIES) startJournal();
 }
 
-void savePGN(const char *filename) {
-    FILE *f = fopen(filename, "w");
-    if (!f) {
-        printf("Could not save PGN file\n");
-        return;
+// Restores the game from the checkpoint and journal left by a session that
+// did not shut down cleanly. Journaled moves were legal when played, so they
+// are applied with make-move directly; replay stops at the first record that
+// does not fit the position (a torn write). Without a readable journal the
+// checkpoint alone is restored. Returns false if there is nothing to recover.
+bool recoverJournal() {
+    Uint64 start = SDL_GetPerformanceCounter();
+    FILE *f = fopen(JOURNAL_FILE, "rb");
+    JournalHeader h;
+    if (!f || fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, JOURNAL_MAGIC, 4) != 0 ||
+        h.version != JOURNAL_VERSION) {
+        if (f) fclose(f);
+        if (!readSession(JOURNAL_CHECKPOINT_FILE)) return false;
+        seekPly(history.count);
+        double ms = (double) (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+        printf("Recovered game from checkpoint: %d plies in %.2f ms\n", history.count, ms);
+        return true;
     }
 
-    fprintf(f, "[Event \"Casual Game\"]\n");
-    fprintf(f, "[Site \"Local\"]\n");
-    fprintf(f, "[Date \"2025.06.04\"]\n");
-    fprintf(f, "[Round \"1\"]\n");
-    fprintf(f, "[White \"Player1\"]\n");
-    fprintf(f, "[Black \"Player2\"]\n");
-    fprintf(f, "[Result \"*\"]\n\n");
+    // The checkpoint may be newer than the journal header if the process died
+    // between writing it and truncating the journal; skip what it covers.
+    long covered = 0;
+    if (readSession(JOURNAL_CHECKPOINT_FILE)) {
+        seekPly(history.count);
+        covered = history.count;
+    } else if (h.baseCount > 0) {
+        fclose(f);
+        printf("Warning: journal checkpoint missing, cannot recover the previous game.\n");
+        return false;
+    } else {
+        resetGameState();
+        history.start = h.start;
+        restorePosition(&h.start);
+    }
+    if (covered < (long) h.baseCount) {
+        fclose(f);
+        return false;
+    }
 
-    fprintf(f, "%s *\n", pgnMoves);
+    long replayed = 0;
+    PackedMove pm;
+    for (long i = h.baseCount; fread(&pm, sizeof(pm), 1, f) == 1; i++) {
+        if (i < covered) continue;
+        Move m = unpackMove(pm);
+        char p = board[m.from_r][m.from_c];
+        if (p == ' ' || isWhitePiece(p) != (currentTurn % 2 == 0)) break;
+        playMove(m);
+        replayed++;
+    }
     fclose(f);
-    printf("PGN saved to %s\n", filename);
+
+    double ms = (double) (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    printf("Recovered game from journal: %d plies (%ld replayed) in %.2f ms\n", history.count, replayed, ms);
+    return true;
 }
 
-void applySANMove(const char *san) {
-    // Castling handling
-    if (strcmp(san, "O-O") == 0 || strcmp(san, "O-O-O") == 0) {
-        bool isWhite = (currentTurn % 2 == 0);
-        if (strcmp(san, "O-O") == 0) {
-            movePieceStoringLog(isWhite ? "e1g1" : "e8g8");
-        } else {
-            movePieceStoringLog(isWhite ? "e1c1" : "e8c8");
+// -------------------------
+// Text Buffers
+// -------------------------
+
+void textAppend(TextBuffer *tb, const void *data, size_t n) {
+    if (tb->len + n + 1 > tb->cap) {
+        size_t cap = tb->cap ? tb->cap : 1024;
+        while (tb->len + n + 1 > cap) cap *= 2;
+        char *grown = realloc(tb->data, cap);
+        if (!grown) {
+            fprintf(stderr, "Out of memory building text\n");
+            return;
         }
-        return;
+        tb->data = grown;
+        tb->cap = cap;
     }
+    memcpy(tb->data + tb->len, data, n);
+    tb->len += n;
+    tb->data[tb->len] = '\0';
+}
 
-    char piece = 'P';
-    int srcCol = -1, srcRow = -1;
-    int dstCol = -1, dstRow = -1;
-    bool isCapture = (strchr(san, 'x') != NULL);
-    int len = strlen(san);
-    bool isWhite = (currentTurn % 2 == 0);
+void textPrintf(TextBuffer *tb, const char *fmt, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    textAppend(tb, line, n < (int) sizeof(line) ? (size_t) n : sizeof(line) - 1);
+}
 
-    // Determine piece type
-    if (san[0] >= 'A' && san[0] <= 'Z' && san[0] != 'O') {
-        piece = san[0];
-        san++; // skip piece letter
-    }
+void freeTextBuffer(TextBuffer *tb) {
+    free(tb->data);
+    tb->data = NULL;
+    tb->len = tb->cap = 0;
+}
 
-    // Destination square: last two chars
-    char file = san[len - 2];
-    char rank = san[len - 1];
-    dstCol = file - 'a';
-    dstRow = '8' - rank;
+// -------------------------
+// Tracing
+// -------------------------
 
-    // Disambiguation (e.g., Nbd2 or R1e1)
-    for (int i = 0; i < len - 2; i++) {
-        if (san[i] >= 'a' && san[i] <= 'h') srcCol = san[i] - 'a';
-        if (san[i] >= '1' && san[i] <= '8') srcRow = '8' - san[i];
+// This thread's ring, allocated and linked into traceRings on first use.
+static TraceRing *threadTraceRing() {
+    if (traceRing) return traceRing;
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (ring) ring->events = malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+    if (!ring || !ring->events) {
+        free(ring);
+        SDL_AtomicSet(&tracingEnabled, 0);
+        fprintf(stderr, "Out of memory for tracing, tracing stopped\n");
+        return NULL;
     }
+    ring->threadId = (Uint32) SDL_ThreadID();
+    SDL_LockMutex(traceLock);
+    ring->next = traceRings;
+    traceRings = ring;
+    SDL_UnlockMutex(traceLock);
+    traceRing = ring;
+    return ring;
+}
 
-    // Search for matching piece
-    for (int r = 0; r < BOARD_SIZE; r++) {
-        for (int c = 0; c < BOARD_SIZE; c++) {
-            char p = board[r][c];
-            if (p == ' ') continue;
-            if ((isWhite && !isWhitePiece(p)) || (!isWhite && isWhitePiece(p))) continue;
-            if (toupper(p) != piece) continue;
-            if (srcCol != -1 && c != srcCol) continue;
-            if (srcRow != -1 && r != srcRow) continue;
-
-            if (isValidMove(r, c, dstRow, dstCol, currentTurn)) {
-                char coordMove[5];
-                coordMove[0] = 'a' + c;
-                coordMove[1] = '8' - r;
-                coordMove[2] = 'a' + dstCol;
-                coordMove[3] = '8' - dstRow;
-                coordMove[4] = '\0';
-                movePieceStoringLog(coordMove);
-                return;
-            }
-        }
-    }
+// Clears all rings and starts recording. Call before starting the threads
+// that should be traced.
+void startTracing() {
+    if (!traceLock) traceLock = SDL_CreateMutex();
+    SDL_LockMutex(traceLock);
+    for (TraceRing *r = traceRings; r; r = r->next) r->written = 0;
+    SDL_UnlockMutex(traceLock);
+    traceEpoch = SDL_GetPerformanceCounter();
+    traceMainThread = (Uint32) SDL_ThreadID();
+    SDL_AtomicSet(&tracingEnabled, 1);
+}
 
-    printf("SAN parser failed for move: %s\n", san);
+void stopTracing() {
+    SDL_AtomicSet(&tracingEnabled, 0);
 }
 
-void playPGNFile(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        printf("Could not open PGN file: %s\n", filename);
-        return;
-    }
+// Start of a zone: a timestamp, or 0 when tracing is off so that the matching
+// traceEnd() costs nothing.
+Uint64 traceBegin() {
+    return SDL_AtomicGet(&tracingEnabled) ? SDL_GetPerformanceCounter() : 0;
+}
 
-    resetGameState();
+void traceEnd(Uint64 start, const char *name) {
+    traceEndValue(start, name, NULL, 0);
+}
 
-    char token[64];
-    while (fscanf(f, "%s", token) == 1) {
-        if (token[0] == '[' || isdigit(token[0])) continue; // skip headers / move numbers
-        if (strcmp(token, "*") == 0 ||
-            strcmp(token, "1-0") == 0 ||
-            strcmp(token, "0-1") == 0 ||
-            strcmp(token, "1/2-1/2") == 0) {
-            break;
+// Records the zone [start, now) with one named integer argument (argName may
+// be NULL). name and argName must be string literals.
+void traceEndValue(Uint64 start, const char *name, const char *argName, int value) {
+    if (!start || !SDL_AtomicGet(&tracingEnabled)) return;
+    TraceRing *ring = threadTraceRing();
+    if (!ring) return;
+    TraceEvent *e = &ring->events[ring->written++ % TRACE_RING_EVENTS];
+    e->name = name;
+    e->argName = argName;
+    e->value = value;
+    e->start = start;
+    e->end = SDL_GetPerformanceCounter();
+}
+
+// Writes every ring as Chrome trace-event JSON ("X" complete events, times in
+// microseconds since startTracing()), for chrome://tracing or Perfetto.
+// Threads should be idle while this runs.
+bool writeTrace(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        printf("Could not write trace file %s\n", filename);
+        return false;
+    }
+    double usPerTick = 1e6 / SDL_GetPerformanceFrequency();
+    long count = 0;
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    SDL_LockMutex(traceLock);
+    for (TraceRing *r = traceRings; r; r = r->next) {
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                   "\"args\": {\"name\": \"%s\"}}", count++ ? ",\n" : "", (unsigned) r->threadId,
+                r->threadId == traceMainThread ? "main" : "worker");
+        Uint64 first = r->written > TRACE_RING_EVENTS ? r->written - TRACE_RING_EVENTS : 0;
+        for (Uint64 i = first; i < r->written; i++) {
+            const TraceEvent *e = &r->events[i % TRACE_RING_EVENTS];
+            if (e->start < traceEpoch) continue;
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+                    e->name, (unsigned) r->threadId, (e->start - traceEpoch) * usPerTick,
+                    (e->end - e->start) * usPerTick);
+            if (e->argName) fprintf(f, ", \"args\": {\"%s\": %d}", e->argName, e->value);
+            fprintf(f, "}");
+            count++;
         }
-        applySANMove(token);
     }
-
+    SDL_UnlockMutex(traceLock);
+    fprintf(f, "\n]}\n");
     fclose(f);
-    currentState = CHESS_BOARD;
+    printf("Trace with %ld events written to %s\n", count, filename);
+    return true;
+}
+
+void freeTracing() {
+    SDL_AtomicSet(&tracingEnabled, 0);
+    while (traceRings) {
+        TraceRing *next = traceRings->next;
+        free(traceRings->events);
+        free(traceRings);
+        traceRings = next;
+    }
+    traceRing = NULL;
+    SDL_DestroyMutex(traceLock);
+    traceLock = NULL;
 }
 
 // -------------------------
-// Valid Moves / Move Generation
+// Move History
 // -------------------------
 
-int isWhitePiece(char piece) {
-    return (piece != ' ' && isupper(piece));
+static const char PROMO_PIECES[] = {0, 'N', 'B', 'R', 'Q'};
+
+void savePosition(Position *pos) {
+    memcpy(pos->board, board, sizeof(board));
+    pos->turn = currentTurn;
+    pos->epRow = enPassantRow;
+    pos->epCol = enPassantCol;
+    pos->castling = packCastlingRights();
+    pos->halfmove = halfmoveClock;
 }
 
-int isPathClear(int r1, int c1, int r2, int c2) {
-    int dr = (r2 > r1) ? 1 : (r2 < r1) ? -1 : 0;
-    int dc = (c2 > c1) ? 1 : (c2 < c1) ? -1 : 0;
-    int r = r1 + dr, c = c1 + dc;
-    while (r != r2 || c != c2) {
-        if (board[r][c] != ' ') return 0;
-        r += dr;
-        c += dc;
+void restorePosition(const Position *pos) {
+    memcpy(board, pos->board, sizeof(board));
+    currentTurn = pos->turn;
+    enPassantRow = pos->epRow;
+    enPassantCol = pos->epCol;
+    unpackCastlingRights(pos->castling);
+    halfmoveClock = pos->halfmove;
+    resetKeyHistory();
+}
+
+void packPosition(PackedPosition *out) {
+    memset(out, 0, sizeof(*out));
+    for (int sq = 0; sq < 64; sq++) {
+        char p = SQ_PIECE(sq);
+        if (p != ' ') out->squares[sq >> 1] |= (Uint8) ((zobristPieceIndex(p) + 1) << (sq & 1) * 4);
     }
-    return 1;
+    out->flags = (Uint8) (currentTurn % 2 | castlingRightsIndex() << 1);
+    out->epCol = (Sint8) (enPassantRow >= 0 ? enPassantCol : -1);
 }
 
-void findKingPosition(int color, int *kr, int *kc) {
-    char searchChar = (color == 0) ? 'K' : 'k';
-    for (int r = 0; r < BOARD_SIZE; r++) {
-        for (int c = 0; c < BOARD_SIZE; c++) {
-            if (board[r][c] == searchChar) {
-                *kr = r;
-                *kc = c;
-                return;
-            }
-        }
+// Sets up a packed position with the move counters at zero (Black to move
+// is turn 1).
+void unpackPosition(const PackedPosition *in) {
+    static const char PIECES[] = " PNBRQKpnbrqk";
+    Position pos;
+    for (int sq = 0; sq < 64; sq++) {
+        int code = in->squares[sq >> 1] >> (sq & 1) * 4 & 15;
+        pos.board[sq >> 3][sq & 7] = code <= 12 ? PIECES[code] : ' ';
     }
-    *kr = *kc = -1;
+    int side = in->flags & 1, rights = in->flags >> 1;
+    pos.turn = side;
+    pos.epCol = in->epCol;
+    pos.epRow = in->epCol < 0 ? -1 : (side == 0 ? 2 : 5);
+    // The king has not moved; a rook without its right has
+    pos.castling = (unsigned char) (!(rights & 1) << 1 | !(rights & 2) << 2 | !(rights & 4) << 4 | !(rights & 8) << 5);
+    pos.halfmove = 0;
+    restorePosition(&pos);
 }
 
-int isValidMove(int r1, int c1, int r2, int c2, int turn) {
-    if (r1 < 0 || r1 >= BOARD_SIZE || c1 < 0 || c1 >= BOARD_SIZE) return 0;
-    if (r2 < 0 || r2 >= BOARD_SIZE || c2 < 0 || c2 >= BOARD_SIZE) return 0;
-    if (r1 == r2 && c1 == c2) return 0;
+PackedMove packMove(Move m) {
+    int promo = 0;
+    for (int i = 1; i < 5; i++) {
+        if (PROMO_PIECES[i] == m.promo) promo = i;
+    }
+    return (PackedMove) ((m.from_r * 8 + m.from_c) | (m.to_r * 8 + m.to_c) << 6 | promo << 12);
+}
 
-    char piece = board[r1][c1];
-    char targ = board[r2][c2];
-    if (piece == ' ') return 0;
+Move unpackMove(PackedMove pm) {
+    int from = pm & 63, to = pm >> 6 & 63;
+    return (Move){from >> 3, from & 7, to >> 3, to & 7, PROMO_PIECES[pm >> 12 & 7]};
+}
 
-    // Must move your own color
-    if ((turn % 2 == 0 && !isWhitePiece(piece)) ||
-        (turn % 2 == 1 && isWhitePiece(piece))) {
-        return 0;
+// Stores the current line as a variation unless a stored line already
+// contains all of it.
+static void keepVariation() {
+    for (int i = 0; i < history.variationCount; i++) {
+        const Variation *v = &history.variations[i];
+        if (v->count >= history.count && memcmp(v->moves, history.moves, history.count * sizeof(PackedMove)) == 0) {
+            return;
+        }
     }
+    if (history.variationCount == history.variationCapacity) {
+        int cap = history.variationCapacity ? history.variationCapacity * 2 : 8;
+        Variation *grown = realloc(history.variations, cap * sizeof(Variation));
+        if (!grown) {
+            fprintf(stderr, "Out of memory recording move history\n");
+            return;
+        }
+        history.variations = grown;
+        history.variationCapacity = cap;
+    }
+    Variation v = {malloc(history.count * sizeof(PackedMove)), history.count};
+    if (!v.moves) {
+        fprintf(stderr, "Out of memory recording move history\n");
+        return;
+    }
+    memcpy(v.moves, history.moves, history.count * sizeof(PackedMove));
+    history.variations[history.variationCount++] = v;
+}
 
-    // Cannot capture your own piece
-    if (targ != ' ' && (isWhitePiece(targ) == isWhitePiece(piece))) return 0;
+// Appends the move just made (u is its undo record; the turn counter has
+// already advanced). Playing a move while reviewing an earlier ply starts a
+// new line; the moves after it are kept as a variation.
+void recordMove(const Undo *u) {
+    if (history.cursor < history.count) keepVariation();
+    history.count = history.cursor;
+    if (history.count == history.capacity) {
+        int cap = history.capacity ? history.capacity * 2 : 256;
+        PackedMove *moves = realloc(history.moves, cap * sizeof(PackedMove));
+        if (moves) history.moves = moves;
+        Undo *undo = realloc(history.undo, cap * sizeof(Undo));
+        if (undo) history.undo = undo;
+        Keyframe *keyframes = realloc(history.keyframes, (cap / KEYFRAME_INTERVAL) * sizeof(Keyframe));
+        if (keyframes) history.keyframes = keyframes;
+        if (!moves || !undo || !keyframes) {
+            fprintf(stderr, "Out of memory recording move history\n");
+            return;
+        }
+        history.capacity = cap;
+    }
+    history.moves[history.count] = packMove(u->move);
+    history.undo[history.count] = *u;
+    history.count++;
+    if (history.count % KEYFRAME_INTERVAL == 0) {
+        Keyframe *kf = &history.keyframes[history.count / KEYFRAME_INTERVAL - 1];
+        savePosition(&kf->pos);
+        kf->whiteCapCount = whiteCapCount;
+        kf->blackCapCount = blackCapCount;
+    }
+    history.cursor = history.count;
+}
 
-    int dr = r2 - r1;
-    int dc = c2 - c1;
+// True if v follows the current line for its first `ply` plies and then
+// continues with a different move (or past the end of the current line).
+static bool variationBranchesAt(const Variation *v, int ply) {
+    return v->count > ply && memcmp(v->moves, history.moves, ply * sizeof(PackedMove)) == 0 &&
+           (ply == history.count || v->moves[ply] != history.moves[ply]);
+}
 
-    switch (tolower(piece)) {
-        case 'p': {
-            // Pawn logic
-            if (isWhitePiece(piece)) {
-                // Single push
-                if (dr == -1 && dc == 0 && targ == ' ') return 1;
-                // Double push from rank 6
-                if (r1 == 6 && dr == -2 && dc == 0 &&
-                    board[r1 - 1][c1] == ' ' && targ == ' ') {
-                    return 1;
-                }
-                // Capture
-                if (dr == -1 && abs(dc) == 1 && targ != ' ' &&
-                    !isWhitePiece(targ)) {
-                    return 1;
-                }
-                // En passant for White
-                if (r1 == 3 && dr == -1 && abs(dc) == 1 &&
-                    board[r2][c2] == ' ' &&
-                    r2 == enPassantRow && c2 == enPassantCol) {
-                    return 1;
-                }
-            } else {
-                // Black pawn logic
-                if (dr == 1 && dc == 0 && targ == ' ') return 1;
-                if (r1 == 1 && dr == 2 && dc == 0 &&
-                    board[r1 + 1][c1] == ' ' && targ == ' ') {
-                    return 1;
-                }
-                if (dr == 1 && abs(dc) == 1 &&
-                    targ != ' ' && isWhitePiece(targ)) {
-                    return 1;
-                }
-                // En passant for Black
-                if (r1 == 4 && dr == 1 && abs(dc) == 1 &&
-                    board[r2][c2] == ' ' &&
-                    r2 == enPassantRow && c2 == enPassantCol) {
-                    return 1;
-                }
-            }
-            break;
-        }
-        case 'r':
-            if (dr == 0 || dc == 0) return isPathClear(r1, c1, r2, c2);
-            break;
-        case 'n':
-            if ((abs(dr) == 2 && abs(dc) == 1) ||
-                (abs(dr) == 1 && abs(dc) == 2)) {
-                return 1;
-            }
-            break;
-        case 'b':
-            if (abs(dr) == abs(dc)) return isPathClear(r1, c1, r2, c2);
-            break;
-        case 'q':
-            if ((abs(dr) == abs(dc)) || dr == 0 || dc == 0) {
-                return isPathClear(r1, c1, r2, c2);
-            }
-            break;
-        case 'k':
-            // Normal one-square king move
-            if (abs(dr) <= 1 && abs(dc) <= 1) return 1;
-
-        // Castling White
-            if (isWhitePiece(piece) && r1 == 7 && c1 == 4 && !whiteKingMoved) {
-                // Kingside
-                if (r2 == 7 && c2 == 6 && !whiteKingsideRookMoved &&
-                    board[7][5] == ' ' && board[7][6] == ' ') {
-                    return 1;
-                }
-                // Queenside
-                if (r2 == 7 && c2 == 2 && !whiteQueensideRookMoved &&
-                    board[7][1] == ' ' && board[7][2] == ' ' && board[7][3] == ' ') {
-                    return 1;
-                }
-            }
-        // Castling Black
-            if (!isWhitePiece(piece) && r1 == 0 && c1 == 4 && !blackKingMoved) {
-                if (r2 == 0 && c2 == 6 && !blackKingsideRookMoved &&
-                    board[0][5] == ' ' && board[0][6] == ' ') {
-                    return 1;
-                }
-                if (r2 == 0 && c2 == 2 && !blackQueensideRookMoved &&
-                    board[0][1] == ' ' && board[0][2] == ' ' && board[0][3] == ' ') {
-                    return 1;
-                }
-            }
-            break;
+// Number of other lines that leave the current one at the shown ply.
+int countVariations() {
+    int n = 0;
+    for (int i = 0; i < history.variationCount; i++) {
+        if (variationBranchesAt(&history.variations[i], history.cursor)) n++;
     }
+    return n;
+}
 
-    return 0;
+// Replaces the moves after the shown ply with the first variation branching
+// there, and stores the replaced moves at the end of the list so repeated
+// calls cycle through every line. The board stays on the same ply. Returns
+// false if no variation branches at this ply.
+bool switchVariation() {
+    int ply = history.cursor;
+    int i = 0;
+    while (i < history.variationCount && !variationBranchesAt(&history.variations[i], ply)) i++;
+    if (i == history.variationCount) return false;
+
+    Variation v = history.variations[i];
+    memmove(&history.variations[i], &history.variations[i + 1], (history.variationCount - i - 1) * sizeof(Variation));
+    history.variationCount--;
+    if (history.count > ply) keepVariation();
+
+    // The variation was legal from this same position when it was played
+    history.count = ply;
+    for (int k = ply; k < v.count; k++) applyMove(unpackMove(v.moves[k]));
+    free(v.moves);
+    seekPly(ply);
+    if (journal.file) startJournal();
+    return true;
 }
 
-int canCaptureSquare(int r1, int c1, int r2, int c2) {
-    char p = board[r1][c1];
-    if (p == ' ') return 0;
-    if (board[r2][c2] != ' ' &&
-        isWhitePiece(board[r2][c2]) == isWhitePiece(p)) {
-        return 0;
-    }
-    int pseudoTurn = isWhitePiece(p) ? 0 : 1;
-    return isValidMove(r1, c1, r2, c2, pseudoTurn);
+void clearVariations() {
+    for (int i = 0; i < history.variationCount; i++) free(history.variations[i].moves);
+    history.variationCount = 0;
 }
 
-int isKingInCheck(int color) {
-    int kr, kc;
-    findKingPosition(color, &kr, &kc);
-    if (kr < 0) return 0;
+void freeMoveHistory() {
+    clearVariations();
+    free(history.moves);
+    free(history.undo);
+    free(history.keyframes);
+    free(history.variations);
+    history.moves = NULL;
+    history.undo = NULL;
+    history.keyframes = NULL;
+    history.variations = NULL;
+    history.count = history.cursor = history.capacity = 0;
+    history.variationCapacity = 0;
+}
 
-    for (int r = 0; r < BOARD_SIZE; r++) {
-        for (int c = 0; c < BOARD_SIZE; c++) {
-            char p = board[r][c];
-            if (p == ' ') continue;
-            if (isWhitePiece(p) == (color == 0)) continue;
-            if (canCaptureSquare(r, c, kr, kc)) return 1;
+// -------------------------
+// Move Navigation
+// -------------------------
+
+// Steps the board back one ply using the stored undo record.
+bool stepBackward() {
+    if (history.cursor == 0) return false;
+    const Undo *u = &history.undo[--history.cursor];
+    unmakeMove(u);
+    currentTurn--;
+    if (u->captured != ' ') {
+        if (isWhitePiece(u->captured)) {
+            whiteCapCount--;
+        } else {
+            blackCapCount--;
         }
     }
-    return 0;
+    return true;
 }
 
-void computeValidMoves(int r, int c) {
-    memset(validMoves, 0, sizeof(validMoves));
-    for (int rr = 0; rr < BOARD_SIZE; rr++) {
-        for (int cc = 0; cc < BOARD_SIZE; cc++) {
-            if (isValidMove(r, c, rr, cc, currentTurn)) {
-                // We skip “leaves king in check” filtering here for simplicity
-                validMoves[rr][cc] = true;
-            }
+// Replays the next recorded ply. The captured-piece lists still hold the
+// pieces from when the move was first played, so only the counts move.
+bool stepForward() {
+    if (history.cursor == history.count) return false;
+    Undo u;
+    makeMove(unpackMove(history.moves[history.cursor++]), &u);
+    currentTurn++;
+    if (u.captured != ' ') {
+        if (isWhitePiece(u.captured)) {
+            whiteCapCount++;
+        } else {
+            blackCapCount++;
         }
     }
+    return true;
 }
 
-int hasAnyLegalMove(int color) {
-    for (int r1 = 0; r1 < BOARD_SIZE; r1++) {
-        for (int c1 = 0; c1 < BOARD_SIZE; c1++) {
-            char p = board[r1][c1];
-            if (p == ' ' || isWhitePiece(p) != (color == 0)) continue;
-            for (int r2 = 0; r2 < BOARD_SIZE; r2++) {
-                for (int c2 = 0; c2 < BOARD_SIZE; c2++) {
-                    if (r1 == r2 && c1 == c2) continue;
-                    if (!isValidMove(r1, c1, r2, c2, color)) continue;
-
-                    // Tentatively make move
-                    char saveDest = board[r2][c2];
-                    board[r2][c2] = board[r1][c1];
-                    board[r1][c1] = ' ';
-                    int stillCheck = isKingInCheck(color);
-                    // Undo
-                    board[r1][c1] = board[r2][c2];
-                    board[r2][c2] = saveDest;
-
-                    if (!stillCheck) return 1;
+// Shows the position after `ply` plies, either by stepping from the current
+// ply or by restoring the nearest keyframe at or before the target, whichever
+// replays fewer moves. Both are under KEYFRAME_INTERVAL, so the cost does not
+// grow with the length of the game.
+void seekPly(int ply) {
+    if (ply < 0) ply = 0;
+    if (ply > history.count) ply = history.count;
+    if (abs(ply - history.cursor) <= ply % KEYFRAME_INTERVAL) {
+        while (history.cursor < ply) stepForward();
+        while (history.cursor > ply) stepBackward();
+        return;
+    }
+
+    int k = ply / KEYFRAME_INTERVAL;
+    if (k == 0) {
+        restorePosition(&history.start);
+        whiteCapCount = blackCapCount = 0;
+    } else {
+        const Keyframe *kf = &history.keyframes[k - 1];
+        restorePosition(&kf->pos);
+        whiteCapCount = kf->whiteCapCount;
+        blackCapCount = kf->blackCapCount;
+    }
+    history.cursor = k * KEYFRAME_INTERVAL;
+
+    // Keyframes carry no key history; the undo records do, for the plies
+    // that can still repeat.
+    int back = halfmoveClock;
+    if (back > history.cursor) back = history.cursor;
+    if (back > KEY_HISTORY_SIZE - 1) back = KEY_HISTORY_SIZE - 1;
+    for (int i = 1; i <= back; i++) {
+        keyHistory[-i & (KEY_HISTORY_SIZE - 1)] = history.undo[history.cursor - i].key;
+    }
+    keyFloor = -back;
+    while (history.cursor < ply) stepForward();
+}
+
+// -------------------------
+// PGN and SAN Handling
+// -------------------------
+
+// Writes the SAN of the legal move m in the current position into buf (at
+// least PGN_SAN_LEN bytes) and returns its length. Disambiguation looks only
+// at the other legal moves of the same piece type to the same square.
+int encodeSAN(Move m, char *buf) {
+    char piece = board[m.from_r][m.from_c];
+    int color = isWhitePiece(piece) ? 0 : 1;
+    char type = (char) toupper(piece);
+    int n = 0;
+
+    if (type == 'K' && abs(m.to_c - m.from_c) == 2) {
+        const char *castle = (m.to_c == 6) ? "O-O" : "O-O-O";
+        n = (int) strlen(castle);
+        memcpy(buf, castle, n);
+    } else {
+        bool capture = board[m.to_r][m.to_c] != ' ' || (type == 'P' && m.from_c != m.to_c);
+        if (type == 'P') {
+            if (capture) buf[n++] = (char) ('a' + m.from_c);
+        } else {
+            buf[n++] = type;
+            int origins[16];
+            int count = findPieceOrigins(type, color, m.to_r * 8 + m.to_c, origins);
+            bool clash = false, sameFile = false, sameRank = false;
+            for (int i = 0; i < count; i++) {
+                int r = origins[i] >> 3, c = origins[i] & 7;
+                if (r == m.from_r && c == m.from_c) continue;
+                if (!isMoveLegal((Move){r, c, m.to_r, m.to_c, 0}, color)) continue;
+                clash = true;
+                if (c == m.from_c) sameFile = true;
+                if (r == m.from_r) sameRank = true;
+            }
+            if (clash) {
+                if (!sameFile) {
+                    buf[n++] = (char) ('a' + m.from_c);
+                } else if (!sameRank) {
+                    buf[n++] = (char) ('8' - m.from_r);
+                } else {
+                    buf[n++] = (char) ('a' + m.from_c);
+                    buf[n++] = (char) ('8' - m.from_r);
                 }
             }
         }
+        if (capture) buf[n++] = 'x';
+        buf[n++] = (char) ('a' + m.to_c);
+        buf[n++] = (char) ('8' - m.to_r);
+        if (m.promo) {
+            buf[n++] = '=';
+            buf[n++] = m.promo;
+        }
     }
-    return 0;
-}
-
-void generateMoves(int color) {
-    moveCount = 0;
-    for (int r = 0; r < BOARD_SIZE; r++) {
-        for (int c = 0; c < BOARD_SIZE; c++) {
-            char p = board[r][c];
-            if (p == ' ' || ((isWhitePiece(p) ? 0 : 1) != color)) continue;
 
-            for (int r2 = 0; r2 < BOARD_SIZE; r2++) {
-                for (int c2 = 0; c2 < BOARD_SIZE; c2++) {
-                    if (!isValidMove(r, c, r2, c2, color)) continue;
+    Undo u;
+    makeMove(m, &u);
+    if (isKingInCheck(1 - color)) buf[n++] = hasAnyLegalMove(1 - color) ? '+' : '#';
+    unmakeMove(&u);
 
-                    // Tentatively apply
-                    char saved = board[r2][c2];
-                    board[r2][c2] = p;
-                    board[r][c] = ' ';
+    buf[n] = '\0';
+    return n;
+}
 
-                    if (!isKingInCheck(color)) {
-                        moveList[moveCount++] = (Move){r, c, r2, c2};
-                    }
+// Appends the recorded moves as SAN movetext followed by result, replaying
+// them from the start position. Lines are wrapped at 80 columns as the PGN
+// standard asks. Navigating with seekPly() keeps the repetition history of
+// the shown position intact.
+void formatPGNMovetext(TextBuffer *out, const char *result) {
+    formatAnnotatedMovetext(out, result, NULL);
+}
 
-                    // Undo
-                    board[r][c] = p;
-                    board[r2][c2] = saved;
-                }
+// As formatPGNMovetext(), with notes[i] (NAGs and comments, may be empty)
+// written after move i. Black's move number is repeated after a note.
+void formatAnnotatedMovetext(TextBuffer *out, const char *result, char (*notes)[PGN_NOTE_LEN]) {
+    int viewed = history.cursor;
+    seekPly(0);
+
+    int column = 0;
+    bool noted = false;
+    for (int i = 0; i <= history.count; i++) {
+        char item[PGN_SAN_LEN + PGN_NOTE_LEN + 16];
+        int n = 0;
+        if (i == history.count) {
+            n = sprintf(item, "%s", result);
+        } else {
+            Move m = unpackMove(history.moves[i]);
+            if (currentTurn % 2 == 0) {
+                n = sprintf(item, "%d. ", currentTurn / 2 + 1);
+            } else if (i == 0 || noted) {
+                n = sprintf(item, "%d... ", currentTurn / 2 + 1);
             }
+            n += encodeSAN(m, item + n);
+            noted = notes && notes[i][0];
+            if (noted) n += sprintf(item + n, " %s", notes[i]);
+            stepForward();
+        }
+
+        if (column > 0 && column + 1 + n > 80) {
+            textAppend(out, "\n", 1);
+            column = 0;
+        } else if (column > 0) {
+            textAppend(out, " ", 1);
+            column++;
         }
+        textAppend(out, item, n);
+        column += n;
     }
+    textAppend(out, "\n", 1);
+
+    seekPly(viewed);
 }
 
-void movePieceStoringLog(const char *mv) {
-    int c1 = tolower(mv[0]) - 'a';
-    int r1 = '8' - mv[1];
-    int c2 = tolower(mv[2]) - 'a';
-    int r2 = '8' - mv[3];
+static const char *gameResultString() {
+    int color = currentTurn % 2;
+    if (hasAnyLegalMove(color)) return drawReason() ? "1/2-1/2" : "*";
+    if (!isKingInCheck(color)) return "1/2-1/2";
+    return (color == 0) ? "0-1" : "1-0";
+}
 
-    if (!isValidMove(r1, c1, r2, c2, currentTurn)) {
-        printf("Invalid move: %s\n", mv);
+void savePGN(const char *filename) {
+    Uint64 zone = traceBegin();
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        printf("Could not save PGN file\n");
         return;
     }
 
-    char captured = board[r2][c2];
-    char mover = board[r1][c1];
+    int viewed = history.cursor;
+    seekPly(history.count);
+    const char *result = gameResultString();
+    seekPly(viewed);
+    fprintf(f, "[Event \"Casual Game\"]\n");
+    fprintf(f, "[Site \"Local\"]\n");
+    fprintf(f, "[Date \"2025.06.04\"]\n");
+    fprintf(f, "[Round \"1\"]\n");
+    fprintf(f, "[White \"Player1\"]\n");
+    fprintf(f, "[Black \"Player2\"]\n");
+    fprintf(f, "[Result \"%s\"]\n", result);
+
+    // Games that do not start from the initial position carry it as FEN
+    char fen[FEN_MAX_LEN];
+    seekPly(0);
+    writeFEN(fen);
+    seekPly(viewed);
+    if (strcmp(fen, START_FEN) != 0) fprintf(f, "[SetUp \"1\"]\n[FEN \"%s\"]\n", fen);
+    fprintf(f, "\n");
+
+    TextBuffer movetext = {0};
+    formatPGNMovetext(&movetext, result);
+    fwrite(movetext.data, 1, movetext.len, f);
+    freeTextBuffer(&movetext);
+    fclose(f);
+    traceEnd(zone, "savePGN");
+    printf("PGN saved to %s\n", filename);
+}
 
-    // En passant capture logic
-    if (tolower(mover) == 'p' && board[r2][c2] == ' ' && c1 != c2) {
-        if (isWhitePiece(board[r1][c1])) {
-            captured = board[r2 + 1][c2];
-            board[r2 + 1][c2] = ' ';
-        } else {
-            captured = board[r2 - 1][c2];
-            board[r2 - 1][c2] = ' ';
-        }
-    } else {
-        captured = board[r2][c2];
+const char *sanErrorString(SANError err) {
+    switch (err) {
+        case SAN_OK: return "ok";
+        case SAN_BAD_SYNTAX: return "malformed move";
+        case SAN_NO_PIECE: return "no piece can make this move";
+        case SAN_AMBIGUOUS: return "ambiguous move";
+        case SAN_ILLEGAL: return "move leaves the king in check";
+        case SAN_BAD_PROMOTION: return "invalid promotion";
     }
+    return "unknown error";
+}
 
-    // Make the move
-    board[r2][c2] = mover;
-    board[r1][c1] = ' ';
-
-    // Reset en passant target
-    enPassantRow = -1;
-    enPassantCol = -1;
-
-    // If pawn moved two squares, set en passant square
-    if (tolower(mover) == 'p' && abs(r2 - r1) == 2) {
-        enPassantRow = (r1 + r2) / 2;
-        enPassantCol = c1;
-    }
+static SANError decodeCastling(bool queenSide, int color, Move *out) {
+    int row = (color == 0) ? 7 : 0;
+    char king = (color == 0) ? 'K' : 'k';
+    char rook = (color == 0) ? 'R' : 'r';
+    Move m = {row, 4, row, queenSide ? 2 : 6, 0};
 
-    // Pawn promotion
-    if ((mover == 'P' && r2 == 0) || (mover == 'p' && r2 == 7)) {
-        awaitingPromotion = true;
-        promoRow = r2;
-        promoCol = c2;
-        promoColor = isWhitePiece(mover) ? 'w' : 'b';
-        return; // pause for promotion
+    if (board[row][4] != king || board[row][queenSide ? 0 : 7] != rook ||
+        !isValidMove(row, 4, m.to_r, m.to_c, color)) {
+        return SAN_NO_PIECE;
     }
+    if (!isCastlingSafe(row, m.to_c, color)) return SAN_ILLEGAL;
+    *out = m;
+    return SAN_OK;
+}
 
-    // Castling logic
-    if (tolower(mover) == 'k' && abs(c2 - c1) == 2) {
-        if (mover == 'K') {
-            if (c2 == 6) {
-                // White kingside
-                board[7][5] = board[7][7];
-                board[7][7] = ' ';
-            } else if (c2 == 2) {
-                // White queenside
-                board[7][3] = board[7][0];
-                board[7][0] = ' ';
-            }
-        } else {
-            if (c2 == 6) {
-                // Black kingside
-                board[0][5] = board[0][7];
-                board[0][7] = ' ';
-            } else if (c2 == 2) {
-                // Black queenside
-                board[0][3] = board[0][0];
-                board[0][0] = ' ';
+// Collects the squares holding a piece of `type` (upper case, not a pawn) of
+// side `color` that attack square tsq, by walking the attack tables backwards
+// from the target. Pins are not considered. Returns the count (at most 16).
+int findPieceOrigins(char type, int color, int tsq, int *out) {
+    char own = (color == 0) ? type : (char) tolower(type);
+    int n = 0;
+    if (type == 'N') {
+        for (int k = 0; k < knightTargetCount[tsq]; k++) {
+            if (SQ_PIECE(knightTargets[tsq][k]) == own) out[n++] = knightTargets[tsq][k];
+        }
+    } else if (type == 'K') {
+        for (int k = 0; k < kingTargetCount[tsq]; k++) {
+            if (SQ_PIECE(kingTargets[tsq][k]) == own) out[n++] = kingTargets[tsq][k];
+        }
+    } else {
+        int d0 = (type == 'B') ? 4 : 0;
+        int d1 = (type == 'R') ? 4 : 8;
+        for (int d = d0; d < d1; d++) {
+            for (int k = 0; k < rayLength[tsq][d]; k++) {
+                char p = SQ_PIECE(rays[tsq][d][k]);
+                if (p == ' ') continue;
+                if (p == own) out[n++] = rays[tsq][d][k];
+                break;
             }
         }
     }
+    return n;
+}
 
-    int moverColor = isWhitePiece(mover) ? 0 : 1;
-    if (isKingInCheck(moverColor)) {
-        // Undo move if leaves king in check
-        board[r1][c1] = mover;
-        board[r2][c2] = captured;
-        printf("You cannot leave your king in check! Move undone.\n");
-        return;
+// Decodes a SAN token for the side `color` in the current position. Candidate
+// origins are found by looking backwards from the destination square through
+// the attack tables rather than by trying every piece on the board.
+SANError decodeSAN(const char *san, int color, Move *out) {
+    char buf[16];
+    int len = 0;
+    for (const char *p = san; *p && *p != '+' && *p != '#' && *p != '!' && *p != '?'; p++) {
+        if (len == (int) sizeof(buf) - 1) return SAN_BAD_SYNTAX;
+        buf[len++] = *p;
     }
+    buf[len] = '\0';
 
-    // Store captured piece
-    if (captured != ' ') {
-        if (isWhitePiece(captured)) {
-            whiteCaptured[whiteCapCount++] = captured;
-        } else {
-            blackCaptured[blackCapCount++] = captured;
-        }
+    if (strcmp(buf, "O-O") == 0 || strcmp(buf, "0-0") == 0) return decodeCastling(false, color, out);
+    if (strcmp(buf, "O-O-O") == 0 || strcmp(buf, "0-0-0") == 0) return decodeCastling(true, color, out);
+    if (len < 2) return SAN_BAD_SYNTAX;
+
+    // Promotion: "e8=Q" or "e8Q"
+    char promo = 0;
+    if (len >= 3 && strchr("QRBN", buf[len - 1]) && (buf[len - 2] == '=' || isdigit((unsigned char) buf[len - 2]))) {
+        promo = buf[len - 1];
+        len -= (buf[len - 2] == '=') ? 2 : 1;
     }
+    if (len < 2) return SAN_BAD_SYNTAX;
 
-    bool inCheck = isKingInCheck(currentTurn % 2);
-    bool noLegalNext = !hasAnyLegalMove(currentTurn % 2);
-    logMoveToPGN(mv, mover, captured != ' ', inCheck, noLegalNext);
-    currentTurn++;
+    char file = buf[len - 2], rank = buf[len - 1];
+    if (file < 'a' || file > 'h' || rank < '1' || rank > '8') return SAN_BAD_SYNTAX;
+    int tr = '8' - rank, tc = file - 'a';
 
-    // Update castling rights
-    if (mover == 'K') whiteKingMoved = true;
-    if (mover == 'R') {
-        if (r1 == 7 && c1 == 0) whiteQueensideRookMoved = true;
-        if (r1 == 7 && c1 == 7) whiteKingsideRookMoved = true;
-    }
-    if (mover == 'k') blackKingMoved = true;
-    if (mover == 'r') {
-        if (r1 == 0 && c1 == 0) blackQueensideRookMoved = true;
-        if (r1 == 0 && c1 == 7) blackKingsideRookMoved = true;
+    char type = 'P';
+    int i = 0;
+    if (strchr("KQRBN", buf[0])) {
+        type = buf[0];
+        i = 1;
     }
 
-    int nextColor = currentTurn % 2;
-    bool inChk = isKingInCheck(nextColor);
-    bool canMv = hasAnyLegalMove(nextColor);
-    if (!canMv) {
-        if (inChk) {
-            printf("Checkmate! %s wins!\n", moverColor == 0 ? "White" : "Black");
-        } else {
-            printf("Stalemate! It's a draw.\n");
-        }
-        SDL_Delay(500);
-        exit(0);
+    // Disambiguation and capture marker, in that order
+    int fromR = -1, fromC = -1;
+    bool capture = false;
+    for (; i < len - 2; i++) {
+        char ch = buf[i];
+        if (ch >= 'a' && ch <= 'h' && fromC < 0 && fromR < 0 && !capture) fromC = ch - 'a';
+        else if (ch >= '1' && ch <= '8' && fromR < 0 && !capture) fromR = '8' - ch;
+        else if ((ch == 'x' || ch == ':') && !capture) capture = true;
+        else return SAN_BAD_SYNTAX;
     }
 
-    if (inChk) {
-        printf("Check!\n");
+    bool lastRank = (tr == (color == 0 ? 0 : 7));
+    if ((promo && (type != 'P' || !lastRank)) || (type == 'P' && lastRank && !promo)) {
+        return SAN_BAD_PROMOTION;
     }
-}
 
-// -------------------------
-// Evaluation and Engine
-// -------------------------
+    char target = board[tr][tc];
+    if (target != ' ' && isWhitePiece(target) == (color == 0)) return SAN_NO_PIECE;
 
-int evaluateStatic() {
-    int sc = 0;
-    for (int r = 0; r < BOARD_SIZE; r++) {
-        for (int c = 0; c < BOARD_SIZE; c++) {
-            char p = board[r][c];
-            if (!p || p == ' ') continue;
-            sc += VALS[(int) p];
-            if (tolower(p) == 'p') {
-                if (isWhitePiece(p)) {
-                    sc += PST_PAWN[r][c];
-                } else {
-                    sc -= PST_PAWN[7 - r][c];
+    char own = (color == 0) ? type : (char) tolower(type);
+    int tsq = tr * 8 + tc;
+    int cand[16];
+    int n = 0;
+
+    switch (type) {
+        case 'N':
+        case 'K':
+        case 'R':
+        case 'B':
+        case 'Q':
+            n = findPieceOrigins(type, color, tsq, cand);
+            break;
+        default: {
+            // Pawns stand one row behind the target from the mover's point of view
+            int back = (color == 0) ? 1 : -1;
+            int r1 = tr + back;
+            if (r1 < 0 || r1 >= BOARD_SIZE) break;
+            if (fromC < 0 || fromC == tc) {
+                if (target != ' ') break;
+                if (board[r1][tc] == own) {
+                    cand[n++] = r1 * 8 + tc;
+                } else if (board[r1][tc] == ' ' && tr == (color == 0 ? 4 : 3) && board[r1 + back][tc] == own) {
+                    cand[n++] = (r1 + back) * 8 + tc;
                 }
+            } else if (abs(fromC - tc) == 1 && board[r1][fromC] == own &&
+                       (target != ' ' || (tr == enPassantRow && tc == enPassantCol))) {
+                cand[n++] = r1 * 8 + fromC;
             }
+            break;
         }
     }
-    return sc;
-}
-
-int evaluateDynamic(int color) {
-    int mob = 0;
-    int center = 0;
-    generateMoves(color);
-    mob = moveCount;
 
-    const int centers[4][2] = {{3, 3}, {3, 4}, {4, 3}, {4, 4}};
-    for (int i = 0; i < 4; i++) {
-        char p = board[centers[i][0]][centers[i][1]];
-        if (p != ' ' && ((isWhitePiece(p) ? 0 : 1) == color)) {
-            center++;
+    int candidates = 0, legal = 0;
+    Move found = {0};
+    for (int k = 0; k < n; k++) {
+        int r = cand[k] >> 3, c = cand[k] & 7;
+        if ((fromR >= 0 && r != fromR) || (fromC >= 0 && c != fromC && type != 'P')) continue;
+        candidates++;
+        Move m = {r, c, tr, tc, promo};
+        if (isMoveLegal(m, color)) {
+            legal++;
+            found = m;
         }
     }
-    return mob * 10 + center * 25;
-}
 
-int alphabeta(int depth, int alpha, int beta, int color) {
-    int opp = 1 - color;
+    if (candidates == 0) return SAN_NO_PIECE;
+    if (legal == 0) return SAN_ILLEGAL;
+    if (legal > 1) return SAN_AMBIGUOUS;
+    *out = found;
+    return SAN_OK;
+}
 
-    if (depth == 0) {
-        int stat = evaluateStatic();
-        int dyn = evaluateDynamic(color) - evaluateDynamic(opp);
-        return stat + dyn;
+// Applies a legal move to the game: board, captured-piece lists, move history
+// and turn counter, without journaling. Unlike movePieceStoringLog() it does
+// not re-validate.
+void applyMove(Move m) {
+    Undo u;
+    makeMove(m, &u);
+    if (u.captured != ' ') {
+        if (isWhitePiece(u.captured)) {
+            whiteCaptured[whiteCapCount++] = u.captured;
+        } else {
+            blackCaptured[blackCapCount++] = u.captured;
+        }
     }
+    currentTurn++;
+    recordMove(&u);
+}
 
-    generateMoves(color);
-    if (moveCount == 0) {
-        if (isKingInCheck(color)) return -100000 + (8 - depth);
-        return 0; // stalemate
+void playMove(Move m) {
+    // Playing the recorded next move while reviewing just steps forward
+    if (history.cursor < history.count && history.moves[history.cursor] == packMove(m)) {
+        stepForward();
+        return;
     }
-
-    for (int i = 0; i < moveCount; i++) {
-        Move m = moveList[i];
-        char movingPiece = board[m.from_r][m.from_c];
-        char captured = board[m.to_r][m.to_c];
-
-        // Make move
-        board[m.to_r][m.to_c] = movingPiece;
-        board[m.from_r][m.from_c] = ' ';
-
-        // Skip if leaves king in check
-        if (isKingInCheck(color)) {
-            board[m.from_r][m.from_c] = movingPiece;
-            board[m.to_r][m.to_c] = captured;
-            continue;
+    bool branched = history.cursor < history.count;
+    applyMove(m);
+    if (journal.file) {
+        // The journal is append-only: a new line from an earlier ply restarts it
+        if (branched) {
+            startJournal();
+        } else {
+            journalMove(m);
         }
+    }
+}
 
-        int val = -alphabeta(depth - 1, -beta, -alpha, opp);
-
-        // Undo
-        board[m.from_r][m.from_c] = movingPiece;
-        board[m.to_r][m.to_c] = captured;
+// Plays the SAN move for the side to move. Nothing is printed; callers
+// report the error as suits them (worker threads must stay quiet).
+SANError applySANMove(const char *san) {
+    Move m;
+    SANError err = decodeSAN(san, currentTurn % 2, &m);
+    if (err == SAN_OK) playMove(m);
+    return err;
+}
 
-        if (val >= beta) return beta;
-        if (val > alpha) alpha = val;
+static bool playFirstPGNGame(const PGNGame *game, void *ctx) {
+    if (!setupPGNStart(game)) return false;
+    for (int i = 0; i < game->plyCount; i++) {
+        SANError err = applySANMove(game->san[i]);
+        if (err != SAN_OK) {
+            printf("SAN parser failed for move %s: %s\n", game->san[i], sanErrorString(err));
+            break;
+        }
     }
+    return false; // only the first game
+}
 
-    return alpha;
+void playPGNFile(const char *filename) {
+    Uint64 zone = traceBegin();
+    resetGameState();
+    long games = parsePGNFile(filename, playFirstPGNGame, NULL);
+    traceEnd(zone, "playPGNFile");
+    if (games < 0) {
+        printf("Could not open PGN file: %s\n", filename);
+        return;
+    }
+    currentState = CHESS_BOARD;
 }
 
-Move findBestMove(int depth, int color, int *outScore) {
-    Move best = {0, 0, 0, 0};
-    int alpha = -1000000;
+static bool pgnRefill(PGNReader *r) {
+    if (!r->file) return false;
+    size_t n = fread(r->buf, 1, sizeof(r->buf), r->file);
+    r->p = r->buf;
+    r->end = r->buf + n;
+    r->bytes += n;
+    return n > 0;
+}
 
-    generateMoves(color);
+static inline int pgnPeek(PGNReader *r) {
+    if (r->p == r->end && !pgnRefill(r)) return EOF;
+    return (unsigned char) *r->p;
+}
 
-    for (int i = 0; i < moveCount; i++) {
-        Move m = moveList[i];
-        char movingPiece = board[m.from_r][m.from_c];
-        char saved = board[m.to_r][m.to_c];
+static inline int pgnGetc(PGNReader *r) {
+    if (r->p == r->end && !pgnRefill(r)) return EOF;
+    return (unsigned char) *r->p++;
+}
 
-        // Make move
-        board[m.to_r][m.to_c] = movingPiece;
-        board[m.from_r][m.from_c] = ' ';
+// Skips up to and including the next `stop` character, a buffer at a time.
+static void pgnSkipPast(PGNReader *r, char stop) {
+    for (;;) {
+        if (r->p == r->end && !pgnRefill(r)) return;
+        const char *hit = memchr(r->p, stop, r->end - r->p);
+        if (hit) {
+            r->p = hit + 1;
+            return;
+        }
+        r->p = r->end;
+    }
+}
 
-        int sc = -alphabeta(depth - 1, -1000000, 1000000, 1 - color);
+// Character classes for the tokenizer (avoids locale-dependent isspace()).
+enum { PGN_SPACE = 1, PGN_DELIM = 2 };
 
-        // Undo
-        board[m.from_r][m.from_c] = movingPiece;
-        board[m.to_r][m.to_c] = saved;
+static const unsigned char PGN_CLASS[256] = {
+    [' '] = PGN_SPACE | PGN_DELIM, ['\t'] = PGN_SPACE | PGN_DELIM, ['\n'] = PGN_SPACE | PGN_DELIM,
+    ['\r'] = PGN_SPACE | PGN_DELIM, ['\v'] = PGN_SPACE | PGN_DELIM, ['\f'] = PGN_SPACE | PGN_DELIM,
+    ['{'] = PGN_DELIM, ['}'] = PGN_DELIM, ['('] = PGN_DELIM, [')'] = PGN_DELIM,
+    ['['] = PGN_DELIM, [']'] = PGN_DELIM, [';'] = PGN_DELIM, ['$'] = PGN_DELIM
+};
 
-        if (sc > alpha) {
-            alpha = sc;
-            best = m;
-        }
-    }
+static bool isPGNResult(const char *tok) {
+    return strcmp(tok, "*") == 0 || strcmp(tok, "1-0") == 0 ||
+           strcmp(tok, "0-1") == 0 || strcmp(tok, "1/2-1/2") == 0;
+}
 
-    *outScore = alpha;
-    return best;
+static void resetPGNGame(PGNGame *game) {
+    game->tagCount = 0;
+    game->plyCount = 0;
+    game->result[0] = '\0';
+    game->commentCount = 0;
+    game->variationCount = 0;
+    game->truncated = false;
 }
 
-void engineMove(int depth) {
-    int score;
-    Move m = findBestMove(depth, currentTurn % 2, &score);
+// Reads a tag pair after its opening '['. The tag is first copied out of the
+// read buffer up to its closing ']' (outside quotes) or end of line, then
+// split into name and value. Handles \" and \\ escapes.
+static void parsePGNTag(PGNReader *r, PGNGame *game) {
+    char line[256];
+    int len = 0;
+    bool quoted = false, escaped = false;
+    for (;;) {
+        if (r->p == r->end && !pgnRefill(r)) break;
+        char c = *r->p++;
+        if (c == '\n' || (c == ']' && !quoted)) break;
+        if (escaped) escaped = false;
+        else if (c == '\\') escaped = true;
+        else if (c == '"') quoted = !quoted;
+        if (len < (int) sizeof(line) - 1) line[len++] = c;
+    }
+    line[len] = '\0';
 
-    generateMoves(currentTurn % 2);
-    if (moveCount == 0) {
-        int col = currentTurn % 2;
-        if (isKingInCheck(col)) {
-            printf("Checkmate! %s wins!\n", (col == 0) ? "Black" : "White");
-        } else {
-            printf("Stalemate! It's a draw.\n");
+    if (game->tagCount >= PGN_MAX_TAGS) {
+        game->truncated = true;
+        return;
+    }
+    PGNTag *tag = &game->tags[game->tagCount];
+    const char *p = line;
+    int n = 0;
+    while (*p == ' ' || *p == '\t') p++;
+    while (isalnum((unsigned char) *p) || *p == '_') {
+        if (n < (int) sizeof(tag->name) - 1) tag->name[n++] = *p;
+        p++;
+    }
+    tag->name[n] = '\0';
+    if (n == 0) return;
+
+    n = 0;
+    p = strchr(p, '"');
+    if (p) {
+        for (p++; *p && *p != '"'; p++) {
+            if (*p == '\\' && p[1]) p++;
+            if (n < (int) sizeof(tag->value) - 1) tag->value[n++] = *p;
         }
-        SDL_Delay(500);
-        exit(0);
     }
+    tag->value[n] = '\0';
+    game->tagCount++;
+}
 
-    char mv[6] = {
-        (char) ('a' + m.from_c),
-        (char) ('8' - m.from_r),
-        (char) ('a' + m.to_c),
-        (char) ('8' - m.to_r),
-        '\0'
-    };
+// Adds one movetext symbol to the game. Returns true when it was the result
+// token that ends the game.
+static bool addPGNSymbol(PGNGame *game, char *tok, int depth) {
+    if (isPGNResult(tok)) {
+        if (depth > 0) return false;
+        snprintf(game->result, sizeof(game->result), "%s", tok);
+        return true;
+    }
 
-    char captured = board[m.to_r][m.to_c];
-    if (captured != ' ') {
-        if (isWhitePiece(captured)) {
-            whiteCaptured[whiteCapCount++] = captured;
+    char *san = tok;
+    if (isdigit((unsigned char) tok[0])) {
+        if (strncmp(tok, "0-0", 3) == 0) {
+            // Castling written with zeros
+            for (char *q = tok; *q; q++) {
+                if (*q == '0') *q = 'O';
+            }
         } else {
-            blackCaptured[blackCapCount++] = captured;
+            // Move number: "12." / "12..." or glued as in "12.e4"
+            while (isdigit((unsigned char) *san)) san++;
+            while (*san == '.') san++;
+            if (!*san) return false;
         }
     }
 
-    board[m.to_r][m.to_c] = board[m.from_r][m.from_c];
-    board[m.from_r][m.from_c] = ' ';
-
-    bool inCheck = isKingInCheck(currentTurn % 2);
-    bool noLegalNext = !hasAnyLegalMove(currentTurn % 2);
-    logMoveToPGN(mv, board[m.to_r][m.to_c], captured != ' ', inCheck, noLegalNext);
-
-    currentTurn++;
+    // Suffix annotations ("!", "?!", ...) are not part of the move
+    size_t len = strlen(san);
+    while (len > 0 && (san[len - 1] == '!' || san[len - 1] == '?')) san[--len] = '\0';
+    if (len == 0 || depth > 0) return false;
 
-    // Force redraw of board and back button
-    SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255);
-    SDL_RenderClear(renderer);
-    renderBoardWithBack();
-    SDL_RenderPresent(renderer);
-    SDL_Delay(200);
+    if (game->plyCount < PGN_MAX_PLIES && len < PGN_SAN_LEN) {
+        memcpy(game->san[game->plyCount++], san, len + 1);
+    } else {
+        game->truncated = true;
+    }
+    return false;
+}
 
-    int nxtColor = currentTurn % 2;
-    bool inChk = isKingInCheck(nxtColor);
-    bool canMv = hasAnyLegalMove(nxtColor);
+// Streams games out of a reader in constant memory, calling onGame once per
+// game. Returns the number of games delivered.
+long parsePGN(PGNReader *r, PGNGameCallback onGame, void *ctx) {
+    PGNGame *game = malloc(sizeof(PGNGame));
+    if (!game) return 0;
+    resetPGNGame(game);
+
+    long games = 0;
+    bool inMovetext = false;
+    bool lineStart = true;
+    bool stop = false;
+    int depth = 0;
+    char tok[64];
+    int c;
+
+    while (!stop) {
+        // Skip whitespace straight through the buffer
+        while (r->p < r->end && (PGN_CLASS[(unsigned char) *r->p] & PGN_SPACE)) {
+            lineStart = (*r->p++ == '\n');
+        }
+        if ((c = pgnGetc(r)) == EOF) break;
+        if (PGN_CLASS[c] & PGN_SPACE) {
+            lineStart = (c == '\n');
+            continue;
+        }
+        bool atLineStart = lineStart;
+        lineStart = false;
+
+        bool gameOver = false;
+        switch (c) {
+            case '%': // escape line
+            case ';': // rest-of-line comment
+                if (c == ';') game->commentCount++;
+                if (c == ';' || atLineStart) {
+                    pgnSkipPast(r, '\n');
+                    lineStart = true;
+                }
+                break;
+            case '{':
+                game->commentCount++;
+                pgnSkipPast(r, '}');
+                break;
+            case '(':
+                depth++;
+                game->variationCount++;
+                break;
+            case ')':
+                if (depth > 0) depth--;
+                break;
+            case '[':
+                if (inMovetext) {
+                    // New tag section without a result token: close the previous game
+                    gameOver = true;
+                    r->p--;
+                    break;
+                }
+                parsePGNTag(r, game);
+                break;
+            case '$':
+                while ((c = pgnPeek(r)) != EOF && isdigit(c)) pgnGetc(r);
+                break;
+            case ']':
+            case '}':
+                break;
+            default: {
+                int n = 0;
+                tok[n++] = (char) c;
+                for (;;) {
+                    // Scan straight through the buffer; refill only at its end
+                    const char *q = r->p;
+                    while (q < r->end && !(PGN_CLASS[(unsigned char) *q] & PGN_DELIM)) {
+                        if (n < (int) sizeof(tok) - 1) tok[n++] = *q;
+                        q++;
+                    }
+                    r->p = q;
+                    if (q < r->end || !pgnRefill(r)) break;
+                }
+                tok[n] = '\0';
+                inMovetext = true;
+                gameOver = addPGNSymbol(game, tok, depth);
+                break;
+            }
+        }
 
-    if (!canMv) {
-        if (inChk) {
-            printf("Checkmate! %s wins!\n", (nxtColor == 0) ? "Black" : "White");
-        } else {
-            printf("Stalemate! It's a draw.\n");
+        if (gameOver) {
+            game->number = ++games;
+            stop = !onGame(game, ctx);
+            resetPGNGame(game);
+            inMovetext = false;
+            depth = 0;
         }
-        SDL_Delay(200);
-        exit(0);
     }
 
-    if (inChk) {
-        printf("Check!\n");
+    if (!stop && (inMovetext || game->tagCount > 0)) {
+        game->number = ++games;
+        onGame(game, ctx);
     }
-
-    // Clear any old selection
-    pieceSelected = false;
-    memset(validMoves, 0, sizeof(validMoves));
+    free(game);
+    return games;
 }
 
-// -------------------------
-// Rendering / UI
-// -------------------------
-
-void drawTextWithFont(const char *text, SDL_Rect rect, TTF_Font *fontToUse) {
-    SDL_Color color = {0, 0, 0, 255};
-    SDL_Surface *surface = TTF_RenderText_Blended(fontToUse, text, color);
-    if (!surface) return;
-    SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_FreeSurface(surface);
-    if (!tex) return;
-
-    int texW = 0, texH = 0;
-    SDL_QueryTexture(tex, NULL, NULL, &texW, &texH);
+// Returns the number of games parsed, or -1 if the file cannot be opened.
+long parsePGNFile(const char *filename, PGNGameCallback onGame, void *ctx) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return -1;
+    PGNReader *r = malloc(sizeof(PGNReader));
+    if (!r) {
+        fclose(f);
+        return -1;
+    }
+    r->file = f;
+    r->p = r->end = r->buf;
+    r->bytes = 0;
+    long games = parsePGN(r, onGame, ctx);
+    free(r);
+    fclose(f);
+    return games;
+}
 
-    SDL_Rect dst = {
-        rect.x + (rect.w - texW) / 2,
-        rect.y + (rect.h - texH) / 2,
-        texW, texH
-    };
-    SDL_RenderCopy(renderer, tex, NULL, &dst);
-    SDL_DestroyTexture(tex);
+long parsePGNBuffer(const char *data, size_t len, PGNGameCallback onGame, void *ctx) {
+    PGNReader r;
+    r.file = NULL;
+    r.p = data;
+    r.end = data + len;
+    r.bytes = (long long) len;
+    return parsePGN(&r, onGame, ctx);
 }
 
-void drawText(const char *text, SDL_Rect rect) {
-    drawTextWithFont(text, rect, font);
+const char *getPGNTag(const PGNGame *game, const char *name) {
+    for (int i = 0; i < game->tagCount; i++) {
+        if (strcmp(game->tags[i].name, name) == 0) return game->tags[i].value;
+    }
+    return NULL;
 }
 
-void drawButton(SDL_Rect rect, const char *text) {
-    // Pinkish fill
-    SDL_SetRenderDrawColor(renderer, 230, 168, 175, 255);
-    SDL_RenderFillRect(renderer, &rect);
+// Copies only the used part of a game record (tags and plies).
+void copyPGNGame(PGNGame *dst, const PGNGame *src) {
+    dst->number = src->number;
+    dst->tagCount = src->tagCount;
+    memcpy(dst->tags, src->tags, src->tagCount * sizeof(PGNTag));
+    dst->plyCount = src->plyCount;
+    memcpy(dst->san, src->san, src->plyCount * sizeof(src->san[0]));
+    memcpy(dst->result, src->result, sizeof(dst->result));
+    dst->commentCount = src->commentCount;
+    dst->variationCount = src->variationCount;
+    dst->truncated = src->truncated;
+}
 
-    // Border
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderDrawRect(renderer, &rect);
+// Sets up the game's starting position: its FEN tag if present, otherwise
+// the standard one.
+bool setupPGNStart(const PGNGame *game) {
+    const char *fen = getPGNTag(game, "FEN");
+    if (fen) return loadFEN(fen);
+    resetGameState();
+    return true;
+}
 
-    // Text
-    drawText(text, rect);
+// Replays a game's mainline from its starting position, stopping after maxPly
+// plies (maxPly < 0 = whole game). onPly, if given, is called after every
+// applied ply. Returns the number of plies applied, or -1 on an illegal move
+// or bad FEN tag.
+int replayPGNGame(const PGNGame *game, int maxPly, void (*onPly)(int ply, void *ctx), void *ctx) {
+    if (!setupPGNStart(game)) return -1;
+    int plies = game->plyCount;
+    if (maxPly >= 0 && maxPly < plies) plies = maxPly;
+    for (int i = 0; i < plies; i++) {
+        if (applySANMove(game->san[i]) != SAN_OK) return -1;
+        if (onPly) onPly(i + 1, ctx);
+    }
+    return plies;
 }
 
-void renderMainMenu() {
-    SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255); // Light pink
-    SDL_RenderClear(renderer);
+// Starts up to count threads running fn(data), stopping at the first one
+// that cannot be created. Returns how many run: callers carry on with fewer
+// workers, or give up when there are none.
+int startWorkers(SDL_Thread **threads, int count, SDL_ThreadFunction fn, const char *name, void *data) {
+    int started = 0;
+    while (started < count && (threads[started] = SDL_CreateThread(fn, name, data)) != NULL) started++;
+    if (started < count) fprintf(stderr, "Started %d of %d %s threads: %s\n", started, count, name, SDL_GetError());
+    return started;
+}
 
-    drawButton(playButton, "Play Human");
-    drawButton(botButton, "Play with Bot");
-    drawButton(pgnButton, "Play again");
+bool initPGNGameQueue(PGNGameQueue *q, int capacity) {
+    q->slots = malloc(capacity * sizeof(PGNGame));
+    q->capacity = capacity;
+    q->head = q->count = 0;
+    q->closed = false;
+    q->lock = SDL_CreateMutex();
+    q->notEmpty = SDL_CreateCond();
+    q->notFull = SDL_CreateCond();
+    return q->slots && q->lock && q->notEmpty && q->notFull;
+}
 
-    SDL_RenderPresent(renderer);
+void destroyPGNGameQueue(PGNGameQueue *q) {
+    free(q->slots);
+    SDL_DestroyMutex(q->lock);
+    SDL_DestroyCond(q->notEmpty);
+    SDL_DestroyCond(q->notFull);
 }
 
-void getPiecePath(char piece, char *outPath) {
-    if (piece == ' ') {
-        outPath[0] = '\0';
-        return;
+// PGNGameCallback that blocks while the queue is full.
+bool pushPGNGame(const PGNGame *game, void *queue) {
+    PGNGameQueue *q = queue;
+    SDL_LockMutex(q->lock);
+    while (q->count == q->capacity && !q->closed) SDL_CondWait(q->notFull, q->lock);
+    bool open = !q->closed;
+    if (open) {
+        copyPGNGame(&q->slots[(q->head + q->count) % q->capacity], game);
+        q->count++;
+        SDL_CondSignal(q->notEmpty);
     }
-    const char *color = isupper(piece) ? "white" : "black";
-    char type = tolower(piece);
-    const char *name;
+    SDL_UnlockMutex(q->lock);
+    return open;
+}
 
-    switch (type) {
-        case 'p': name = "pawn";
-            break;
-        case 'r': name = "rook";
-            break;
-        case 'n': name = "knight";
-            break;
-        case 'b': name = "bishop";
-            break;
-        case 'q': name = "queen";
-            break;
-        case 'k': name = "king";
-            break;
-        default: name = "unknown";
-            break;
+// Returns false once the queue is closed and drained.
+bool popPGNGame(PGNGameQueue *q, PGNGame *out) {
+    SDL_LockMutex(q->lock);
+    while (q->count == 0 && !q->closed) SDL_CondWait(q->notEmpty, q->lock);
+    bool got = q->count > 0;
+    if (got) {
+        copyPGNGame(out, &q->slots[q->head]);
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        SDL_CondSignal(q->notFull);
     }
-    sprintf(outPath, "%s/%s_%s.png", imageBasePath, color, name);
+    SDL_UnlockMutex(q->lock);
+    return got;
 }
 
-void renderBoard() {
-    for (int row = 0; row < BOARD_SIZE; row++) {
-        for (int col = 0; col < BOARD_SIZE; col++) {
-            SDL_Rect tile = {col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE};
-            bool light = ((row + col) % 2 == 0);
+void closePGNGameQueue(PGNGameQueue *q) {
+    SDL_LockMutex(q->lock);
+    q->closed = true;
+    SDL_CondBroadcast(q->notEmpty);
+    SDL_CondBroadcast(q->notFull);
+    SDL_UnlockMutex(q->lock);
+}
 
-            if (light) {
-                SDL_SetRenderDrawColor(renderer, 240, 217, 181, 255);
-            } else {
-                SDL_SetRenderDrawColor(renderer, 181, 136, 99, 255);
-            }
-            SDL_RenderFillRect(renderer, &tile);
+// -------------------------
+// Valid Moves / Move Generation
+// -------------------------
 
-            // Highlight valid‐move squares
-            if (validMoves[row][col]) {
-                SDL_SetRenderDrawColor(renderer, 102, 240, 102, 100);
-                SDL_RenderFillRect(renderer, &tile);
-            }
+int isWhitePiece(char piece) {
+    return (piece != ' ' && isupper(piece));
+}
 
-            // Highlight selected square
-            if (pieceSelected && row == selectedRow && col == selectedCol) {
-                SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-                SDL_RenderDrawRect(renderer, &tile);
-            }
+int isPathClear(int r1, int c1, int r2, int c2) {
+    int dr = (r2 > r1) ? 1 : (r2 < r1) ? -1 : 0;
+    int dc = (c2 > c1) ? 1 : (c2 < c1) ? -1 : 0;
+    int r = r1 + dr, c = c1 + dc;
+    while (r != r2 || c != c2) {
+        if (board[r][c] != ' ') return 0;
+        r += dr;
+        c += dc;
+    }
+    return 1;
+}
 
-            // Draw piece if any
-            char piece = board[row][col];
-            if (piece != ' ' && textures[(int) piece]) {
-                SDL_RenderCopy(renderer, textures[(int) piece], NULL, &tile);
+void findKingPosition(int color, int *kr, int *kc) {
+    char searchChar = (color == 0) ? 'K' : 'k';
+    for (int r = 0; r < BOARD_SIZE; r++) {
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            if (board[r][c] == searchChar) {
+                *kr = r;
+                *kc = c;
+                return;
             }
         }
     }
+    *kr = *kc = -1;
 }
 
-void drawCapturedPieces() {
-    // Captured by White (black pieces taken by white)
-    SDL_Rect label1 = {BOARD_WIDTH + 20, WINDOW_HEIGHT - 120, 260, 20};
-    drawTextWithFont("Captured by White:", label1, smallFont);
-
-    const int CAPSZ = 25;
-    SDL_Rect blackRect = {BOARD_WIDTH + 20, label1.y + 25, CAPSZ, CAPSZ};
-    for (int i = 0; i < blackCapCount; i++) {
-        char piece = blackCaptured[i];
-        if (textures[(int) piece]) {
-            SDL_RenderCopy(renderer, textures[(int) piece], NULL, &blackRect);
-            blackRect.x += CAPSZ + 2;
-        }
-    }
+int isValidMove(int r1, int c1, int r2, int c2, int turn) {
+    if (r1 < 0 || r1 >= BOARD_SIZE || c1 < 0 || c1 >= BOARD_SIZE) return 0;
+    if (r2 < 0 || r2 >= BOARD_SIZE || c2 < 0 || c2 >= BOARD_SIZE) return 0;
+    if (r1 == r2 && c1 == c2) return 0;
 
-    // Captured by Black (white pieces taken by black)
-    SDL_Rect label2 = {BOARD_WIDTH + 20, blackRect.y + 35, 260, 20};
-    drawTextWithFont("Captured by Black:", label2, smallFont);
+    char piece = board[r1][c1];
+    char targ = board[r2][c2];
+    if (piece == ' ') return 0;
 
-    SDL_Rect whiteRect = {BOARD_WIDTH + 20, label2.y + 25, CAPSZ, CAPSZ};
-    for (int i = 0; i < whiteCapCount; i++) {
-        char piece = whiteCaptured[i];
-        if (textures[(int) piece]) {
-            SDL_RenderCopy(renderer, textures[(int) piece], NULL, &whiteRect);
-            whiteRect.x += CAPSZ + 2;
-        }
+    // Must move your own color
+    if ((turn % 2 == 0 && !isWhitePiece(piece)) ||
+        (turn % 2 == 1 && isWhitePiece(piece))) {
+        return 0;
     }
-}
 
-const char *getGameStatusText() {
-    int color = currentTurn % 2;
-    bool inCheck = isKingInCheck(color);
-    bool canMove = hasAnyLegalMove(color);
+    // Cannot capture your own piece
+    if (targ != ' ' && (isWhitePiece(targ) == isWhitePiece(piece))) return 0;
 
-    if (!canMove) {
-        if (inCheck) {
+    int dr = r2 - r1;
+    int dc = c2 - c1;
+
+    switch (tolower(piece)) {
+        case 'p': {
+            // Pawn logic
+            if (isWhitePiece(piece)) {
+                // Single push
+                if (dr == -1 && dc == 0 && targ == ' ') return 1;
+                // Double push from rank 6
+                if (r1 == 6 && dr == -2 && dc == 0 &&
+                    board[r1 - 1][c1] == ' ' && targ == ' ') {
+                    return 1;
+                }
+                // Capture
+                if (dr == -1 && abs(dc) == 1 && targ != ' ' &&
+                    !isWhitePiece(targ)) {
+                    return 1;
+                }
+                // En passant for White
+                if (r1 == 3 && dr == -1 && abs(dc) == 1 &&
+                    board[r2][c2] == ' ' &&
+                    r2 == enPassantRow && c2 == enPassantCol) {
+                    return 1;
+                }
+            } else {
+                // Black pawn logic
+                if (dr == 1 && dc == 0 && targ == ' ') return 1;
+                if (r1 == 1 && dr == 2 && dc == 0 &&
+                    board[r1 + 1][c1] == ' ' && targ == ' ') {
+                    return 1;
+                }
+                if (dr == 1 && abs(dc) == 1 &&
+                    targ != ' ' && isWhitePiece(targ)) {
+                    return 1;
+                }
+                // En passant for Black
+                if (r1 == 4 && dr == 1 && abs(dc) == 1 &&
+                    board[r2][c2] == ' ' &&
+                    r2 == enPassantRow && c2 == enPassantCol) {
+                    return 1;
+                }
+            }
+            break;
+        }
+        case 'r':
+            if (dr == 0 || dc == 0) return isPathClear(r1, c1, r2, c2);
+            break;
+        case 'n':
+            if ((abs(dr) == 2 && abs(dc) == 1) ||
+                (abs(dr) == 1 && abs(dc) == 2)) {
+                return 1;
+            }
+            break;
+        case 'b':
+            if (abs(dr) == abs(dc)) return isPathClear(r1, c1, r2, c2);
+            break;
+        case 'q':
+            if ((abs(dr) == abs(dc)) || dr == 0 || dc == 0) {
+                return isPathClear(r1, c1, r2, c2);
+            }
+            break;
+        case 'k':
+            // Normal one-square king move
+            if (abs(dr) <= 1 && abs(dc) <= 1) return 1;
+
+        // Castling White
+            if (isWhitePiece(piece) && r1 == 7 && c1 == 4 && !whiteKingMoved) {
+                // Kingside
+                if (r2 == 7 && c2 == 6 && !whiteKingsideRookMoved &&
+                    board[7][5] == ' ' && board[7][6] == ' ') {
+                    return 1;
+                }
+                // Queenside
+                if (r2 == 7 && c2 == 2 && !whiteQueensideRookMoved &&
+                    board[7][1] == ' ' && board[7][2] == ' ' && board[7][3] == ' ') {
+                    return 1;
+                }
+            }
+        // Castling Black
+            if (!isWhitePiece(piece) && r1 == 0 && c1 == 4 && !blackKingMoved) {
+                if (r2 == 0 && c2 == 6 && !blackKingsideRookMoved &&
+                    board[0][5] == ' ' && board[0][6] == ' ') {
+                    return 1;
+                }
+                if (r2 == 0 && c2 == 2 && !blackQueensideRookMoved &&
+                    board[0][1] == ' ' && board[0][2] == ' ' && board[0][3] == ' ') {
+                    return 1;
+                }
+            }
+            break;
+    }
+
+    return 0;
+}
+
+int canCaptureSquare(int r1, int c1, int r2, int c2) {
+    char p = board[r1][c1];
+    if (p == ' ') return 0;
+    if (board[r2][c2] != ' ' &&
+        isWhitePiece(board[r2][c2]) == isWhitePiece(p)) {
+        return 0;
+    }
+    int pseudoTurn = isWhitePiece(p) ? 0 : 1;
+    return isValidMove(r1, c1, r2, c2, pseudoTurn);
+}
+
+int isKingInCheck(int color) {
+    int kr, kc;
+    findKingPosition(color, &kr, &kc);
+    if (kr < 0) return 0;
+    return isSquareAttacked(kr, kc, 1 - color);
+}
+
+void computeValidMoves(int r, int c) {
+    Uint64 zone = traceBegin();
+    memset(validMoves, 0, sizeof(validMoves));
+    for (int rr = 0; rr < BOARD_SIZE; rr++) {
+        for (int cc = 0; cc < BOARD_SIZE; cc++) {
+            if (isValidMove(r, c, rr, cc, currentTurn)) {
+                // We skip “leaves king in check” filtering here for simplicity
+                validMoves[rr][cc] = true;
+            }
+        }
+    }
+    traceEnd(zone, "computeValidMoves");
+}
+
+static int addPawnMove(Move *list, int n, int r1, int c1, int r2, int c2) {
+    if (r2 == 0 || r2 == 7) {
+        for (int i = 4; i >= 1; i--) list[n++] = (Move){r1, c1, r2, c2, PROMO_PIECES[i]};
+    } else {
+        list[n++] = (Move){r1, c1, r2, c2, 0};
+    }
+    return n;
+}
+
+static int addCastlingMoves(int color, Move *list, int n) {
+    int row = (color == 0) ? 7 : 0;
+    char king = (color == 0) ? 'K' : 'k', rook = (color == 0) ? 'R' : 'r';
+    bool kingMoved = (color == 0) ? whiteKingMoved : blackKingMoved;
+    if (board[row][4] == king && !kingMoved) {
+        bool kingside = !((color == 0) ? whiteKingsideRookMoved : blackKingsideRookMoved);
+        bool queenside = !((color == 0) ? whiteQueensideRookMoved : blackQueensideRookMoved);
+        if (kingside && board[row][7] == rook && board[row][5] == ' ' && board[row][6] == ' ' &&
+            isCastlingSafe(row, 6, color)) {
+            list[n++] = (Move){row, 4, row, 6, 0};
+        }
+        if (queenside && board[row][0] == rook && board[row][1] == ' ' && board[row][2] == ' ' &&
+            board[row][3] == ' ' && isCastlingSafe(row, 2, color)) {
+            list[n++] = (Move){row, 4, row, 2, 0};
+        }
+    }
+    return n;
+}
+
+// Fills list (at least MAX_MOVES entries) with the pseudo-legal moves of
+// color, walking the attack tables: the noisy ones (captures and promotions),
+// the quiet ones, or both. Castling is only emitted when it is also safe, so
+// the legal filter below has to look at the king's square alone.
+static int generateMoveSet(int color, Move *list, bool noisy, bool quiet) {
+    int n = 0;
+    searchStats.movegenCalls++;
+    for (int sq = 0; sq < 64; sq++) {
+        char p = SQ_PIECE(sq);
+        if (p == ' ' || isWhitePiece(p) != (color == 0)) continue;
+        int r = sq >> 3, c = sq & 7;
+
+        switch (toupper(p)) {
+            case 'P': {
+                int dir = (color == 0) ? -1 : 1;
+                int r2 = r + dir;
+                if (board[r2][c] == ' ') {
+                    if ((r2 == 0 || r2 == 7) ? noisy : quiet) n = addPawnMove(list, n, r, c, r2, c);
+                    int home = (color == 0) ? 6 : 1;
+                    if (quiet && r == home && board[r2 + dir][c] == ' ') list[n++] = (Move){r, c, r2 + dir, c, 0};
+                }
+                for (int dc = -1; dc <= 1 && noisy; dc += 2) {
+                    int c2 = c + dc;
+                    if (c2 < 0 || c2 >= BOARD_SIZE) continue;
+                    char t = board[r2][c2];
+                    if ((t != ' ' && isWhitePiece(t) != (color == 0)) ||
+                        (r2 == enPassantRow && c2 == enPassantCol)) {
+                        n = addPawnMove(list, n, r, c, r2, c2);
+                    }
+                }
+                break;
+            }
+            case 'N':
+            case 'K': {
+                bool knight = toupper(p) == 'N';
+                int count = knight ? knightTargetCount[sq] : kingTargetCount[sq];
+                for (int k = 0; k < count; k++) {
+                    int tsq = knight ? knightTargets[sq][k] : kingTargets[sq][k];
+                    char t = SQ_PIECE(tsq);
+                    if (t != ' ' && isWhitePiece(t) == (color == 0)) continue;
+                    if (t != ' ' ? noisy : quiet) list[n++] = (Move){r, c, tsq >> 3, tsq & 7, 0};
+                }
+                break;
+            }
+            default: {
+                int d0 = (toupper(p) == 'B') ? 4 : 0;
+                int d1 = (toupper(p) == 'R') ? 4 : 8;
+                for (int d = d0; d < d1; d++) {
+                    for (int k = 0; k < rayLength[sq][d]; k++) {
+                        int tsq = rays[sq][d][k];
+                        char t = SQ_PIECE(tsq);
+                        if (t != ' ' && isWhitePiece(t) == (color == 0)) break;
+                        if (t != ' ' ? noisy : quiet) list[n++] = (Move){r, c, tsq >> 3, tsq & 7, 0};
+                        if (t != ' ') break;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return quiet ? addCastlingMoves(color, list, n) : n;
+}
+
+int generatePseudoMoves(int color, Move *list) {
+    return generateMoveSet(color, list, true, true);
+}
+
+int generateNoisyMoves(int color, Move *list) {
+    return generateMoveSet(color, list, true, false);
+}
+
+int generateQuietMoves(int color, Move *list) {
+    return generateMoveSet(color, list, false, true);
+}
+
+// True if generatePseudoMoves() would emit m for color, decided without
+// generating anything; hash and killer moves come from other positions.
+bool isPseudoLegal(Move m, int color) {
+    char p = board[m.from_r][m.from_c], t = board[m.to_r][m.to_c];
+    if (p == ' ' || isWhitePiece(p) != (color == 0)) return false;
+    if (t != ' ' && isWhitePiece(t) == (color == 0)) return false;
+    int from = m.from_r * 8 + m.from_c, to = m.to_r * 8 + m.to_c;
+
+    if (toupper(p) == 'P') {
+        int dir = (color == 0) ? -1 : 1;
+        if ((m.to_r == 0 || m.to_r == 7) != (m.promo != 0)) return false;
+        if (m.to_c == m.from_c) {
+            if (t != ' ') return false;
+            if (m.to_r == m.from_r + dir) return true;
+            return m.from_r == ((color == 0) ? 6 : 1) && m.to_r == m.from_r + 2 * dir &&
+                   board[m.from_r + dir][m.from_c] == ' ';
+        }
+        return m.to_r == m.from_r + dir && abs(m.to_c - m.from_c) == 1 &&
+               (t != ' ' || (m.to_r == enPassantRow && m.to_c == enPassantCol));
+    }
+    if (m.promo) return false;
+
+    switch (toupper(p)) {
+        case 'N':
+            for (int k = 0; k < knightTargetCount[from]; k++) {
+                if (knightTargets[from][k] == to) return true;
+            }
+            return false;
+        case 'K': {
+            for (int k = 0; k < kingTargetCount[from]; k++) {
+                if (kingTargets[from][k] == to) return true;
+            }
+            Move castles[2];
+            int n = addCastlingMoves(color, castles, 0);
+            for (int i = 0; i < n; i++) {
+                if (packMove(castles[i]) == packMove(m)) return true;
+            }
+            return false;
+        }
+        default: {
+            int d0 = (toupper(p) == 'B') ? 4 : 0;
+            int d1 = (toupper(p) == 'R') ? 4 : 8;
+            for (int d = d0; d < d1; d++) {
+                for (int k = 0; k < rayLength[from][d]; k++) {
+                    int tsq = rays[from][d][k];
+                    if (tsq == to) return true;
+                    if (SQ_PIECE(tsq) != ' ') break;
+                }
+            }
+            return false;
+        }
+    }
+}
+
+int generateLegalMoves(int color, Move *list) {
+    Move pseudo[MAX_MOVES];
+    int count = generatePseudoMoves(color, pseudo);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (isMoveLegal(pseudo[i], color)) list[n++] = pseudo[i];
+    }
+    return n;
+}
+
+int hasAnyLegalMove(int color) {
+    Uint64 zone = traceBegin();
+    Move pseudo[MAX_MOVES];
+    int count = generatePseudoMoves(color, pseudo);
+    int found = 0;
+    for (int i = 0; i < count && !found; i++) {
+        if (isMoveLegal(pseudo[i], color)) found = 1;
+    }
+    traceEnd(zone, "hasAnyLegalMove");
+    return found;
+}
+
+void generateMoves(int color) {
+    Uint64 zone = traceBegin();
+    moveCount = generateLegalMoves(color, moveList);
+    traceEnd(zone, "generateMoves");
+}
+
+void movePieceStoringLog(const char *mv) {
+    int c1 = tolower(mv[0]) - 'a';
+    int r1 = '8' - mv[1];
+    int c2 = tolower(mv[2]) - 'a';
+    int r2 = '8' - mv[3];
+
+    const char *draw = drawReason();
+    if (draw) {
+        printf("%s, no more moves.\n", draw);
+        return;
+    }
+
+    if (!isValidMove(r1, c1, r2, c2, currentTurn)) {
+        printf("Invalid move: %s\n", mv);
+        return;
+    }
+
+    char mover = board[r1][c1];
+    int moverColor = isWhitePiece(mover) ? 0 : 1;
+    Move m = {r1, c1, r2, c2, 0};
+    bool promotes = (mover == 'P' && r2 == 0) || (mover == 'p' && r2 == 7);
+    if (promotes) m.promo = 'Q'; // provisional, the picker chooses the piece
+
+    bool castling = (tolower(mover) == 'k' && abs(c2 - c1) == 2);
+    if ((castling && !isCastlingSafe(r1, c2, moverColor)) || !isMoveLegal(m, moverColor)) {
+        printf("You cannot leave your king in check! Move undone.\n");
+        return;
+    }
+
+    // Pawn promotion
+    if (promotes) {
+        awaitingPromotion = true;
+        promoRow = r2;
+        promoCol = c2;
+        promoColor = isWhitePiece(mover) ? 'w' : 'b';
+        pendingPromotion = m;
+        return; // pause for promotion
+    }
+
+    playMove(m);
+
+    int nextColor = currentTurn % 2;
+    bool inChk = isKingInCheck(nextColor);
+    bool canMv = hasAnyLegalMove(nextColor);
+    if (headless) return;
+    if (!canMv) {
+        if (inChk) {
+            printf("Checkmate! %s wins!\n", moverColor == 0 ? "White" : "Black");
+        } else {
+            printf("Stalemate! It's a draw.\n");
+        }
+        stopJournal(true);
+        return;
+    }
+    draw = drawReason();
+    if (draw) {
+        printf("%s.\n", draw);
+        stopJournal(true);
+        return;
+    }
+
+    if (inChk) {
+        printf("Check!\n");
+    }
+}
+
+// -------------------------
+// Attack Tables / Make-Unmake
+// -------------------------
+
+void initAttackTables() {
+    static const int knightSteps[8][2] = {
+        {-2, -1}, {-2, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2}, {2, -1}, {2, 1}
+    };
+    for (int r = 0; r < BOARD_SIZE; r++) {
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            int sq = r * 8 + c;
+            knightTargetCount[sq] = kingTargetCount[sq] = 0;
+            for (int i = 0; i < 8; i++) {
+                int nr = r + knightSteps[i][0], nc = c + knightSteps[i][1];
+                if (nr >= 0 && nr < 8 && nc >= 0 && nc < 8) {
+                    knightTargets[sq][knightTargetCount[sq]++] = (signed char) (nr * 8 + nc);
+                }
+            }
+            for (int d = 0; d < 8; d++) {
+                int nr = r + RAY_DIRS[d][0], nc = c + RAY_DIRS[d][1];
+                rayLength[sq][d] = 0;
+                if (nr >= 0 && nr < 8 && nc >= 0 && nc < 8) {
+                    kingTargets[sq][kingTargetCount[sq]++] = (signed char) (nr * 8 + nc);
+                }
+                while (nr >= 0 && nr < 8 && nc >= 0 && nc < 8) {
+                    rays[sq][d][rayLength[sq][d]++] = (signed char) (nr * 8 + nc);
+                    nr += RAY_DIRS[d][0];
+                    nc += RAY_DIRS[d][1];
+                }
+            }
+        }
+    }
+}
+
+int isSquareAttacked(int r, int c, int byColor) {
+    int sq = r * 8 + c;
+    char pawn = byColor == 0 ? 'P' : 'p';
+    char knight = byColor == 0 ? 'N' : 'n';
+    char king = byColor == 0 ? 'K' : 'k';
+    char rook = byColor == 0 ? 'R' : 'r';
+    char bishop = byColor == 0 ? 'B' : 'b';
+    char queen = byColor == 0 ? 'Q' : 'q';
+
+    // A white pawn attacks upwards, so it would stand one row below
+    int pr = byColor == 0 ? r + 1 : r - 1;
+    if (pr >= 0 && pr < BOARD_SIZE) {
+        if (c > 0 && board[pr][c - 1] == pawn) return 1;
+        if (c < 7 && board[pr][c + 1] == pawn) return 1;
+    }
+    for (int i = 0; i < knightTargetCount[sq]; i++) {
+        if (SQ_PIECE(knightTargets[sq][i]) == knight) return 1;
+    }
+    for (int i = 0; i < kingTargetCount[sq]; i++) {
+        if (SQ_PIECE(kingTargets[sq][i]) == king) return 1;
+    }
+    for (int d = 0; d < 8; d++) {
+        char slider = d < 4 ? rook : bishop;
+        for (int i = 0; i < rayLength[sq][d]; i++) {
+            char p = SQ_PIECE(rays[sq][d][i]);
+            if (p == ' ') continue;
+            if (p == slider || p == queen) return 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+unsigned char packCastlingRights() {
+    return (unsigned char) (whiteKingMoved | whiteKingsideRookMoved << 1 | whiteQueensideRookMoved << 2 |
+                            blackKingMoved << 3 | blackKingsideRookMoved << 4 | blackQueensideRookMoved << 5);
+}
+
+void unpackCastlingRights(unsigned char bits) {
+    whiteKingMoved = bits & 1;
+    whiteKingsideRookMoved = bits >> 1 & 1;
+    whiteQueensideRookMoved = bits >> 2 & 1;
+    blackKingMoved = bits >> 3 & 1;
+    blackKingsideRookMoved = bits >> 4 & 1;
+    blackQueensideRookMoved = bits >> 5 & 1;
+}
+
+static void loseCastlingRightsAt(int r, int c) {
+    if (r == 7 && c == 0) whiteQueensideRookMoved = true;
+    if (r == 7 && c == 7) whiteKingsideRookMoved = true;
+    if (r == 0 && c == 0) blackQueensideRookMoved = true;
+    if (r == 0 && c == 7) blackKingsideRookMoved = true;
+}
+
+// Plays a pseudo-legal move on the board, including en passant, castling and
+// promotion, and updates en passant / castling state. Turn and captured-piece
+// bookkeeping are left to the caller.
+void makeMove(Move m, Undo *u) {
+    char piece = board[m.from_r][m.from_c];
+    u->move = m;
+    u->moved = piece;
+    u->captured = board[m.to_r][m.to_c];
+    u->capRow = m.to_r;
+    u->capCol = m.to_c;
+    u->epRow = enPassantRow;
+    u->epCol = enPassantCol;
+    u->castling = packCastlingRights();
+    u->halfmove = halfmoveClock;
+    u->key = positionKey;
+    u->pawnKey = pawnKey;
+
+    int color = isWhitePiece(piece) ? 0 : 1;
+    Uint64 key = positionKey ^ zobristBlackToMove ^ zobristCastling[castlingRightsIndex()] ^ enPassantKey(color);
+
+    bool isPawn = (piece == 'P' || piece == 'p');
+    if (isPawn && m.from_c != m.to_c && u->captured == ' ') {
+        // En passant: the captured pawn stands beside the mover
+        u->capRow = m.from_r;
+        u->captured = board[m.from_r][m.to_c];
+        board[m.from_r][m.to_c] = ' ';
+    }
+    if (u->captured != ' ') key ^= zobristPieces[zobristPieceIndex(u->captured)][u->capRow * 8 + u->capCol];
+
+    char placed = m.promo ? (isWhitePiece(piece) ? m.promo : (char) tolower(m.promo)) : piece;
+    board[m.to_r][m.to_c] = placed;
+    board[m.from_r][m.from_c] = ' ';
+    key ^= zobristPieces[zobristPieceIndex(piece)][m.from_r * 8 + m.from_c];
+    key ^= zobristPieces[zobristPieceIndex(placed)][m.to_r * 8 + m.to_c];
+
+    if (u->captured == 'P' || u->captured == 'p') {
+        pawnKey ^= zobristPieces[zobristPieceIndex(u->captured)][u->capRow * 8 + u->capCol];
+    }
+    if (isPawn) {
+        pawnKey ^= zobristPieces[zobristPieceIndex(piece)][m.from_r * 8 + m.from_c];
+        if (placed == piece) pawnKey ^= zobristPieces[zobristPieceIndex(piece)][m.to_r * 8 + m.to_c];
+    }
+
+    if ((piece == 'K' || piece == 'k') && abs(m.to_c - m.from_c) == 2) {
+        int rookFrom = (m.to_c == 6) ? 7 : 0;
+        int rookTo = (m.to_c == 6) ? 5 : 3;
+        char rook = board[m.from_r][rookFrom];
+        board[m.from_r][rookTo] = rook;
+        board[m.from_r][rookFrom] = ' ';
+        key ^= zobristPieces[zobristPieceIndex(rook)][m.from_r * 8 + rookFrom];
+        key ^= zobristPieces[zobristPieceIndex(rook)][m.from_r * 8 + rookTo];
+    }
+
+    halfmoveClock = (isPawn || u->captured != ' ') ? 0 : halfmoveClock + 1;
+    enPassantRow = enPassantCol = -1;
+    if (isPawn && abs(m.to_r - m.from_r) == 2) {
+        enPassantRow = (m.from_r + m.to_r) / 2;
+        enPassantCol = m.from_c;
+    }
+
+    if (piece == 'K') whiteKingMoved = true;
+    if (piece == 'k') blackKingMoved = true;
+    loseCastlingRightsAt(m.from_r, m.from_c);
+    loseCastlingRightsAt(m.to_r, m.to_c);
+
+    positionKey = key ^ zobristCastling[castlingRightsIndex()] ^ enPassantKey(1 - color);
+    keyHistory[++keyTop & (KEY_HISTORY_SIZE - 1)] = positionKey;
+}
+
+void unmakeMove(const Undo *u) {
+    Move m = u->move;
+    board[m.from_r][m.from_c] = u->moved;
+    board[m.to_r][m.to_c] = ' ';
+    board[u->capRow][u->capCol] = u->captured;
+
+    if ((u->moved == 'K' || u->moved == 'k') && abs(m.to_c - m.from_c) == 2) {
+        int rookFrom = (m.to_c == 6) ? 7 : 0;
+        int rookTo = (m.to_c == 6) ? 5 : 3;
+        board[m.from_r][rookFrom] = board[m.from_r][rookTo];
+        board[m.from_r][rookTo] = ' ';
+    }
+
+    enPassantRow = u->epRow;
+    enPassantCol = u->epCol;
+    unpackCastlingRights(u->castling);
+    halfmoveClock = u->halfmove;
+    positionKey = u->key;
+    pawnKey = u->pawnKey;
+    if (--keyTop < keyFloor) {
+        keyFloor = keyTop;
+        keyHistory[keyTop & (KEY_HISTORY_SIZE - 1)] = positionKey;
+    }
+}
+
+// Passes the turn: only the side-to-move key and en passant square change.
+// Like makeMove(), it leaves currentTurn to the caller (call it before the
+// increment).
+void makeNullMove(Undo *u) {
+    u->epRow = enPassantRow;
+    u->epCol = enPassantCol;
+    u->halfmove = halfmoveClock;
+    u->key = positionKey;
+    positionKey ^= zobristBlackToMove ^ enPassantKey(currentTurn % 2);
+    enPassantRow = enPassantCol = -1;
+    halfmoveClock = 0; // repetitions never span a null move
+    keyHistory[++keyTop & (KEY_HISTORY_SIZE - 1)] = positionKey;
+}
+
+void unmakeNullMove(const Undo *u) {
+    enPassantRow = u->epRow;
+    enPassantCol = u->epCol;
+    halfmoveClock = u->halfmove;
+    positionKey = u->key;
+    keyTop--;
+}
+
+// The king may not castle out of, through or into check.
+bool isCastlingSafe(int row, int toCol, int color) {
+    int opp = 1 - color;
+    int step = (toCol > 4) ? 1 : -1;
+    return !isSquareAttacked(row, 4, opp) && !isSquareAttacked(row, 4 + step, opp) &&
+           !isSquareAttacked(row, toCol, opp);
+}
+
+// True if the pseudo-legal move m does not leave color's king in check.
+bool isMoveLegal(Move m, int color) {
+    Undo u;
+    makeMove(m, &u);
+    bool legal = !isKingInCheck(color);
+    unmakeMove(&u);
+    return legal;
+}
+
+// -------------------------
+// Static Exchange Evaluation
+// -------------------------
+
+static bool isRemoved(Uint64 removed, int sq) {
+    return (removed >> sq) & 1;
+}
+
+// The cheapest piece of color attacking sq, ignoring the squares in removed.
+// Sliders are found by walking the rays past removed pieces, so a rook or
+// queen lined up behind another attacker shows up once the front one is gone.
+static int leastValuableAttacker(int sq, int color, Uint64 removed) {
+    int r = sq >> 3, c = sq & 7;
+    int pr = r + ((color == 0) ? 1 : -1);
+    char pawn = (color == 0) ? 'P' : 'p';
+    if (pr >= 0 && pr < BOARD_SIZE) {
+        for (int dc = -1; dc <= 1; dc += 2) {
+            int pc = c + dc;
+            if (pc >= 0 && pc < BOARD_SIZE && board[pr][pc] == pawn && !isRemoved(removed, pr * 8 + pc)) {
+                return pr * 8 + pc;
+            }
+        }
+    }
+
+    char knight = (color == 0) ? 'N' : 'n';
+    for (int k = 0; k < knightTargetCount[sq]; k++) {
+        int t = knightTargets[sq][k];
+        if (SQ_PIECE(t) == knight && !isRemoved(removed, t)) return t;
+    }
+
+    int best = -1, bestValue = INF_SCORE;
+    for (int d = 0; d < 8; d++) {
+        char slider = (d < 4) ? 'R' : 'B';
+        for (int k = 0; k < rayLength[sq][d]; k++) {
+            int t = rays[sq][d][k];
+            char p = SQ_PIECE(t);
+            if (p == ' ' || isRemoved(removed, t)) continue;
+            char type = (char) toupper(p);
+            if (isWhitePiece(p) == (color == 0) && (type == slider || type == 'Q') && VALS[(int) type] < bestValue) {
+                best = t;
+                bestValue = VALS[(int) type];
+            }
+            break;
+        }
+    }
+    if (best >= 0) return best;
+
+    char king = (color == 0) ? 'K' : 'k';
+    for (int k = 0; k < kingTargetCount[sq]; k++) {
+        int t = kingTargets[sq][k];
+        if (SQ_PIECE(t) == king && !isRemoved(removed, t)) return t;
+    }
+    return -1;
+}
+
+// Material the side playing capture m gains once both sides have made every
+// profitable recapture on the target square, each with its cheapest piece.
+// Pins and checks are ignored.
+int see(Move m) {
+    int from = m.from_r * 8 + m.from_c, to = m.to_r * 8 + m.to_c;
+    char mover = board[m.from_r][m.from_c];
+    char victim = board[m.to_r][m.to_c];
+    Uint64 removed = 1ULL << from;
+    int gain[32];
+
+    if (victim == ' ' && toupper(mover) == 'P' && m.from_c != m.to_c) {
+        removed |= 1ULL << (m.from_r * 8 + m.to_c); // en passant
+        gain[0] = VALS['P'];
+    } else {
+        gain[0] = (victim == ' ') ? 0 : abs(VALS[(int) victim]);
+    }
+    int onSquare = abs(VALS[(int) mover]);
+    if (m.promo) {
+        gain[0] += VALS[(int) m.promo] - VALS['P'];
+        onSquare = VALS[(int) m.promo];
+    }
+
+    int d = 0;
+    int side = isWhitePiece(mover) ? 1 : 0;
+    while (d < 31) {
+        int a = leastValuableAttacker(to, side, removed);
+        if (a < 0) break;
+        // The king can only take last
+        if (toupper(SQ_PIECE(a)) == 'K' && leastValuableAttacker(to, 1 - side, removed | 1ULL << a) >= 0) break;
+        d++;
+        gain[d] = onSquare - gain[d - 1];
+        onSquare = abs(VALS[(int) SQ_PIECE(a)]);
+        removed |= 1ULL << a;
+        side = 1 - side;
+    }
+    // Either side may stop recapturing when that is better for it
+    for (; d > 0; d--) {
+        if (-gain[d - 1] > gain[d]) continue;
+        gain[d - 1] = -gain[d];
+    }
+    return gain[0];
+}
+
+// -------------------------
+// Zobrist Hashing
+// -------------------------
+
+static Uint64 splitMix64(Uint64 *state) {
+    Uint64 z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Keys come from a fixed seed so they are identical across runs and builds;
+// on-disk indexes depend on that.
+void initZobrist() {
+    Uint64 state = 0x5A0B1257C0FFEEULL;
+    for (int p = 0; p < 12; p++) {
+        for (int sq = 0; sq < 64; sq++) zobristPieces[p][sq] = splitMix64(&state);
+    }
+    for (int i = 0; i < 16; i++) zobristCastling[i] = splitMix64(&state);
+    for (int c = 0; c < 8; c++) zobristEnPassant[c] = splitMix64(&state);
+    zobristBlackToMove = splitMix64(&state);
+    zobristPawnSeed = splitMix64(&state);
+}
+
+int zobristPieceIndex(char p) {
+    static const char order[] = "PNBRQKpnbrqk";
+    return (int) (strchr(order, p) - order);
+}
+
+int castlingRightsIndex() {
+    int rights = 0;
+    if (!whiteKingMoved && !whiteKingsideRookMoved) rights |= 1;
+    if (!whiteKingMoved && !whiteQueensideRookMoved) rights |= 2;
+    if (!blackKingMoved && !blackKingsideRookMoved) rights |= 4;
+    if (!blackKingMoved && !blackQueensideRookMoved) rights |= 8;
+    return rights;
+}
+
+// The en passant file only counts when a pawn of color (to move) can take.
+Uint64 enPassantKey(int color) {
+    if (enPassantRow < 0) return 0;
+    char pawn = (color == 0) ? 'P' : 'p';
+    int fromRow = enPassantRow + ((color == 0) ? 1 : -1);
+    for (int dc = -1; dc <= 1; dc += 2) {
+        int c = enPassantCol + dc;
+        if (c >= 0 && c < BOARD_SIZE && board[fromRow][c] == pawn) return zobristEnPassant[enPassantCol];
+    }
+    return 0;
+}
+
+// Hashes the current position from scratch: pieces, side to move, castling
+// rights and the en passant file when a capture there is actually possible
+// (so transposed positions hash alike). makeMove() keeps positionKey equal
+// to this incrementally.
+Uint64 computeZobristKey() {
+    Uint64 key = 0;
+    for (int sq = 0; sq < 64; sq++) {
+        char p = SQ_PIECE(sq);
+        if (p != ' ') key ^= zobristPieces[zobristPieceIndex(p)][sq];
+    }
+    int color = currentTurn % 2;
+    if (color == 1) key ^= zobristBlackToMove;
+    return key ^ zobristCastling[castlingRightsIndex()] ^ enPassantKey(color);
+}
+
+Uint64 computePawnKey() {
+    Uint64 key = zobristPawnSeed;
+    for (int sq = 0; sq < 64; sq++) {
+        char p = SQ_PIECE(sq);
+        if (p == 'P' || p == 'p') key ^= zobristPieces[zobristPieceIndex(p)][sq];
+    }
+    return key;
+}
+
+// Starts the key history at the current position, with nothing known before.
+void resetKeyHistory() {
+    positionKey = computeZobristKey();
+    pawnKey = computePawnKey();
+    keyTop = keyFloor = 0;
+    keyHistory[0] = positionKey;
+}
+
+// How many times the current position occurred before. Only the window since
+// the last capture or pawn move can repeat, and only positions with the same
+// side to move, so the scan looks at every second key of at most
+// halfmoveClock entries.
+int repetitionCount() {
+    int window = halfmoveClock;
+    if (window > keyTop - keyFloor) window = keyTop - keyFloor;
+    if (window > KEY_HISTORY_SIZE - 1) window = KEY_HISTORY_SIZE - 1;
+    int n = 0;
+    for (int i = 4; i <= window; i += 2) {
+        if (keyHistory[(keyTop - i) & (KEY_HISTORY_SIZE - 1)] == positionKey) n++;
+    }
+    return n;
+}
+
+// Why the game on the board is drawn by rule, or NULL if it is not.
+const char *drawReason() {
+    if (halfmoveClock >= FIFTY_MOVE_PLIES) return "Draw by fifty-move rule";
+    if (repetitionCount() >= 2) return "Draw by threefold repetition";
+    return NULL;
+}
+
+// -------------------------
+// Evaluation and Engine
+// -------------------------
+
+// n times *weight, n counted White minus Black. While tracing, n is also
+// added to the weight's coefficient.
+static int weigh(const int *weight, int n) {
+    if (evalTrace) evalTrace->coef[weight - (const int *) &EVAL_WEIGHTS] += n;
+    return *weight * n;
+}
+
+// Scores the pawns on the board from scratch. Pawns of a file are kept as a
+// mask of rows (bit r = row r); White pushes towards row 0.
+void evaluatePawnStructure(PawnHashEntry *e) {
+    const EvalWeights *w = &EVAL_WEIGHTS;
+    int rows[2][8] = {{0}};
+    for (int r = 0; r < BOARD_SIZE; r++) {
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            if (board[r][c] == 'P') rows[0][c] |= 1 << r;
+            if (board[r][c] == 'p') rows[1][c] |= 1 << r;
+        }
+    }
+
+    int sc = 0;
+    for (int color = 0; color < 2; color++) {
+        int opp = 1 - color, dir = (color == 0) ? -1 : 1, sign = -dir;
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            int own = (c > 0 ? rows[color][c - 1] : 0) | (c < 7 ? rows[color][c + 1] : 0);
+            int enemy = (c > 0 ? rows[opp][c - 1] : 0) | (c < 7 ? rows[opp][c + 1] : 0);
+            bool onFile = false;
+            for (int r = 1; r < BOARD_SIZE - 1; r++) {
+                if (!(rows[color][c] & 1 << r)) continue;
+                if (onFile) sc += weigh(&w->doubledPawn, sign);
+                onFile = true;
+
+                int ahead = (color == 0) ? (1 << r) - 1 : 0xFF & ~((2 << r) - 1);
+                if (!((rows[opp][c] | enemy) & ahead)) {
+                    sc += weigh(&w->passedPawn[(color == 0) ? 7 - r : r], sign);
+                }
+                if (!own) {
+                    sc += weigh(&w->isolatedPawn, sign);
+                } else if (!(own & ~ahead & 0xFF)) {
+                    // No neighbour level or behind, and an enemy pawn guards the stop square
+                    int guard = r + 2 * dir;
+                    if (guard >= 0 && guard < BOARD_SIZE && (enemy & 1 << guard)) sc += weigh(&w->backwardPawn, sign);
+                }
+            }
+        }
+
+        // Cover for a king on file f: the nearest own pawn on f and either side
+        int home = (color == 0) ? 6 : 1;
+        for (int f = 0; f < BOARD_SIZE; f++) {
+            int advanced = 0, missing = 0;
+            for (int c = f - 1; c <= f + 1; c++) {
+                if (c < 0 || c >= BOARD_SIZE) continue;
+                if (rows[color][c] & 1 << home) continue;
+                if (rows[color][c] & 1 << (home + dir)) advanced++;
+                else missing++;
+            }
+            e->shelter[color][f] = (Uint8) (missing << 4 | advanced);
+        }
+    }
+    e->score = (Sint16) sc;
+}
+
+// The pawn structure of the board, computed only when the table misses.
+// A traced evaluation always recomputes it so that its terms are counted.
+const PawnHashEntry *probePawnHash() {
+    PawnHashEntry *e = &pawnHash[pawnKey & (PAWN_HASH_ENTRIES - 1)];
+    searchStats.pawnProbes++;
+    if (e->key == pawnKey && !evalTrace) {
+        searchStats.pawnHits++;
+        return e;
+    }
+    evaluatePawnStructure(e);
+    e->key = pawnKey;
+    return e;
+}
+
+// Missing cover only counts on the back ranks and against a queen.
+static int evaluateShelter(const PawnHashEntry *e, int color, int kingRow, int kingCol) {
+    if (kingRow != (color == 0 ? 7 : 0) && kingRow != (color == 0 ? 6 : 1)) return 0;
+    int cover = e->shelter[color][kingCol], sign = (color == 0) ? 1 : -1;
+    return weigh(&EVAL_WEIGHTS.shelterAdvanced, sign * (cover & 15)) +
+           weigh(&EVAL_WEIGHTS.shelterMissing, sign * (cover >> 4));
+}
+
+int evaluateStatic() {
+    static const char MATERIAL_INDEX[128] = {['N'] = 1, ['B'] = 2, ['R'] = 3, ['Q'] = 4};
+    const EvalWeights *w = &EVAL_WEIGHTS;
+    int sc = 0, kingRow[2] = {7, 0}, kingCol[2] = {4, 4};
+    bool queen[2] = {false, false};
+    for (int r = 0; r < BOARD_SIZE; r++) {
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            char p = board[r][c];
+            if (!p || p == ' ') continue;
+            char type = (char) toupper(p);
+            int sign = isWhitePiece(p) ? 1 : -1;
+            if (type == 'K') {
+                kingRow[sign < 0] = r;
+                kingCol[sign < 0] = c;
+                continue;
+            }
+            sc += weigh(&w->material[(int) MATERIAL_INDEX[(int) type]], sign);
+            if (type == 'P') {
+                sc += weigh(&w->pawnSquare[(sign > 0 ? r : 7 - r) * 8 + c], sign);
+            } else if (type == 'Q') {
+                queen[sign < 0] = true;
+            }
+        }
+    }
+
+    const PawnHashEntry *e = probePawnHash();
+    sc += e->score;
+    if (queen[1]) sc += evaluateShelter(e, 0, kingRow[0], kingCol[0]);
+    if (queen[0]) sc += evaluateShelter(e, 1, kingRow[1], kingCol[1]);
+    return sc;
+}
+
+// Mobility and centre control of color, counted White minus Black like
+// evaluateStatic().
+int evaluateDynamic(int color) {
+    int center = 0, sign = (color == 0) ? 1 : -1;
+    Move pseudo[MAX_MOVES];
+    int mob = generatePseudoMoves(color, pseudo);
+
+    const int centers[4][2] = {{3, 3}, {3, 4}, {4, 3}, {4, 4}};
+    for (int i = 0; i < 4; i++) {
+        char p = board[centers[i][0]][centers[i][1]];
+        if (p != ' ' && ((isWhitePiece(p) ? 0 : 1) == color)) {
+            center++;
+        }
+    }
+    return weigh(&EVAL_WEIGHTS.mobility, sign * mob) + weigh(&EVAL_WEIGHTS.center, sign * center);
+}
+
+// Score from color's point of view, which is what negamax expects.
+int evaluate(int color) {
+    searchStats.evalCalls++;
+    int sc = evaluateStatic() + evaluateDynamic(0) + evaluateDynamic(1);
+    return (color == 0) ? sc : -sc;
+}
+
+// Evaluates the board from White's side and fills trace with the
+// coefficient of every weight, so that the score is their dot product with
+// EVAL_WEIGHTS.
+int traceEvaluation(EvalTrace *trace) {
+    memset(trace, 0, sizeof(*trace));
+    evalTrace = trace;
+    int sc = evaluate(0);
+    evalTrace = NULL;
+    return sc;
+}
+
+int nonPawnMaterial(int color) {
+    int sum = 0;
+    for (int sq = 0; sq < 64; sq++) {
+        char p = SQ_PIECE(sq);
+        if (p == ' ' || isWhitePiece(p) != (color == 0)) continue;
+        char type = (char) toupper(p);
+        if (type != 'P' && type != 'K') sum += VALS[(int) type];
+    }
+    return sum;
+}
+
+// -------------------------
+// Transposition Table
+// -------------------------
+
+// Takes the largest power-of-two table that fits in megabytes, halving the
+// request until the allocation succeeds.
+bool initTransTable(TransTable *tt, int megabytes) {
+    size_t n = 1;
+    while (n * 2 * sizeof(TTEntry) <= ((size_t) megabytes << 20)) n *= 2;
+    for (; n > 0; n /= 2) {
+        tt->entries = calloc(n, sizeof(TTEntry));
+        if (tt->entries) break;
+    }
+    if (!tt->entries) {
+        fprintf(stderr, "Out of memory allocating the transposition table\n");
+        tt->mask = 0;
+        return false;
+    }
+    tt->mask = n - 1;
+    return true;
+}
+
+void clearTransTable(TransTable *tt) {
+    if (tt->entries) memset(tt->entries, 0, (tt->mask + 1) * sizeof(TTEntry));
+}
+
+void freeTransTable(TransTable *tt) {
+    free(tt->entries);
+    tt->entries = NULL;
+    tt->mask = 0;
+}
+
+// Permille of the first thousand entries in use, as UCI "hashfull" reports.
+int transTableFill(const TransTable *tt) {
+    if (!tt->entries) return 0;
+    int sample = tt->mask + 1 < 1000 ? (int) tt->mask + 1 : 1000, used = 0;
+    for (int i = 0; i < sample; i++) {
+        if (tt->entries[i].bound != TT_NONE) used++;
+    }
+    return used * 1000 / sample;
+}
+
+// Mate scores count plies from the root; the table keeps them relative to
+// the node so they stay right when the position is reached at another ply.
+static int scoreToTT(int score, int ply) {
+    if (score >= MATE_BOUND) return score + ply;
+    if (score <= -MATE_BOUND) return score - ply;
+    return score;
+}
+
+static int scoreFromTT(int score, int ply) {
+    if (score >= MATE_BOUND) return score - ply;
+    if (score <= -MATE_BOUND) return score + ply;
+    return score;
+}
+
+static void storeTT(int depth, int ply, int score, TTBound bound, Move best) {
+    TTEntry *e = &searchTT->entries[positionKey & searchTT->mask];
+    if (e->key == positionKey && e->depth > depth && bound != TT_EXACT) return;
+    searchStats.ttStores++;
+    e->key = positionKey;
+    e->score = scoreToTT(score, ply);
+    e->move = packMove(best);
+    e->depth = (signed char) depth;
+    e->bound = (unsigned char) bound;
+}
+
+// -------------------------
+// Search
+// -------------------------
+
+static bool isCapture(Move m) {
+    char mover = board[m.from_r][m.from_c];
+    return board[m.to_r][m.to_c] != ' ' || (toupper(mover) == 'P' && m.from_c != m.to_c);
+}
+
+// Ordering: hash move, captures that do not lose material by most valuable
+// victim then least valuable attacker, promotions, killers, quiet moves by
+// history, and last the captures SEE says lose material (scored below zero).
+static int scoreMove(Move m, PackedMove hashMove, int ply, int color) {
+    PackedMove pm = packMove(m);
+    if (pm == hashMove) return 1 << 30;
+    char mover = board[m.from_r][m.from_c];
+    if (isCapture(m)) {
+        char victim = board[m.to_r][m.to_c];
+        int value = (victim == ' ') ? 100 : abs(VALS[(int) victim]);
+        if (value < abs(VALS[(int) mover])) {
+            int gain = see(m);
+            if (gain < 0) return -(1 << 20) + gain;
+        }
+        return (1 << 28) + value * 32 - abs(VALS[(int) mover]) / 32;
+    }
+    if (m.promo) return (1 << 28) + abs(VALS[(int) m.promo]);
+    if (pm == killerMoves[ply][0]) return (1 << 27) + 1;
+    if (pm == killerMoves[ply][1]) return 1 << 27;
+    return historyScores[color][m.from_r * 8 + m.from_c][m.to_r * 8 + m.to_c];
+}
+
+// Swaps the best-scored remaining move into slot i and returns it.
+static Move pickMove(Move *list, int *scores, int count, int i) {
+    int best = i;
+    for (int j = i + 1; j < count; j++) {
+        if (scores[j] > scores[best]) best = j;
+    }
+    Move m = list[best];
+    int sc = scores[best];
+    list[best] = list[i];
+    scores[best] = scores[i];
+    list[i] = m;
+    scores[i] = sc;
+    return m;
+}
+
+// Takes m out of moves[from..count) if it is there; returns the new count.
+static int removeMove(Move *list, int from, int count, PackedMove pm) {
+    for (int i = from; i < count; i++) {
+        if (packMove(list[i]) == pm) {
+            list[i] = list[--count];
+            break;
+        }
+    }
+    return count;
+}
+
+static void initMovePicker(MovePicker *mp, PackedMove hashMove, int ply, int color) {
+    mp->stage = STAGE_HASH;
+    mp->color = color;
+    mp->ply = ply;
+    mp->hashMove = hashMove;
+    mp->killers[0] = killerMoves[ply][0];
+    mp->killers[1] = killerMoves[ply][1];
+    mp->noisyEnd = mp->count = mp->next = mp->badNext = 0;
+    searchStats.pickerNodes++;
+}
+
+// Next move of the node in scoreMove() order, or false when all are tried.
+// The hash move and killers are checked with isPseudoLegal() so a cutoff by
+// one of them skips generation; captures and promotions are generated next,
+// quiet moves only once the killers are done, and captures that lose
+// material go last.
+static bool nextMove(MovePicker *mp, Move *out) {
+    for (;;) {
+        switch (mp->stage) {
+            case STAGE_HASH:
+                mp->stage = STAGE_GOOD_NOISY;
+                if (mp->hashMove && isPseudoLegal(unpackMove(mp->hashMove), mp->color)) {
+                    searchStats.stageReached[STAGE_HASH]++;
+                    *out = unpackMove(mp->hashMove);
+                    return true;
+                }
+                mp->hashMove = 0;
+                break;
+
+            case STAGE_GOOD_NOISY:
+                if (mp->count == 0 && mp->next == 0) {
+                    searchStats.stageReached[STAGE_GOOD_NOISY]++;
+                    int n = generateNoisyMoves(mp->color, mp->moves);
+                    if (mp->hashMove) n = removeMove(mp->moves, 0, n, mp->hashMove);
+                    for (int i = 0; i < n; i++) mp->scores[i] = scoreMove(mp->moves[i], 0, mp->ply, mp->color);
+                    mp->noisyEnd = mp->count = n;
+                }
+                if (mp->next < mp->noisyEnd) {
+                    Move m = pickMove(mp->moves, mp->scores, mp->noisyEnd, mp->next);
+                    if (mp->scores[mp->next] >= 0) {
+                        mp->next++;
+                        *out = m;
+                        return true;
+                    }
+                }
+                mp->badNext = mp->next;
+                mp->stage = STAGE_KILLERS;
+                searchStats.stageReached[STAGE_KILLERS]++;
+                mp->next = 0;
+                break;
+
+            case STAGE_KILLERS:
+                while (mp->next < 2) {
+                    PackedMove pm = mp->killers[mp->next];
+                    Move m = unpackMove(pm);
+                    if (pm && pm != mp->hashMove && isPseudoLegal(m, mp->color) && !m.promo && !isCapture(m)) {
+                        mp->next++;
+                        *out = m;
+                        return true;
+                    }
+                    mp->killers[mp->next++] = 0;
+                }
+                mp->stage = STAGE_QUIET;
+                searchStats.stageReached[STAGE_QUIET]++;
+                mp->count = mp->noisyEnd + generateQuietMoves(mp->color, mp->moves + mp->noisyEnd);
+                if (mp->hashMove) mp->count = removeMove(mp->moves, mp->noisyEnd, mp->count, mp->hashMove);
+                for (int k = 0; k < 2; k++) {
+                    if (mp->killers[k]) mp->count = removeMove(mp->moves, mp->noisyEnd, mp->count, mp->killers[k]);
+                }
+                for (int i = mp->noisyEnd; i < mp->count; i++) {
+                    mp->scores[i] = scoreMove(mp->moves[i], 0, mp->ply, mp->color);
+                }
+                mp->next = mp->noisyEnd;
+                break;
+
+            case STAGE_QUIET:
+                if (mp->next < mp->count) {
+                    *out = pickMove(mp->moves, mp->scores, mp->count, mp->next++);
+                    return true;
+                }
+                mp->stage = STAGE_BAD_NOISY;
+                if (mp->badNext < mp->noisyEnd) searchStats.stageReached[STAGE_BAD_NOISY]++;
+                break;
+
+            case STAGE_BAD_NOISY:
+                if (mp->badNext < mp->noisyEnd) {
+                    *out = pickMove(mp->moves, mp->scores, mp->noisyEnd, mp->badNext++);
+                    return true;
+                }
+                mp->stage = STAGE_DONE;
+                break;
+
+            case STAGE_DONE:
+                return false;
+        }
+    }
+}
+
+static void rewardQuietMove(Move m, int depth, int ply, int color) {
+    PackedMove pm = packMove(m);
+    if (killerMoves[ply][0] != pm) {
+        killerMoves[ply][1] = killerMoves[ply][0];
+        killerMoves[ply][0] = pm;
+    }
+    int *h = &historyScores[color][m.from_r * 8 + m.from_c][m.to_r * 8 + m.to_c];
+    *h += depth * depth;
+    if (*h > (1 << 26)) *h /= 2;
+}
+
+// Stops the search once the node or time budget is spent or searchAbort is
+// set; polled every 1024 nodes so the clock is not read at every node.
+static void checkSearchLimits() {
+    if ((searchNodeLimit && searchNodes >= searchNodeLimit) ||
+        (searchDeadline && SDL_GetPerformanceCounter() >= searchDeadline) ||
+        (searchAbort && SDL_AtomicGet(searchAbort))) {
+        searchStopped = true;
+    }
+}
+
+// Budget for the next analyzePosition() calls: nodes and/or milliseconds per
+// search, 0 for no limit. The first iteration always completes.
+void setSearchLimits(Uint64 nodes, int millis) {
+    searchNodeLimit = nodes;
+    searchDeadline = millis > 0 ? SDL_GetPerformanceCounter() + SDL_GetPerformanceFrequency() * millis / 1000 : 0;
+}
+
+// Captures (and queen promotions) only, until the position is quiet; the
+// side to move may always stand pat on the static evaluation. Captures that
+// lose material by SEE are not searched.
+int quiesce(int alpha, int beta, int ply) {
+    searchNodes++;
+    searchStats.qnodes++;
+    if (ply > searchStats.seldepth) searchStats.seldepth = ply;
+    if (searchLimited && (searchNodes & 1023) == 0) checkSearchLimits();
+    if (searchStopped) return 0;
+    int color = currentTurn % 2;
+    int standPat = evaluate(color);
+    if (standPat >= beta || ply >= SEARCH_MAX_PLY - 1) return standPat;
+    if (standPat > alpha) alpha = standPat;
+
+    Move list[MAX_MOVES];
+    int scores[MAX_MOVES];
+    int count = 0;
+    Move pseudo[MAX_MOVES];
+    int n = generateNoisyMoves(color, pseudo);
+    for (int i = 0; i < n; i++) {
+        if (!isCapture(pseudo[i]) && pseudo[i].promo != 'Q') continue;
+        int sc = scoreMove(pseudo[i], 0, ply, color);
+        if (sc < 0) continue;
+        list[count] = pseudo[i];
+        scores[count++] = sc;
+    }
+
+    int best = standPat;
+    for (int i = 0; i < count; i++) {
+        Move m = pickMove(list, scores, count, i);
+        Undo u;
+        makeMove(m, &u);
+        if (isKingInCheck(color)) {
+            unmakeMove(&u);
+            continue;
+        }
+        currentTurn++;
+        int val = -quiesce(-beta, -alpha, ply + 1);
+        currentTurn--;
+        unmakeMove(&u);
+        if (searchStopped) return 0;
+
+        if (val > best) best = val;
+        if (val > alpha) alpha = val;
+        if (alpha >= beta) break;
+    }
+    return best;
+}
+
+// Fail-soft principal variation search for the side to move. ply counts from
+// the root and is used for mate distances, killers and repetition checks.
+int alphabeta(int depth, int ply, int alpha, int beta, bool allowNull) {
+    int color = currentTurn % 2;
+    bool pvNode = beta - alpha > 1;
+    pvLength[ply] = ply;
+
+    // A repeat of any earlier position is scored as the draw it can be forced
+    // into; waiting for the third occurrence only wastes depth.
+    if (ply > 0 && (halfmoveClock >= FIFTY_MOVE_PLIES || repetitionCount() > 0)) return 0;
+
+    bool inCheck = isKingInCheck(color);
+    if (inCheck && searchOptions.checkExtensions) depth++;
+    if (depth <= 0) return quiesce(alpha, beta, ply);
+    searchNodes++;
+    if (ply > searchStats.seldepth) searchStats.seldepth = ply;
+    if (searchLimited && (searchNodes & 1023) == 0) checkSearchLimits();
+    if (searchStopped) return 0;
+    if (ply >= SEARCH_MAX_PLY - 1) return evaluate(color);
+
+    PackedMove hashMove = 0; // a8a8, never a real move
+    const TTEntry *e = &searchTT->entries[positionKey & searchTT->mask];
+    searchStats.ttProbes++;
+    if (e->bound != TT_NONE && e->key == positionKey) {
+        searchStats.ttHits++;
+        hashMove = e->move;
+        int score = scoreFromTT(e->score, ply);
+        if (!pvNode && e->depth >= depth &&
+            (e->bound == TT_EXACT || (e->bound == TT_LOWER && score >= beta) ||
+             (e->bound == TT_UPPER && score <= alpha))) {
+            return score;
+        }
+    }
+
+    int staticEval = inCheck ? -INF_SCORE : evaluate(color);
+
+    // Null move: if passing still fails high, a real move will too. With only
+    // a minor piece or rook left zugzwang is common and passing proves little,
+    // so the cutoff has to be confirmed by a reduced search without null moves.
+    if (searchOptions.nullMove && allowNull && !pvNode && !inCheck && depth >= 3 && staticEval >= beta) {
+        int material = nonPawnMaterial(color);
+        if (material > 0) {
+            int r = (depth >= 6) ? 3 : 2;
+            Undo u;
+            makeNullMove(&u);
+            currentTurn++;
+            int val = -alphabeta(depth - 1 - r, ply + 1, -beta, -beta + 1, false);
+            currentTurn--;
+            unmakeNullMove(&u);
+            if (searchStopped) return 0;
+            if (val >= beta) {
+                if (val >= MATE_BOUND) val = beta;
+                if (material > VALS['R'] || alphabeta(depth - r, ply, beta - 1, beta, false) >= beta) return val;
+            }
+        }
+    }
+
+    bool futile = searchOptions.futility && !pvNode && !inCheck && depth <= 2 && abs(alpha) < MATE_BOUND &&
+                  staticEval + FUTILITY_MARGIN[depth] <= alpha;
+
+    MovePicker picker;
+    initMovePicker(&picker, hashMove, ply, color);
+
+    int origAlpha = alpha;
+    int best = -INF_SCORE;
+    Move bestMove = {0, 0, 0, 0, 0};
+    int legal = 0;
+    Move m;
+    while (nextMove(&picker, &m)) {
+        bool quiet = !m.promo && !isCapture(m);
+        Undo u;
+        makeMove(m, &u);
+        if (isKingInCheck(color)) {
+            unmakeMove(&u);
+            continue;
+        }
+        legal++;
+        currentTurn++;
+        bool givesCheck = isKingInCheck(1 - color);
+
+        if (futile && quiet && !givesCheck && legal > 1) {
+            currentTurn--;
+            unmakeMove(&u);
+            continue;
+        }
+
+        int val;
+        if (legal == 1) {
+            val = -alphabeta(depth - 1, ply + 1, -beta, -alpha, true);
+        } else {
+            int reduction = 0;
+            if (searchOptions.lmr && depth >= 3 && legal > 3 && quiet && !inCheck && !givesCheck) {
+                reduction = (legal > 6 && depth >= 6) ? 2 : 1;
+            }
+            int lo = searchOptions.pvs ? -alpha - 1 : -beta;
+            val = -alphabeta(depth - 1 - reduction, ply + 1, lo, -alpha, true);
+            if (reduction && val > alpha) val = -alphabeta(depth - 1, ply + 1, lo, -alpha, true);
+            if (searchOptions.pvs && val > alpha && val < beta) {
+                val = -alphabeta(depth - 1, ply + 1, -beta, -alpha, true);
+            }
+        }
+        currentTurn--;
+        unmakeMove(&u);
+        if (searchStopped) return 0;
+
+        if (val > best) {
+            best = val;
+            bestMove = m;
+        }
+        if (val > alpha) {
+            alpha = val;
+            pvTable[ply][ply] = packMove(m);
+            memcpy(&pvTable[ply][ply + 1], &pvTable[ply + 1][ply + 1],
+                   (pvLength[ply + 1] - ply - 1) * sizeof(PackedMove));
+            pvLength[ply] = pvLength[ply + 1];
+        }
+        if (alpha >= beta) {
+            searchStats.cutoffs++;
+            if (legal == 1) searchStats.firstMoveCutoffs++;
+            if (quiet) rewardQuietMove(m, depth, ply, color);
+            break;
+        }
+    }
+
+    if (legal == 0) return inCheck ? -MATE_SCORE + ply : 0;
+
+    TTBound bound = (best >= beta) ? TT_LOWER : (best > origAlpha) ? TT_EXACT : TT_UPPER;
+    storeTT(depth, ply, best, bound, bestMove);
+    return best;
+}
+
+// Searches the root moves in order; the first gets the full window, the rest
+// a zero window with a re-search when they turn out better. The best move and
+// its principal variation go to line.
+static int searchRoot(Move *list, int count, int depth, int alpha, int beta, int *bestIndex, PVLine *line) {
+    int best = -INF_SCORE;
+    *bestIndex = 0;
+    for (int i = 0; i < count; i++) {
+        Undo u;
+        makeMove(list[i], &u);
+        currentTurn++;
+        int val;
+        if (i == 0 || !searchOptions.pvs) {
+            val = -alphabeta(depth - 1, 1, -beta, -alpha, true);
+        } else {
+            val = -alphabeta(depth - 1, 1, -alpha - 1, -alpha, true);
+            if (val > alpha && val < beta) val = -alphabeta(depth - 1, 1, -beta, -alpha, true);
+        }
+        currentTurn--;
+        unmakeMove(&u);
+        if (searchStopped) break;
+
+        if (val > best) {
+            best = val;
+            *bestIndex = i;
+            line->pv[0] = packMove(list[i]);
+            memcpy(&line->pv[1], &pvTable[1][1], (pvLength[1] - 1) * sizeof(PackedMove));
+            line->length = pvLength[1];
+        }
+        if (val > alpha) alpha = val;
+        if (alpha >= beta) break;
+    }
+    line->score = best;
+    line->depth = depth;
+    return best;
+}
+
+// Iterative deepening to depth for the side to move, keeping the multiPV
+// best root moves (at most the number of legal moves; returns how many).
+// Line k is found by searching the root moves not already taken by lines
+// 0..k-1, so the lines share one tree walk per depth and one transposition
+// table. From the second iteration on each line's root window is centred on
+// its previous score and widened to the failing side when the result falls
+// outside it. A search stopped by setSearchLimits() returns the lines of the
+// last completed depth. If no table can be allocated it searches with a
+// single entry, which is slower but still correct.
+int analyzePosition(int depth, int multiPV, PVLine *lines, PVCallback onDepth, void *ctx) {
+    if (!searchTT || searchTT == &noTT) {
+        noTT.entries = &noTTEntry;
+        searchTT = (ownTT.entries || initTransTable(&ownTT, TT_DEFAULT_MB)) ? &ownTT : &noTT;
+    }
+    memset(killerMoves, 0, sizeof(killerMoves));
+    memset(historyScores, 0, sizeof(historyScores));
+    searchNodes = 0;
+    searchStopped = searchLimited = false;
+    memset(&searchStats, 0, sizeof(searchStats));
+    Uint64 start = SDL_GetPerformanceCounter(), iterationStart = start;
+    Uint64 zone = traceBegin();
+
+    int color = currentTurn % 2;
+    Move list[MAX_MOVES], savedList[MAX_MOVES];
+    PVLine saved[MULTI_PV_MAX];
+    int scores[MAX_MOVES];
+    int count = generateLegalMoves(color, list);
+    if (multiPV > count) multiPV = count;
+    if (multiPV > MULTI_PV_MAX) multiPV = MULTI_PV_MAX;
+    if (multiPV <= 0) return 0;
+
+    const TTEntry *e = &searchTT->entries[positionKey & searchTT->mask];
+    PackedMove hashMove = (e->key == positionKey) ? e->move : 0;
+    for (int i = 0; i < count; i++) scores[i] = scoreMove(list[i], hashMove, 0, color);
+    for (int i = 0; i < count; i++) pickMove(list, scores, count, i);
+    for (int k = 0; k < multiPV; k++) lines[k].score = 0;
+
+    for (int d = 1; d <= depth; d++) {
+        Uint64 iterationNodes = searchNodes;
+        memcpy(saved, lines, multiPV * sizeof(PVLine));
+        memcpy(savedList, list, count * sizeof(Move));
+        for (int k = 0; k < multiPV && !searchStopped; k++) {
+            int score = lines[k].score;
+            int window = (searchOptions.aspiration && d > 1) ? ASPIRATION_WINDOW : INF_SCORE;
+            int alpha = (score - window < -INF_SCORE) ? -INF_SCORE : score - window;
+            int beta = (score + window > INF_SCORE) ? INF_SCORE : score + window;
+            int bestIndex;
+            for (;;) {
+                int val = searchRoot(list + k, count - k, d, alpha, beta, &bestIndex, &lines[k]);
+                if (searchStopped) {
+                    break;
+                } else if (val <= alpha && alpha > -INF_SCORE) {
+                    alpha = -INF_SCORE;
+                } else if (val >= beta && beta < INF_SCORE) {
+                    beta = INF_SCORE;
+                } else {
+                    break;
+                }
+            }
+            // The line's move takes slot k, the others keep their order
+            Move best = list[k + bestIndex];
+            memmove(list + k + 1, list + k, bestIndex * sizeof(Move));
+            list[k] = best;
+        }
+
+        if (searchStopped) {
+            memcpy(lines, saved, multiPV * sizeof(PVLine));
+            memcpy(list, savedList, count * sizeof(Move));
+            break;
+        }
+        searchLimited = true;
+        if (zone) traceEndValue(iterationStart, "search iteration", "depth", d);
+        Uint64 now = SDL_GetPerformanceCounter();
+        searchStats.depth = d;
+        searchStats.depthNodes[d] = searchNodes - iterationNodes;
+        searchStats.depthSeconds[d] = (double) (now - iterationStart) / SDL_GetPerformanceFrequency();
+        searchStats.nodes = searchNodes;
+        searchStats.seconds = (double) (now - start) / SDL_GetPerformanceFrequency();
+        iterationStart = now;
+
+        // Later lines can come back better than earlier ones; rank them
+        for (int k = 1; k < multiPV; k++) {
+            for (int j = k; j > 0 && lines[j].score > lines[j - 1].score; j--) {
+                PVLine t = lines[j];
+                lines[j] = lines[j - 1];
+                lines[j - 1] = t;
+                Move m = list[j];
+                list[j] = list[j - 1];
+                list[j - 1] = m;
+            }
+        }
+        if (onDepth) onDepth(d, lines, multiPV, ctx);
+    }
+    // A stopped iteration's work still counts
+    searchStats.nodes = searchNodes;
+    searchStats.seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    traceEndValue(zone, "analyzePosition", "depth", searchStats.depth);
+    return multiPV;
+}
+
+void mergeSearchStats(SearchStats *total, const SearchStats *s) {
+    total->nodes += s->nodes;
+    total->qnodes += s->qnodes;
+    total->evalCalls += s->evalCalls;
+    total->movegenCalls += s->movegenCalls;
+    total->ttProbes += s->ttProbes;
+    total->ttHits += s->ttHits;
+    total->ttStores += s->ttStores;
+    total->pawnProbes += s->pawnProbes;
+    total->pawnHits += s->pawnHits;
+    total->cutoffs += s->cutoffs;
+    total->firstMoveCutoffs += s->firstMoveCutoffs;
+    total->pickerNodes += s->pickerNodes;
+    for (int i = 0; i < STAGE_DONE; i++) total->stageReached[i] += s->stageReached[i];
+    if (s->depth > total->depth) total->depth = s->depth;
+    if (s->seldepth > total->seldepth) total->seldepth = s->seldepth;
+    total->seconds += s->seconds;
+    for (int d = 0; d < SEARCH_MAX_PLY; d++) {
+        total->depthNodes[d] += s->depthNodes[d];
+        total->depthSeconds[d] += s->depthSeconds[d];
+    }
+}
+
+// Growth per ply of the iteration tree over the last two completed depths,
+// which evens out the odd/even swing of alpha-beta; 0 before three
+// iterations are done.
+double effectiveBranchingFactor(const SearchStats *s) {
+    if (s->depth < 3 || s->depthNodes[s->depth - 2] == 0) return 0.0;
+    return sqrt((double) s->depthNodes[s->depth] / s->depthNodes[s->depth - 2]);
+}
+
+double statRate(Uint64 part, Uint64 whole) {
+    return whole ? (double) part / whole : 0.0;
+}
+
+void appendSearchStatsJSON(TextBuffer *out, const SearchStats *s) {
+    textPrintf(out, "{\"depth\": %d, \"seldepth\": %d, \"nodes\": %llu, \"qnodes\": %llu, ", s->depth,
+               s->seldepth, (unsigned long long) s->nodes, (unsigned long long) s->qnodes);
+    textPrintf(out, "\"time_ms\": %.3f, \"nps\": %.0f, \"ebf\": %.3f, ", s->seconds * 1000.0,
+               s->seconds > 0 ? s->nodes / s->seconds : 0.0, effectiveBranchingFactor(s));
+    textPrintf(out, "\"cutoffs\": %llu, \"first_move_cutoff_rate\": %.4f, ", (unsigned long long) s->cutoffs,
+               statRate(s->firstMoveCutoffs, s->cutoffs));
+    textPrintf(out, "\"tt_probes\": %llu, \"tt_hits\": %llu, \"tt_stores\": %llu, \"tt_hit_rate\": %.4f, ",
+               (unsigned long long) s->ttProbes, (unsigned long long) s->ttHits, (unsigned long long) s->ttStores,
+               statRate(s->ttHits, s->ttProbes));
+    textPrintf(out, "\"pawn_probes\": %llu, \"pawn_hit_rate\": %.4f, ", (unsigned long long) s->pawnProbes,
+               statRate(s->pawnHits, s->pawnProbes));
+    textPrintf(out, "\"eval_calls\": %llu, \"movegen_calls\": %llu, \"picker_nodes\": %llu, \"stages_reached\": {",
+               (unsigned long long) s->evalCalls, (unsigned long long) s->movegenCalls,
+               (unsigned long long) s->pickerNodes);
+    for (int i = 0; i < STAGE_DONE; i++) {
+        textPrintf(out, "%s\"%s\": %llu", i ? ", " : "", MOVE_STAGE_NAMES[i], (unsigned long long) s->stageReached[i]);
+    }
+    textPrintf(out, "}, \"iterations\": [");
+    for (int d = 1; d <= s->depth; d++) {
+        textPrintf(out, "%s{\"depth\": %d, \"nodes\": %llu, \"time_ms\": %.3f}", d > 1 ? ", " : "", d,
+                   (unsigned long long) s->depthNodes[d], s->depthSeconds[d] * 1000.0);
+    }
+    textAppend(out, "]}", 2);
+}
+
+// Long algebraic notation as UCI uses it: e2e4, e7e8q.
+int formatUCIMove(Move m, char *buf) {
+    int n = sprintf(buf, "%c%c%c%c", 'a' + m.from_c, '8' - m.from_r, 'a' + m.to_c, '8' - m.to_r);
+    if (m.promo) buf[n++] = (char) tolower(m.promo);
+    buf[n] = '\0';
+    return n;
+}
+
+// PVCallback printing one UCI "info" line per line of the completed depth.
+void printUCIInfo(int depth, const PVLine *lines, int count, void *ctx) {
+    (void) ctx;
+    const SearchStats *s = &searchStats;
+    for (int i = 0; i < count; i++) {
+        const PVLine *l = &lines[i];
+        printf("info depth %d seldepth %d multipv %d score ", depth, s->seldepth, i + 1);
+        if (l->score >= MATE_BOUND) printf("mate %d", (MATE_SCORE - l->score + 1) / 2);
+        else if (l->score <= -MATE_BOUND) printf("mate -%d", (MATE_SCORE + l->score) / 2);
+        else printf("cp %d", l->score);
+        printf(" nodes %llu nps %.0f time %.0f hashfull %d pv", (unsigned long long) s->nodes,
+               s->seconds > 0 ? s->nodes / s->seconds : 0.0, s->seconds * 1000.0,
+               searchTT ? transTableFill(searchTT) : 0);
+        for (int k = 0; k < l->length; k++) {
+            char move[8];
+            formatUCIMove(unpackMove(l->pv[k]), move);
+            printf(" %s", move);
+        }
+        printf("\n");
+    }
+}
+
+// Best move for the side to move, with its score from that side's view.
+Move findBestMove(int depth, int *outScore) {
+    PVLine line;
+    if (analyzePosition(depth, 1, &line, NULL, NULL) == 0) {
+        *outScore = isKingInCheck(currentTurn % 2) ? -MATE_SCORE : 0;
+        return (Move){0, 0, 0, 0, 0};
+    }
+    *outScore = line.score;
+    return unpackMove(line.pv[0]);
+}
+
+// "+0.35" in pawns, or "#3" / "#-2" for mates in moves.
+int formatScore(int score, char *buf, size_t size) {
+    if (score >= MATE_BOUND) return snprintf(buf, size, "#%d", (MATE_SCORE - score + 1) / 2);
+    if (score <= -MATE_BOUND) return snprintf(buf, size, "#-%d", (MATE_SCORE + score) / 2);
+    return snprintf(buf, size, "%+.2f", score / 100.0);
+}
+
+// Writes the first maxMoves moves of line as SAN, playing them on the board
+// and taking them back again. The line stops at the first move that is not
+// legal here, as a line from another position would corrupt the board.
+int formatPVLine(const PVLine *line, int maxMoves, char *buf, size_t size) {
+    Undo undo[SEARCH_MAX_PLY];
+    int played = 0, n = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < line->length && i < maxMoves; i++) {
+        Move m = unpackMove(line->pv[i]);
+        int color = currentTurn % 2;
+        if (!isPseudoLegal(m, color) || !isMoveLegal(m, color)) break;
+        char san[PGN_SAN_LEN];
+        encodeSAN(m, san);
+        int len = snprintf(buf + n, size - n, "%s%s", n ? " " : "", san);
+        if (len < 0 || (size_t) (n + len) >= size) break;
+        n += len;
+        makeMove(m, &undo[played++]);
+        currentTurn++;
+    }
+    while (played > 0) {
+        currentTurn--;
+        unmakeMove(&undo[--played]);
+    }
+    return n;
+}
+
+void engineMove(int depth) {
+    Uint64 zone = traceBegin();
+    int score;
+    Move m = findBestMove(depth, &score);
+
+    generateMoves(currentTurn % 2);
+    if (moveCount == 0 || drawReason()) return; // game already over, the status line says why
+
+    playMove(m);
+
+    // Force redraw of board and back button
+    SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255);
+    SDL_RenderClear(renderer);
+    renderBoardWithBack();
+    SDL_RenderPresent(renderer);
+    Uint64 delay = traceBegin();
+    SDL_Delay(200);
+    traceEnd(delay, "SDL_Delay");
+
+    int nxtColor = currentTurn % 2;
+    bool inChk = isKingInCheck(nxtColor);
+    bool canMv = hasAnyLegalMove(nxtColor);
+    const char *draw = canMv ? drawReason() : NULL;
+
+    if (!canMv) {
+        if (inChk) {
+            printf("Checkmate! %s wins!\n", (nxtColor == 0) ? "Black" : "White");
+        } else {
+            printf("Stalemate! It's a draw.\n");
+        }
+        stopJournal(true);
+    } else if (draw) {
+        printf("%s.\n", draw);
+        stopJournal(true);
+    }
+
+    if (inChk) {
+        printf("Check!\n");
+    }
+
+    // Clear any old selection
+    pieceSelected = false;
+    memset(validMoves, 0, sizeof(validMoves));
+    traceEnd(zone, "engineMove");
+}
+
+// -------------------------
+// Mate Solver
+// -------------------------
+
+// Depth-first proof-number search. A node's (phi, delta) are its proof and
+// disproof numbers seen from the side to move: phi = 0 means that side wins
+// (the attacker mates, or the defender escapes), delta = 0 that it loses.
+// The attacker only plays checks, so every defender node is in check and a
+// side without moves has lost. Nodes are keyed by position and attacker moves
+// left, which also keeps cycles out of the table.
+typedef struct {
+    Uint64 key;
+    Uint32 phi, delta;
+} MateEntry;
+
+static _Thread_local MateEntry *mateTable = NULL;
+static _Thread_local Uint64 mateMask = 0;
+static _Thread_local Uint64 mateNodes = 0, mateNodeLimit = 0;
+
+void freeMateTable() {
+    free(mateTable);
+    mateTable = NULL;
+    mateMask = 0;
+}
+
+static bool initMateTable(int megabytes) {
+    size_t n = 1;
+    while (n * 2 * sizeof(MateEntry) <= ((size_t) megabytes << 20)) n *= 2;
+    mateTable = calloc(n, sizeof(MateEntry));
+    if (!mateTable) {
+        fprintf(stderr, "Out of memory allocating the mate table\n");
+        return false;
+    }
+    mateMask = n - 1;
+    return true;
+}
+
+static Uint64 mateKey(int remaining) {
+    return positionKey ^ ((Uint64) (remaining + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+static void lookupMate(Uint64 key, Uint32 *phi, Uint32 *delta) {
+    const MateEntry *e = &mateTable[key & mateMask];
+    if (e->key == key) {
+        *phi = e->phi;
+        *delta = e->delta;
+    } else {
+        *phi = *delta = 1;
+    }
+}
+
+static void storeMate(Uint64 key, Uint32 phi, Uint32 delta) {
+    MateEntry *e = &mateTable[key & mateMask];
+    e->key = key;
+    e->phi = phi;
+    e->delta = delta;
+}
+
+// The attacker's legal checking moves, or all of the defender's legal moves.
+static int mateChildren(bool attacking, Move *list) {
+    int color = currentTurn % 2;
+    Move pseudo[MAX_MOVES];
+    int count = generatePseudoMoves(color, pseudo), n = 0;
+    for (int i = 0; i < count; i++) {
+        Undo u;
+        makeMove(pseudo[i], &u);
+        if (!isKingInCheck(color) && (!attacking || isKingInCheck(1 - color))) list[n++] = pseudo[i];
+        unmakeMove(&u);
+    }
+    return n;
+}
+
+static void mateMID(int remaining, Uint32 thPhi, Uint32 thDelta, int attacker) {
+    mateNodes++;
+    bool attacking = currentTurn % 2 == attacker;
+    Uint64 key = mateKey(remaining);
+
+    // Out of attacker moves: the defender (in check) escapes unless mated now
+    if (!attacking && remaining == 0) {
+        if (hasAnyLegalMove(currentTurn % 2)) storeMate(key, 0, PN_INF);
+        else storeMate(key, PN_INF, 0);
+        return;
+    }
+
+    Move list[MAX_MOVES];
+    Uint64 keys[MAX_MOVES];
+    int count = mateChildren(attacking, list);
+    if (count == 0) {
+        storeMate(key, PN_INF, 0);
+        return;
+    }
+    int childRemaining = attacking ? remaining - 1 : remaining;
+    for (int i = 0; i < count; i++) {
+        Undo u;
+        makeMove(list[i], &u);
+        keys[i] = mateKey(childRemaining);
+        unmakeMove(&u);
+    }
+
+    for (;;) {
+        Uint32 phi = PN_INF, delta2 = PN_INF, bestPhi = 0;
+        Uint64 delta = 0;
+        int best = 0;
+        for (int i = 0; i < count; i++) {
+            Uint32 cPhi, cDelta;
+            lookupMate(keys[i], &cPhi, &cDelta);
+            delta += cPhi;
+            if (cDelta < phi) {
+                delta2 = phi;
+                phi = cDelta;
+                best = i;
+                bestPhi = cPhi;
+            } else if (cDelta < delta2) {
+                delta2 = cDelta;
+            }
+        }
+        if (delta > PN_INF) delta = PN_INF;
+
+        if (phi >= thPhi || delta >= thDelta || mateNodes >= mateNodeLimit) {
+            storeMate(key, phi, (Uint32) delta);
+            return;
+        }
+
+        Uint64 childPhi = (Uint64) thDelta - delta + bestPhi;
+        Uint32 childDelta = (thPhi < delta2 + 1) ? thPhi : delta2 + 1;
+        Undo u;
+        makeMove(list[best], &u);
+        currentTurn++;
+        mateMID(childRemaining, childPhi > PN_INF ? PN_INF : (Uint32) childPhi, childDelta, attacker);
+        currentTurn--;
+        unmakeMove(&u);
+    }
+}
+
+// Follows proven nodes from the root: a checking move whose defender node is
+// lost, then the defence that holds out longest (judged by the longest mate
+// each reply was disproven for while the lengths were tried), until mate.
+static void extractMateLine(int remaining, int attacker, PVLine *line) {
+    Undo undo[2 * MATE_MAX_MOVES];
+    line->length = 0;
+    while (line->length < 2 * MATE_MAX_MOVES) {
+        bool attacking = currentTurn % 2 == attacker;
+        Move list[MAX_MOVES];
+        int count = mateChildren(attacking, list), next = -1, longest = 0;
+        int childRemaining = attacking ? remaining - 1 : remaining;
+        for (int i = 0; i < count && !(attacking && next >= 0); i++) {
+            Uint32 phi, delta;
+            makeMove(list[i], &undo[line->length]);
+            lookupMate(mateKey(childRemaining), &phi, &delta);
+            if (attacking ? delta == 0 : phi == 0) {
+                int len = 1;
+                for (int k = childRemaining - 1; !attacking && k > 0; k--) {
+                    lookupMate(mateKey(k), &phi, &delta);
+                    if (delta == 0) {
+                        len = k + 1;
+                        break;
+                    }
+                }
+                if (next < 0 || len > longest) {
+                    next = i;
+                    longest = len;
+                }
+            }
+            unmakeMove(&undo[line->length]);
+        }
+        if (next < 0) break;
+        line->pv[line->length] = packMove(list[next]);
+        makeMove(list[next], &undo[line->length++]);
+        currentTurn++;
+        remaining = childRemaining;
+    }
+    for (int i = line->length - 1; i >= 0; i--) {
+        currentTurn--;
+        unmakeMove(&undo[i]);
+    }
+}
+
+// Looks for a mate by the side to move in at most maxMoves moves, trying each
+// length in turn so the first one found is the shortest. maxNodes (0 for no
+// limit) bounds the work over all lengths.
+bool solveMate(int maxMoves, Uint64 maxNodes, MateResult *out) {
+    memset(out, 0, sizeof(*out));
+    if (!mateTable && !initMateTable(MATE_TT_MB)) return false;
+    memset(mateTable, 0, (mateMask + 1) * sizeof(MateEntry));
+    if (maxMoves > MATE_MAX_MOVES) maxMoves = MATE_MAX_MOVES;
+    mateNodes = 0;
+    mateNodeLimit = maxNodes ? maxNodes : ~0ULL;
+
+    int attacker = currentTurn % 2;
+    for (int n = 1; n <= maxMoves && mateNodes < mateNodeLimit; n++) {
+        mateMID(n, PN_INF, PN_INF, attacker);
+        Uint32 phi, delta;
+        lookupMate(mateKey(n), &phi, &delta);
+        if (phi == 0) {
+            out->found = true;
+            out->mateIn = n;
+            extractMateLine(n, attacker, &out->line);
+            out->line.depth = n;
+            out->line.score = MATE_SCORE - (2 * n - 1);
+            break;
+        }
+    }
+    out->nodes = mateNodes;
+    return out->found;
+}
+
+// -------------------------
+// Rendering / UI
+// -------------------------
+
+void drawTextWithFont(const char *text, SDL_Rect rect, TTF_Font *fontToUse) {
+    Uint64 zone = traceBegin();
+    SDL_Color color = {0, 0, 0, 255};
+    SDL_Surface *surface = TTF_RenderText_Blended(fontToUse, text, color);
+    if (!surface) return;
+    SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_FreeSurface(surface);
+    if (!tex) return;
+
+    int texW = 0, texH = 0;
+    SDL_QueryTexture(tex, NULL, NULL, &texW, &texH);
+
+    SDL_Rect dst = {
+        rect.x + (rect.w - texW) / 2,
+        rect.y + (rect.h - texH) / 2,
+        texW, texH
+    };
+    SDL_RenderCopy(renderer, tex, NULL, &dst);
+    SDL_DestroyTexture(tex);
+    traceEnd(zone, "drawText");
+}
+
+void drawText(const char *text, SDL_Rect rect) {
+    drawTextWithFont(text, rect, font);
+}
+
+void drawButton(SDL_Rect rect, const char *text) {
+    // Pinkish fill
+    SDL_SetRenderDrawColor(renderer, 230, 168, 175, 255);
+    SDL_RenderFillRect(renderer, &rect);
+
+    // Border
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderDrawRect(renderer, &rect);
+
+    // Text
+    drawText(text, rect);
+}
+
+void renderMainMenu() {
+    SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255); // Light pink
+    SDL_RenderClear(renderer);
+
+    drawButton(playButton, "Play Human");
+    drawButton(botButton, "Play with Bot");
+    drawButton(pgnButton, "Play again");
+
+    SDL_RenderPresent(renderer);
+}
+
+void getPiecePath(char piece, char *outPath) {
+    if (piece == ' ') {
+        outPath[0] = '\0';
+        return;
+    }
+    const char *color = isupper(piece) ? "white" : "black";
+    char type = tolower(piece);
+    const char *name;
+
+    switch (type) {
+        case 'p': name = "pawn";
+            break;
+        case 'r': name = "rook";
+            break;
+        case 'n': name = "knight";
+            break;
+        case 'b': name = "bishop";
+            break;
+        case 'q': name = "queen";
+            break;
+        case 'k': name = "king";
+            break;
+        default: name = "unknown";
+            break;
+    }
+    sprintf(outPath, "%s/%s_%s.png", imageBasePath, color, name);
+}
+
+void renderBoard() {
+    Uint64 zone = traceBegin();
+    for (int row = 0; row < BOARD_SIZE; row++) {
+        for (int col = 0; col < BOARD_SIZE; col++) {
+            SDL_Rect tile = {col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+            bool light = ((row + col) % 2 == 0);
+
+            if (light) {
+                SDL_SetRenderDrawColor(renderer, 240, 217, 181, 255);
+            } else {
+                SDL_SetRenderDrawColor(renderer, 181, 136, 99, 255);
+            }
+            SDL_RenderFillRect(renderer, &tile);
+
+            // Highlight valid‐move squares
+            if (validMoves[row][col]) {
+                SDL_SetRenderDrawColor(renderer, 102, 240, 102, 100);
+                SDL_RenderFillRect(renderer, &tile);
+            }
+
+            // Highlight selected square
+            if (pieceSelected && row == selectedRow && col == selectedCol) {
+                SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+                SDL_RenderDrawRect(renderer, &tile);
+            }
+
+            // Draw piece if any
+            char piece = board[row][col];
+            if (piece != ' ' && textures[(int) piece]) {
+                SDL_RenderCopy(renderer, textures[(int) piece], NULL, &tile);
+            }
+        }
+    }
+    traceEnd(zone, "renderBoard");
+}
+
+void drawCapturedPieces() {
+    // Captured by White (black pieces taken by white)
+    SDL_Rect label1 = {BOARD_WIDTH + 20, WINDOW_HEIGHT - 120, 260, 20};
+    drawTextWithFont("Captured by White:", label1, smallFont);
+
+    const int CAPSZ = 25;
+    SDL_Rect blackRect = {BOARD_WIDTH + 20, label1.y + 25, CAPSZ, CAPSZ};
+    for (int i = 0; i < blackCapCount; i++) {
+        char piece = blackCaptured[i];
+        if (textures[(int) piece]) {
+            SDL_RenderCopy(renderer, textures[(int) piece], NULL, &blackRect);
+            blackRect.x += CAPSZ + 2;
+        }
+    }
+
+    // Captured by Black (white pieces taken by black)
+    SDL_Rect label2 = {BOARD_WIDTH + 20, blackRect.y + 35, 260, 20};
+    drawTextWithFont("Captured by Black:", label2, smallFont);
+
+    SDL_Rect whiteRect = {BOARD_WIDTH + 20, label2.y + 25, CAPSZ, CAPSZ};
+    for (int i = 0; i < whiteCapCount; i++) {
+        char piece = whiteCaptured[i];
+        if (textures[(int) piece]) {
+            SDL_RenderCopy(renderer, textures[(int) piece], NULL, &whiteRect);
+            whiteRect.x += CAPSZ + 2;
+        }
+    }
+}
+
+const char *getGameStatusText() {
+    int color = currentTurn % 2;
+    bool inCheck = isKingInCheck(color);
+    bool canMove = hasAnyLegalMove(color);
+
+    if (!canMove) {
+        if (inCheck) {
             return (color == 0) ? "Checkmate! Black wins" : "Checkmate! White wins";
         } else {
-            return "Stalemate";
+            return "Stalemate";
+        }
+    }
+    const char *draw = drawReason();
+    if (draw) return draw;
+    if (inCheck) {
+        return "Check";
+    }
+    return "";
+}
+
+void drawTurnIndicator(int turn) {
+    const char *turnText = (turn % 2 == 0) ? "White's Turn" : "Black's Turn";
+    SDL_Rect textRect = {BOARD_WIDTH + 20, 100, 260, 40};
+    drawText(turnText, textRect);
+
+    const char *status = getGameStatusText();
+    if (strlen(status) > 0) {
+        SDL_Rect statusRect = {BOARD_WIDTH + 20, 140, 260, 30};
+        drawTextWithFont(status, statusRect, smallFont);
+    }
+
+    int variations = countVariations();
+    if (history.cursor < history.count || variations > 0) {
+        char review[64];
+        int n = snprintf(review, sizeof(review), "Reviewing ply %d of %d", history.cursor, history.count);
+        if (variations > 0) snprintf(review + n, sizeof(review) - n, ", %d more (V)", variations);
+        SDL_Rect reviewRect = {BOARD_WIDTH + 20, 170, 260, 30};
+        drawTextWithFont(review, reviewRect, smallFont);
+    }
+}
+
+static int analysisWorkerMain(void *data) {
+    AnalysisWorker *w = data;
+    headless = true;
+    searchAbort = &w->stop;
+    SDL_LockMutex(w->lock);
+    while (!w->quit) {
+        if (!w->pending) {
+            SDL_CondWait(w->wake, w->lock);
+            continue;
+        }
+        w->pending = false;
+        SDL_AtomicSet(&w->stop, 0);
+        Uint64 key = w->key;
+        restorePosition(&w->pos);
+        memcpy(keyHistory, w->keys, w->keyCount * sizeof(Uint64));
+        keyTop = w->keyCount;
+        keyHistory[keyTop] = positionKey;
+        SDL_UnlockMutex(w->lock);
+
+        PVLine lines[ANALYSIS_LINES];
+        Uint64 zone = traceBegin();
+        int count = analyzePosition(ANALYSIS_DEPTH, ANALYSIS_LINES, lines, NULL, NULL);
+        traceEnd(zone, "analysis");
+
+        SDL_LockMutex(w->lock);
+        if (!SDL_AtomicGet(&w->stop)) {
+            memcpy(w->lines, lines, count * sizeof(PVLine));
+            w->count = count;
+            w->stats = searchStats;
+            w->resultKey = key;
+        }
+    }
+    SDL_UnlockMutex(w->lock);
+    freeTransTable(&ownTT);
+    return 0;
+}
+
+static bool startAnalysisWorker() {
+    AnalysisWorker *w = &analysisWorker;
+    if (w->thread) return true;
+    memset(w, 0, sizeof(*w));
+    w->lock = SDL_CreateMutex();
+    w->wake = SDL_CreateCond();
+    w->thread = (w->lock && w->wake) ? SDL_CreateThread(analysisWorkerMain, "analysis", w) : NULL;
+    if (!w->thread) {
+        fprintf(stderr, "Could not start the analysis thread: %s\n", SDL_GetError());
+        if (w->wake) SDL_DestroyCond(w->wake);
+        if (w->lock) SDL_DestroyMutex(w->lock);
+        memset(w, 0, sizeof(*w));
+        return false;
+    }
+    return true;
+}
+
+void stopAnalysisWorker() {
+    AnalysisWorker *w = &analysisWorker;
+    if (!w->thread) return;
+    SDL_LockMutex(w->lock);
+    w->quit = true;
+    SDL_AtomicSet(&w->stop, 1);
+    SDL_CondSignal(w->wake);
+    SDL_UnlockMutex(w->lock);
+    SDL_WaitThread(w->thread, NULL);
+    SDL_DestroyCond(w->wake);
+    SDL_DestroyMutex(w->lock);
+    memset(w, 0, sizeof(*w));
+}
+
+// Posts the board's position to the analysis thread when it changes, and
+// takes over the thread's lines once it has finished with that position.
+void updateAnalysis() {
+    if (!analysisEnabled || awaitingPromotion) return;
+    if (!startAnalysisWorker()) {
+        analysisEnabled = false;
+        return;
+    }
+    AnalysisWorker *w = &analysisWorker;
+    Uint64 key = positionKey ^ (Uint64) history.cursor;
+    if (key != analysisRequest) {
+        analysisRequest = key;
+        if (drawReason()) {
+            analysisKey = key;
+            analysisCount = 0;
+            return;
+        }
+        int n = halfmoveClock;
+        if (n > keyTop - keyFloor) n = keyTop - keyFloor;
+        if (n > KEY_HISTORY_SIZE - 1) n = KEY_HISTORY_SIZE - 1;
+        SDL_LockMutex(w->lock);
+        savePosition(&w->pos);
+        for (int i = 0; i < n; i++) w->keys[i] = keyHistory[(keyTop - n + i) & (KEY_HISTORY_SIZE - 1)];
+        w->keyCount = n;
+        w->key = key;
+        w->pending = true;
+        SDL_AtomicSet(&w->stop, 1);
+        SDL_CondSignal(w->wake);
+        SDL_UnlockMutex(w->lock);
+    }
+    if (analysisKey == key && analysisCount > 0) return;
+    SDL_LockMutex(w->lock);
+    if (w->resultKey == key && !w->pending) {
+        memcpy(analysisLines, w->lines, w->count * sizeof(PVLine));
+        analysisCount = w->count;
+        analysisStats = w->stats;
+        analysisKey = key;
+    }
+    SDL_UnlockMutex(w->lock);
+}
+
+void drawAnalysis() {
+    if (!analysisEnabled) return;
+    char text[128];
+    snprintf(text, sizeof(text), "Analysis, depth %d", analysisCount ? analysisLines[0].depth : 0);
+    SDL_Rect heading = {BOARD_WIDTH + 20, 260, 260, 20};
+    drawTextWithFont(text, heading, smallFont);
+
+    // Lines of an older position (the bot moves before the next frame's
+    // refresh) cannot be played out on this board
+    bool current = analysisKey == (positionKey ^ (Uint64) history.cursor);
+    for (int i = 0; current && i < analysisCount; i++) {
+        char score[16], pv[96];
+        formatScore(analysisLines[i].score, score, sizeof(score));
+        formatPVLine(&analysisLines[i], ANALYSIS_PV_MOVES, pv, sizeof(pv));
+        snprintf(text, sizeof(text), "%d. %s  %s", i + 1, score, pv);
+        SDL_Rect lineRect = {BOARD_WIDTH + 20, 285 + i * 24, 260, 20};
+        drawTextWithFont(text, lineRect, smallFont);
+    }
+
+    if (analysisCount > 0) {
+        const SearchStats *s = &analysisStats;
+        snprintf(text, sizeof(text), "%lluk nodes  EBF %.1f  TT %.0f%%  cut1 %.0f%%",
+                 (unsigned long long) (s->nodes / 1000), effectiveBranchingFactor(s),
+                 100.0 * statRate(s->ttHits, s->ttProbes), 100.0 * statRate(s->firstMoveCutoffs, s->cutoffs));
+        SDL_Rect statsRect = {BOARD_WIDTH + 20, 285 + analysisCount * 24, 260, 20};
+        drawTextWithFont(text, statsRect, smallFont);
+    }
+}
+
+void renderBoardWithBack() {
+    Uint64 zone = traceBegin();
+    renderBoard();
+    drawButton(backButton, "Back");
+    drawButton(savePGNButton, "Save");
+    drawTurnIndicator(currentTurn);
+    drawAnalysis();
+    drawCapturedPieces();
+    drawFrameGraph();
+    traceEnd(zone, "renderBoardWithBack");
+}
+
+void recordFrameTime(double millis) {
+    frameTimes[frameCount++ % FRAME_GRAPH_FRAMES] = (float) millis;
+}
+
+// Bars for the last FRAME_GRAPH_FRAMES frame times, newest on the right, on a
+// 0-100 ms scale with a mark at 50 ms.
+void drawFrameGraph() {
+    if (!frameGraphEnabled) return;
+    SDL_Rect area = {BOARD_WIDTH + 20, WINDOW_HEIGHT - 163, FRAME_GRAPH_FRAMES * 2, 38};
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderFillRect(renderer, &area);
+
+    int frames = frameCount < FRAME_GRAPH_FRAMES ? frameCount : FRAME_GRAPH_FRAMES;
+    float worst = 0;
+    for (int i = 0; i < frames; i++) {
+        float ms = frameTimes[(frameCount - frames + i) % FRAME_GRAPH_FRAMES];
+        if (ms > worst) worst = ms;
+        int h = (int) (ms * area.h / 100.0f);
+        if (h > area.h) h = area.h;
+        if (ms > 50.0f) {
+            SDL_SetRenderDrawColor(renderer, 220, 40, 40, 255);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 40, 160, 40, 255);
+        }
+        SDL_Rect bar = {area.x + (FRAME_GRAPH_FRAMES - frames + i) * 2, area.y + area.h - h, 2, h};
+        SDL_RenderFillRect(renderer, &bar);
+    }
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderDrawLine(renderer, area.x, area.y + area.h / 2, area.x + area.w - 1, area.y + area.h / 2);
+    SDL_RenderDrawRect(renderer, &area);
+
+    char text[64];
+    float last = frames ? frameTimes[(frameCount - 1) % FRAME_GRAPH_FRAMES] : 0;
+    snprintf(text, sizeof(text), "frame %.1f ms, worst %.0f ms", last, worst);
+    SDL_Rect label = {area.x, area.y - 18, area.w, 16};
+    drawTextWithFont(text, label, smallFont);
+}
+
+// Everything a frame does after input: refreshes the side panel analysis,
+// then draws and presents the current screen.
+void drawFrame() {
+    static bool firstBoardDrawn = false;
+    if (currentState == CHESS_BOARD) updateAnalysis();
+
+    SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255);
+    SDL_RenderClear(renderer);
+
+    if (currentState == MAIN_MENU) {
+        renderMainMenu();
+    } else if (currentState == CHESS_BOARD) {
+        renderBoardWithBack();
+
+        // Always render promotion options if needed
+        if (awaitingPromotion) {
+            const char *options = "qrbn";
+            for (int i = 0; i < 4; i++) {
+                char piece = (promoColor == 'w') ? toupper(options[i]) : tolower(options[i]);
+                SDL_Rect optRect = {BOARD_WIDTH + 40 + i * 60, 200, 50, 50};
+                SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+                SDL_RenderFillRect(renderer, &optRect);
+                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+                SDL_RenderDrawRect(renderer, &optRect);
+                if (textures[(int) piece]) {
+                    SDL_RenderCopy(renderer, textures[(int) piece], NULL, &optRect);
+                }
+            }
+        }
+
+        SDL_RenderPresent(renderer);
+
+        // As soon as we enter CHESS_BOARD, force an initial draw
+        if (!firstBoardDrawn) {
+            renderBoardWithBack();
+            SDL_RenderPresent(renderer);
+            firstBoardDrawn = true;
+        }
+    }
+}
+
+// -------------------------
+// Offscreen Rendering
+// -------------------------
+
+static _Thread_local SDL_Surface *offscreenSurface = NULL;
+
+// Points this thread's renderer at an in-memory surface (software renderer,
+// no window) and builds its textures from the shared piece atlas.
+bool initOffscreenRenderer(int width, int height) {
+    offscreenSurface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32);
+    if (!offscreenSurface) {
+        fprintf(stderr, "Offscreen surface error: %s\n", SDL_GetError());
+        return false;
+    }
+    renderer = SDL_CreateSoftwareRenderer(offscreenSurface);
+    if (!renderer) {
+        fprintf(stderr, "Software renderer error: %s\n", SDL_GetError());
+        SDL_FreeSurface(offscreenSurface);
+        offscreenSurface = NULL;
+        return false;
+    }
+    loadPieceTextures();
+    return true;
+}
+
+void cleanupOffscreenRenderer() {
+    freePieceTextures();
+    if (renderer) SDL_DestroyRenderer(renderer);
+    if (offscreenSurface) SDL_FreeSurface(offscreenSurface);
+    renderer = NULL;
+    offscreenSurface = NULL;
+}
+
+bool renderBoardToPNG(const char *path) {
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderClear(renderer);
+    renderBoard();
+    SDL_RenderPresent(renderer);
+    if (IMG_SavePNG(offscreenSurface, path) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n", path, IMG_GetError());
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    const char *outDir;
+    int every; // diagram every N plies; 0 = final position only
+    PGNGameQueue queue;
+    SDL_atomic_t diagrams;
+    SDL_atomic_t failures;
+} RenderBatchJob;
+
+typedef struct {
+    RenderBatchJob *job;
+    long game;
+} RenderPlyContext;
+
+static void renderBatchDiagram(RenderBatchJob *job, long game, int ply) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/game%05ld_ply%03d.png", job->outDir, game, ply);
+    if (renderBoardToPNG(path)) {
+        SDL_AtomicAdd(&job->diagrams, 1);
+    } else {
+        SDL_AtomicAdd(&job->failures, 1);
+    }
+}
+
+static void renderBatchOnPly(int ply, void *ctx) {
+    RenderPlyContext *rc = ctx;
+    if (ply % rc->job->every == 0) renderBatchDiagram(rc->job, rc->game, ply);
+}
+
+static int renderBatchWorker(void *data) {
+    RenderBatchJob *job = data;
+    headless = true;
+    PGNGame *game = malloc(sizeof(PGNGame));
+    if (!game || !initOffscreenRenderer(BOARD_WIDTH, BOARD_WIDTH)) {
+        free(game);
+        return 1;
+    }
+
+    while (popPGNGame(&job->queue, game)) {
+        RenderPlyContext rc = {job, game->number};
+        int plies = replayPGNGame(game, -1, job->every > 0 ? renderBatchOnPly : NULL, &rc);
+        if (plies < 0) {
+            fprintf(stderr, "Game %ld: invalid move, rendering stopped there\n", game->number);
+            SDL_AtomicAdd(&job->failures, 1);
+            continue;
+        }
+        if (job->every == 0 || plies % job->every != 0) renderBatchDiagram(job, game->number, plies);
+    }
+
+    cleanupOffscreenRenderer();
+    freeMoveHistory();
+    free(game);
+    return 0;
+}
+
+// Renders every game of a PGN file to PNG diagrams in outDir (which must
+// exist). The file is streamed into a bounded queue drained by worker threads
+// that each own a software renderer; the piece atlas is shared read-only.
+void renderBatch(const char *pgnFile, const char *outDir, int threads, int every) {
+    RenderBatchJob job = {0};
+    job.outDir = outDir;
+    job.every = every;
+
+    if (threads < 1) threads = SDL_GetCPUCount();
+    if (!initPGNGameQueue(&job.queue, threads * 4)) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+    SDL_Thread **workers = malloc(threads * sizeof(SDL_Thread *));
+    if (!workers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    threads = startWorkers(workers, threads, renderBatchWorker, "render", &job);
+    if (threads == 0) {
+        free(workers);
+        destroyPGNGameQueue(&job.queue);
+        return;
+    }
+    long games = parsePGNFile(pgnFile, pushPGNGame, &job.queue);
+    closePGNGameQueue(&job.queue);
+    for (int i = 0; i < threads; i++) {
+        SDL_WaitThread(workers[i], NULL);
+    }
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    if (games < 0) {
+        printf("Could not open PGN file: %s\n", pgnFile);
+    } else {
+        int diagrams = SDL_AtomicGet(&job.diagrams);
+        printf("Rendered %d diagrams from %ld games in %.2fs (%.1f diagrams/s, %d threads, %d failures)\n",
+               diagrams, games, secs, secs > 0 ? diagrams / secs : 0.0, threads,
+               SDL_AtomicGet(&job.failures));
+    }
+
+    free(workers);
+    destroyPGNGameQueue(&job.queue);
+}
+
+// -------------------------
+// Game Database
+// -------------------------
+
+static int resultCode(const char *result) {
+    if (strcmp(result, "1-0") == 0) return 1;
+    if (strcmp(result, "0-1") == 0) return 2;
+    if (strcmp(result, "1/2-1/2") == 0) return 3;
+    return 0;
+}
+
+const char *gameDBResultString(int code) {
+    static const char *const names[] = {"*", "1-0", "0-1", "1/2-1/2"};
+    return names[code & 3];
+}
+
+// Moves are written straight after the header while the tag pool is spooled
+// to a temporary file and the index kept in memory (16 bytes per game); both
+// are appended on close, then the header is rewritten with the offsets.
+bool openGameDBWriter(GameDBWriter *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    w->file = fopen(path, "wb");
+    w->tags = tmpfile();
+    if (!w->file || !w->tags) {
+        if (w->file) fclose(w->file);
+        if (w->tags) fclose(w->tags);
+        return false;
+    }
+    GameDBHeader blank;
+    memset(&blank, 0, sizeof(blank));
+    fwrite(&blank, sizeof(blank), 1, w->file);
+    return true;
+}
+
+// Fails, adding nothing, for a game whose ply count or tag block does not
+// fit the 16-bit index fields, or when the database reaches its 32-bit
+// offset limits.
+bool addGameToDB(GameDBWriter *w, const char *tagPool, size_t tagBytes, const PackedMove *moves, int plies,
+                 const char *result) {
+    if (plies < 0 || plies > 0xFFFF || tagBytes > 0xFFFF) {
+        fprintf(stderr, "Game too large for the database: %d plies, %zu tag bytes (limit 65535 each)\n", plies,
+                tagBytes);
+        return false;
+    }
+    if (w->moveCount + plies > 0xFFFFFFFFu || w->tagBytes + tagBytes > 0xFFFFFFFFu) {
+        fprintf(stderr, "Game database is full\n");
+        return false;
+    }
+    if (w->count == w->capacity) {
+        long cap = w->capacity ? w->capacity * 2 : 1024;
+        GameIndexEntry *grown = realloc(w->index, cap * sizeof(GameIndexEntry));
+        if (!grown) return false;
+        w->index = grown;
+        w->capacity = cap;
+    }
+    GameIndexEntry *e = &w->index[w->count++];
+    e->moveOffset = (Uint32) w->moveCount;
+    e->tagOffset = (Uint32) w->tagBytes;
+    e->plyCount = (Uint16) plies;
+    e->tagBytes = (Uint16) tagBytes;
+    e->result = (Uint8) resultCode(result);
+    e->flags = 0;
+    fwrite(moves, sizeof(PackedMove), plies, w->file);
+    fwrite(tagPool, 1, tagBytes, w->tags);
+    w->moveCount += plies;
+    w->tagBytes += tagBytes;
+    return true;
+}
+
+bool closeGameDBWriter(GameDBWriter *w) {
+    GameDBHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GAME_DB_MAGIC, 4);
+    h.version = GAME_DB_VERSION;
+    h.byteOrder = GAME_DB_BYTE_ORDER;
+    h.gameCount = (Uint32) w->count;
+    h.movesOffset = sizeof(GameDBHeader);
+    h.moveCount = w->moveCount;
+    h.tagsOffset = h.movesOffset + w->moveCount * sizeof(PackedMove);
+    h.tagBytes = w->tagBytes;
+    // Keep the index 8-byte aligned for the mapped reader
+    h.indexOffset = (h.tagsOffset + w->tagBytes + 7) & ~(Uint64) 7;
+
+    char chunk[1 << 16];
+    size_t n;
+    rewind(w->tags);
+    while ((n = fread(chunk, 1, sizeof(chunk), w->tags)) > 0) fwrite(chunk, 1, n, w->file);
+    static const char pad[8] = {0};
+    fwrite(pad, 1, h.indexOffset - (h.tagsOffset + w->tagBytes), w->file);
+    fwrite(w->index, sizeof(GameIndexEntry), w->count, w->file);
+
+    rewind(w->file);
+    fwrite(&h, sizeof(h), 1, w->file);
+    bool ok = !ferror(w->file) && !ferror(w->tags);
+    ok = (fclose(w->file) == 0) && ok;
+    fclose(w->tags);
+    free(w->index);
+    memset(w, 0, sizeof(*w));
+    return ok;
+}
+
+bool mapFile(MappedFile *mf, const char *path) {
+    memset(mf, 0, sizeof(*mf));
+#ifdef _WIN32
+    mf->fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mf->fileHandle == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    GetFileSizeEx(mf->fileHandle, &size);
+    mf->size = (size_t) size.QuadPart;
+    mf->mapHandle = CreateFileMappingA(mf->fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mf->mapHandle) mf->base = MapViewOfFile(mf->mapHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        mf->size = (size_t) st.st_size;
+        void *p = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) mf->base = p;
+    }
+    close(fd);
+#endif
+    if (!mf->base) {
+        unmapFile(mf);
+        return false;
+    }
+    return true;
+}
+
+void unmapFile(MappedFile *mf) {
+#ifdef _WIN32
+    if (mf->base) UnmapViewOfFile(mf->base);
+    if (mf->mapHandle) CloseHandle(mf->mapHandle);
+    if (mf->fileHandle && mf->fileHandle != INVALID_HANDLE_VALUE) CloseHandle(mf->fileHandle);
+#else
+    if (mf->base) munmap((void *) mf->base, mf->size);
+#endif
+    memset(mf, 0, sizeof(*mf));
+}
+
+// True if count items of unit bytes starting at offset lie within size bytes.
+static bool sectionFits(Uint64 offset, Uint64 count, Uint64 unit, Uint64 size) {
+    return offset <= size && count <= (size - offset) / unit;
+}
+
+static bool gameIndexEntryFits(const GameDBHeader *h, const GameIndexEntry *e) {
+    return sectionFits(e->moveOffset, e->plyCount, 1, h->moveCount) &&
+           sectionFits(e->tagOffset, e->tagBytes, 1, h->tagBytes);
+}
+
+// Maps the whole file read-only. Every section and index entry is checked
+// against the file size, which touches the index (16 bytes per game) but no
+// moves or tags, so a corrupt or truncated file is rejected up front.
+bool openGameDB(GameDB *db, const char *path) {
+    memset(db, 0, sizeof(*db));
+    if (!mapFile(&db->map, path)) return false;
+    const unsigned char *base = db->map.base;
+    size_t size = db->map.size;
+    const GameDBHeader *h = (const GameDBHeader *) base;
+    bool ok = size >= sizeof(GameDBHeader) && memcmp(h->magic, GAME_DB_MAGIC, 4) == 0 &&
+              h->version == GAME_DB_VERSION && h->byteOrder == GAME_DB_BYTE_ORDER &&
+              h->movesOffset % sizeof(PackedMove) == 0 && h->indexOffset % 8 == 0 &&
+              sectionFits(h->movesOffset, h->moveCount, sizeof(PackedMove), size) &&
+              sectionFits(h->tagsOffset, h->tagBytes, 1, size) &&
+              sectionFits(h->indexOffset, h->gameCount, sizeof(GameIndexEntry), size);
+    const GameIndexEntry *index = (const GameIndexEntry *) (base + (ok ? h->indexOffset : 0));
+    for (Uint32 i = 0; ok && i < h->gameCount; i++) ok = gameIndexEntryFits(h, &index[i]);
+    if (!ok) {
+        closeGameDB(db);
+        return false;
+    }
+    db->header = h;
+    db->index = index;
+    db->moves = (const PackedMove *) (base + h->movesOffset);
+    db->tags = (const char *) (base + h->tagsOffset);
+    return true;
+}
+
+void closeGameDB(GameDB *db) {
+    unmapFile(&db->map);
+    memset(db, 0, sizeof(*db));
+}
+
+long gameDBCount(const GameDB *db) {
+    return db->header ? (long) db->header->gameCount : 0;
+}
+
+// Returns game id's (0-based) move stream, or NULL if id is out of range.
+const PackedMove *gameDBMoves(const GameDB *db, long id, int *plies) {
+    if (id < 0 || id >= gameDBCount(db)) return NULL;
+    const GameIndexEntry *e = &db->index[id];
+    if (!gameIndexEntryFits(db->header, e)) return NULL;
+    *plies = e->plyCount;
+    return db->moves + e->moveOffset;
+}
+
+// Splits the "Name\0Value\0" pair at p into its name (p itself) and
+// *value. Returns the next pair, or NULL if the pair does not end before end.
+static const char *nextGameDBTag(const char *p, const char *end, const char **value) {
+    const char *nameEnd = memchr(p, '\0', end - p);
+    if (!nameEnd) return NULL;
+    *value = nameEnd + 1;
+    const char *valueEnd = *value < end ? memchr(*value, '\0', end - *value) : NULL;
+    return valueEnd ? valueEnd + 1 : NULL;
+}
+
+const char *gameDBTag(const GameDB *db, long id, const char *name) {
+    if (id < 0 || id >= gameDBCount(db)) return NULL;
+    const GameIndexEntry *e = &db->index[id];
+    if (!gameIndexEntryFits(db->header, e)) return NULL;
+    const char *p = db->tags + e->tagOffset;
+    const char *end = p + e->tagBytes;
+    while (p && p < end) {
+        const char *value, *next = nextGameDBTag(p, end, &value);
+        if (next && strcmp(p, name) == 0) return value;
+        p = next;
+    }
+    return NULL;
+}
+
+// Replays game id (first maxPly plies, maxPly < 0 = all) into the current
+// position and move history. The stored moves were validated when the
+// database was built, so no legality checks are repeated.
+bool replayGameDBGame(const GameDB *db, long id, int maxPly) {
+    int plies;
+    const PackedMove *moves = gameDBMoves(db, id, &plies);
+    if (!moves) return false;
+    const char *fen = gameDBTag(db, id, "FEN");
+    if (fen) {
+        if (!loadFEN(fen)) return false;
+    } else {
+        resetGameState();
+    }
+    if (maxPly >= 0 && maxPly < plies) plies = maxPly;
+    for (int i = 0; i < plies; i++) playMove(unpackMove(moves[i]));
+    return true;
+}
+
+// -------------------------
+// Position Index
+// -------------------------
+
+typedef struct {
+    const GameDB *db;
+    SDL_atomic_t nextGame;
+} PositionIndexJob;
+
+// Records are collected up to POSITION_INDEX_RUN at a time; each full
+// buffer is sorted and spilled to a temporary file, and the last one is
+// sorted and kept in memory. Memory per worker is bounded by the run size.
+typedef struct {
+    PositionIndexJob *job;
+    PositionRecord *records;
+    size_t count, capacity;
+    FILE **runs;
+    int runCount, runCapacity;
+    bool failed;
+} PositionIndexWorker;
+
+// One sorted run during the merge: a spilled file read through buf, or the
+// worker's in-memory tail (file NULL).
+typedef struct {
+    FILE *file;
+    PositionRecord *buf;
+    size_t pos, len;
+} PositionRun;
+
+static int comparePositionRecords(const void *a, const void *b) {
+    const PositionRecord *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    if (x->game != y->game) return x->game < y->game ? -1 : 1;
+    return (int) x->ply - (int) y->ply;
+}
+
+static bool spillPositionRun(PositionIndexWorker *w) {
+    if (w->runCount == w->runCapacity) {
+        int cap = w->runCapacity ? w->runCapacity * 2 : 16;
+        FILE **grown = realloc(w->runs, cap * sizeof(FILE *));
+        if (!grown) return false;
+        w->runs = grown;
+        w->runCapacity = cap;
+    }
+    FILE *f = tmpfile();
+    if (!f) return false;
+    w->runs[w->runCount++] = f;
+    qsort(w->records, w->count, sizeof(PositionRecord), comparePositionRecords);
+    bool ok = fwrite(w->records, sizeof(PositionRecord), w->count, f) == w->count && fflush(f) == 0;
+    w->count = 0;
+    return ok;
+}
+
+static bool addPositionRecord(PositionIndexWorker *w, Uint64 key, long game, int ply, PackedMove next) {
+    if (w->count == POSITION_INDEX_RUN && !spillPositionRun(w)) return false;
+    if (w->count == w->capacity) {
+        size_t cap = w->capacity ? w->capacity * 2 : 1 << 16;
+        if (cap > POSITION_INDEX_RUN) cap = POSITION_INDEX_RUN;
+        PositionRecord *grown = realloc(w->records, cap * sizeof(PositionRecord));
+        if (!grown) return false;
+        w->records = grown;
+        w->capacity = cap;
+    }
+    PositionRecord *r = &w->records[w->count++];
+    r->key = key;
+    r->game = (Uint32) game;
+    r->ply = (Uint16) ply;
+    r->next = next;
+    return true;
+}
+
+// Claims games in chunks from the shared counter and emits one record per
+// position reached, the final one with next move 0.
+static int positionIndexWorker(void *data) {
+    PositionIndexWorker *w = data;
+    const GameDB *db = w->job->db;
+    long total = gameDBCount(db);
+    headless = true;
+
+    for (;;) {
+        long first = SDL_AtomicAdd(&w->job->nextGame, POSITION_INDEX_CHUNK);
+        if (first >= total) break;
+        long last = first + POSITION_INDEX_CHUNK < total ? first + POSITION_INDEX_CHUNK : total;
+        for (long id = first; id < last; id++) {
+            int plies = 0;
+            const PackedMove *moves = gameDBMoves(db, id, &plies);
+            const char *fen = gameDBTag(db, id, "FEN");
+            if (fen) {
+                if (!loadFEN(fen)) continue;
+            } else {
+                resetGameState();
+            }
+            for (int i = 0; i <= plies; i++) {
+                PackedMove next = (i < plies) ? moves[i] : 0;
+                if (!addPositionRecord(w, positionKey, id, i, next)) {
+                    w->failed = true;
+                    return 1;
+                }
+                if (i < plies) {
+                    Undo u;
+                    makeMove(unpackMove(next), &u);
+                    currentTurn++;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Next record of a run in merge order, or NULL when it is used up. A read
+// error ends the run and sets *failed.
+static const PositionRecord *peekPositionRun(PositionRun *run, bool *failed) {
+    if (run->pos == run->len && run->file) {
+        run->len = fread(run->buf, sizeof(PositionRecord), POSITION_INDEX_READ, run->file);
+        run->pos = 0;
+        if (ferror(run->file)) *failed = true;
+    }
+    return run->pos < run->len ? &run->buf[run->pos] : NULL;
+}
+
+// Replays every game of the database on a pool of threads, each sorting its
+// records into runs (see PositionIndexWorker), then k-way merges all runs
+// into the index file: a header, the entries grouped by key, and a sorted
+// key table pointing into the entries. Keys are stored once per distinct
+// position instead of once per occurrence.
+bool buildPositionIndex(const char *dbPath, const char *outPath, int threads) {
+    GameDB db;
+    if (!openGameDB(&db, dbPath)) {
+        fprintf(stderr, "Could not open game database: %s\n", dbPath);
+        return false;
+    }
+    FILE *out = fopen(outPath, "wb");
+    FILE *keys = tmpfile();
+    if (!out || !keys) {
+        fprintf(stderr, "Could not create index file: %s\n", outPath);
+        if (out) fclose(out);
+        if (keys) fclose(keys);
+        closeGameDB(&db);
+        return false;
+    }
+
+    if (threads < 1) threads = SDL_GetCPUCount();
+    PositionIndexJob job = {0};
+    job.db = &db;
+    PositionIndexWorker *workers = calloc(threads, sizeof(PositionIndexWorker));
+    SDL_Thread **handles = malloc(threads * sizeof(SDL_Thread *));
+    if (!workers || !handles) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    int started = 0;
+    for (; started < threads; started++) {
+        workers[started].job = &job;
+        handles[started] = SDL_CreateThread(positionIndexWorker, "pos-index", &workers[started]);
+        if (!handles[started]) break;
+    }
+    if (started < threads) fprintf(stderr, "Started %d of %d pos-index threads: %s\n", started, threads, SDL_GetError());
+    threads = started;
+    bool ok = threads > 0;
+    for (int i = 0; i < threads; i++) {
+        SDL_WaitThread(handles[i], NULL);
+        if (workers[i].failed) ok = false;
+    }
+    double replaySecs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    PositionIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    fwrite(&h, sizeof(h), 1, out);
+
+    int runCount = 0;
+    for (int i = 0; i < threads; i++) runCount += workers[i].runCount + 1;
+    PositionRun *runs = calloc(runCount, sizeof(PositionRun));
+    if (!runs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    runCount = 0;
+    for (int i = 0; ok && i < threads; i++) {
+        for (int k = 0; k < workers[i].runCount; k++) {
+            PositionRun *run = &runs[runCount++];
+            run->file = workers[i].runs[k];
+            run->buf = malloc(POSITION_INDEX_READ * sizeof(PositionRecord));
+            if (!run->buf || fseek(run->file, 0, SEEK_SET) != 0) ok = false;
+        }
+        qsort(workers[i].records, workers[i].count, sizeof(PositionRecord), comparePositionRecords);
+        runs[runCount].buf = workers[i].records;
+        runs[runCount++].len = workers[i].count;
+    }
+
+    PositionKey current = {0, 0, 0};
+    Uint64 entries = 0, keyCount = 0;
+    while (ok) {
+        int best = -1;
+        const PositionRecord *r = NULL;
+        for (int i = 0; i < runCount; i++) {
+            const PositionRecord *head = peekPositionRun(&runs[i], &ok);
+            if (head && (!r || comparePositionRecords(head, r) < 0)) {
+                best = i;
+                r = head;
+            }
+        }
+        if (best < 0) break;
+        runs[best].pos++;
+
+        if (entries == 0 || r->key != current.key) {
+            if (entries > 0) fwrite(&current, sizeof(current), 1, keys);
+            current.key = r->key;
+            current.first = entries;
+            current.count = 0;
+            keyCount++;
+        }
+        PositionEntry e = {r->game, r->ply, r->next};
+        fwrite(&e, sizeof(e), 1, out);
+        current.count++;
+        entries++;
+    }
+    if (entries > 0) fwrite(&current, sizeof(current), 1, keys);
+
+    memcpy(h.magic, POSITION_INDEX_MAGIC, 4);
+    h.version = POSITION_INDEX_VERSION;
+    h.byteOrder = GAME_DB_BYTE_ORDER;
+    h.gameCount = (Uint32) gameDBCount(&db);
+    h.entriesOffset = sizeof(h);
+    h.entryCount = entries;
+    h.keysOffset = h.entriesOffset + entries * sizeof(PositionEntry);
+    h.keyCount = keyCount;
+
+    char chunk[1 << 16];
+    size_t n;
+    rewind(keys);
+    while ((n = fread(chunk, 1, sizeof(chunk), keys)) > 0) fwrite(chunk, 1, n, out);
+    rewind(out);
+    fwrite(&h, sizeof(h), 1, out);
+    ok = ok && !ferror(out) && !ferror(keys);
+    ok = (fclose(out) == 0) && ok;
+    fclose(keys);
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    if (ok) {
+        long games = gameDBCount(&db);
+        printf("Indexed %llu positions (%llu distinct) from %ld games in %.2fs "
+               "(replay %.2fs, %.0f games/s, %.0f positions/s, %d threads)\n",
+               (unsigned long long) entries, (unsigned long long) keyCount, games, secs, replaySecs,
+               secs > 0 ? games / secs : 0.0, secs > 0 ? entries / secs : 0.0, threads);
+    } else {
+        fprintf(stderr, "Could not write position index: %s\n", outPath);
+    }
+
+    for (int i = 0; i < runCount; i++) {
+        if (runs[i].file) free(runs[i].buf);
+    }
+    for (int i = 0; i < threads; i++) {
+        for (int k = 0; k < workers[i].runCount; k++) fclose(workers[i].runs[k]);
+        free(workers[i].runs);
+        free(workers[i].records);
+    }
+    free(runs);
+    free(workers);
+    free(handles);
+    closeGameDB(&db);
+    return ok;
+}
+
+// Maps the index built from db. The header, both sections and every key's
+// run of entries are checked against the file, and the index must have been
+// built from a database with db's game count. Entries are not scanned;
+// lookups check each entry's game id instead.
+bool openPositionIndex(PositionIndex *idx, const char *path, const GameDB *db) {
+    memset(idx, 0, sizeof(*idx));
+    if (!mapFile(&idx->map, path)) return false;
+    const PositionIndexHeader *h = (const PositionIndexHeader *) idx->map.base;
+    size_t size = idx->map.size;
+    bool ok = size >= sizeof(PositionIndexHeader) && memcmp(h->magic, POSITION_INDEX_MAGIC, 4) == 0 &&
+              h->version == POSITION_INDEX_VERSION && h->byteOrder == GAME_DB_BYTE_ORDER &&
+              h->entriesOffset % 8 == 0 && h->keysOffset % 8 == 0 &&
+              sectionFits(h->entriesOffset, h->entryCount, sizeof(PositionEntry), size) &&
+              sectionFits(h->keysOffset, h->keyCount, sizeof(PositionKey), size);
+    if (ok && h->gameCount != (Uint32) gameDBCount(db)) {
+        fprintf(stderr, "Position index %s was built from a database of %u games, not %ld\n", path,
+                (unsigned) h->gameCount, gameDBCount(db));
+        ok = false;
+    }
+    const PositionKey *keys = ok ? (const PositionKey *) (idx->map.base + h->keysOffset) : NULL;
+    for (Uint64 i = 0; ok && i < h->keyCount; i++) ok = sectionFits(keys[i].first, keys[i].count, 1, h->entryCount);
+    if (!ok) {
+        closePositionIndex(idx);
+        return false;
+    }
+    idx->header = h;
+    idx->entries = (const PositionEntry *) (idx->map.base + h->entriesOffset);
+    idx->keys = keys;
+    return true;
+}
+
+void closePositionIndex(PositionIndex *idx) {
+    unmapFile(&idx->map);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// Binary search over the key table; NULL if the position never occurs.
+const PositionKey *findPosition(const PositionIndex *idx, Uint64 key) {
+    size_t lo = 0, hi = idx->header->keyCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->keys[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < idx->header->keyCount && idx->keys[lo].key == key) return &idx->keys[lo];
+    return NULL;
+}
+
+// Aggregates the moves played from position `key` into out (at most maxOut,
+// most played first). Scores are from White's point of view and ratings are
+// the mean of the WhiteElo/BlackElo tags present. Returns the number of
+// distinct moves and stores the number of distinct games reaching the
+// position in *games.
+int positionMoveStats(const PositionIndex *idx, const GameDB *db, Uint64 key, PositionMoveStats *out,
+                      int maxOut, long *games) {
+    *games = 0;
+    const PositionKey *k = findPosition(idx, key);
+    if (!k) return 0;
+
+    int n = 0;
+    Uint32 lastGame = 0;
+    long gameCount = gameDBCount(db);
+    for (Uint64 i = 0; i < k->count; i++) {
+        const PositionEntry *e = &idx->entries[k->first + i];
+        if (e->game >= gameCount) continue;
+        if (*games == 0 || e->game != lastGame) (*games)++;
+        lastGame = e->game;
+        if (e->next == 0) continue;
+
+        int s = 0;
+        while (s < n && out[s].move != e->next) s++;
+        if (s == n) {
+            if (n == maxOut) continue;
+            memset(&out[n], 0, sizeof(out[n]));
+            out[n++].move = e->next;
+        }
+        PositionMoveStats *st = &out[s];
+        st->games++;
+        int result = db->index[e->game].result;
+        if (result != 0) {
+            st->scored++;
+            st->points += (result == 1) ? 1.0 : (result == 3) ? 0.5 : 0.0;
+        }
+        const char *ratings[2] = {gameDBTag(db, e->game, "WhiteElo"), gameDBTag(db, e->game, "BlackElo")};
+        for (int c = 0; c < 2; c++) {
+            if (ratings[c] && atoi(ratings[c]) > 0) {
+                st->rated++;
+                st->ratingSum += atoi(ratings[c]);
+            }
+        }
+    }
+
+    // Most played first
+    for (int i = 1; i < n; i++) {
+        PositionMoveStats tmp = out[i];
+        int j = i;
+        while (j > 0 && out[j - 1].games < tmp.games) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = tmp;
+    }
+    return n;
+}
+
+// -------------------------
+// Batch Conversion
+// -------------------------
+
+// Output of one converted game. Slots are reused round-robin, so the buffers
+// keep their capacity between games.
+typedef struct {
+    TextBuffer pgn;
+    TextBuffer errors;
+    TextBuffer tags;  // database tag pool entry
+    TextBuffer moves; // PackedMove stream
+    const char *result;
+    bool valid;
+    bool ready;
+} ConvertResult;
+
+// Per-worker analysis state for annotating games.
+typedef struct {
+    const EngineConfig *engine;
+    TransTable tt; // cleared per game, so the game's positions share it
+    char (*notes)[PGN_NOTE_LEN];
+    int *scores;   // per ply, for the side to move
+    char (*best)[PGN_SAN_LEN];
+    PackedMove *bestMoves;
+    long positions;
+    Uint64 nodes;
+} GameAnnotator;
+
+typedef struct {
+    PGNGameQueue queue;
+    PGNGame *games;            // one per worker, claimed through nextSlot
+    GameAnnotator *annotators; // ...likewise, when annotating
+    SDL_atomic_t nextSlot;
+    ConvertResult *window;     // reorder window indexed by game number
+    int windowSize;
+    long nextToWrite;
+    long totalGames;       // -1 until the parser has finished
+    SDL_mutex *lock;
+    SDL_cond *slotFree;
+    SDL_cond *slotReady;
+    FILE *pgnOut, *errOut;
+    GameDBWriter *db;
+    const EngineConfig *engine; // annotate games with this engine, NULL to only convert
+    int hashMB;
+    SDL_atomic_t valid;
+    SDL_atomic_t invalid;
+    SDL_atomic_t plies;
+} ConvertJob;
+
+static const char *const SEVEN_TAG_ROSTER[] = {
+    "Event", "Site", "Date", "Round", "White", "Black", "Result"
+};
+
+static void appendTagPair(TextBuffer *out, const char *name, const char *value) {
+    textPrintf(out, "[%s \"", name);
+    for (const char *v = value; *v; v++) {
+        if (*v == '"' || *v == '\\') textAppend(out, "\\", 1);
+        textAppend(out, v, 1);
+    }
+    textAppend(out, "\"]\n", 3);
+}
+
+static bool initGameAnnotator(GameAnnotator *a, const EngineConfig *engine, int hashMB) {
+    memset(a, 0, sizeof(*a));
+    a->engine = engine;
+    a->notes = malloc((PGN_MAX_PLIES + 1) * sizeof(*a->notes));
+    a->scores = malloc((PGN_MAX_PLIES + 1) * sizeof(int));
+    a->best = malloc((PGN_MAX_PLIES + 1) * sizeof(*a->best));
+    a->bestMoves = malloc((PGN_MAX_PLIES + 1) * sizeof(PackedMove));
+    return a->notes && a->scores && a->best && a->bestMoves && initTransTable(&a->tt, hashMB);
+}
+
+static void freeGameAnnotator(GameAnnotator *a) {
+    freeTransTable(&a->tt);
+    free(a->notes);
+    free(a->scores);
+    free(a->best);
+    free(a->bestMoves);
+}
+
+// "0.35" or "#-3" from White's side, as in the [%eval] comment command.
+static void formatEval(int score, char *buf, size_t size) {
+    if (score >= MATE_BOUND) {
+        snprintf(buf, size, "#%d", (MATE_SCORE - score + 1) / 2);
+    } else if (score <= -MATE_BOUND) {
+        snprintf(buf, size, "#-%d", (MATE_SCORE + score + 1) / 2);
+    } else {
+        snprintf(buf, size, "%.2f", score / 100.0);
+    }
+}
+
+static int clampScore(int score) {
+    if (score > ANNOTATE_SCORE_CAP) return ANNOTATE_SCORE_CAP;
+    if (score < -ANNOTATE_SCORE_CAP) return -ANNOTATE_SCORE_CAP;
+    return score;
+}
+
+// Searches every position of the recorded game within the engine's limits,
+// last position first so that later results are in the table when earlier
+// positions are searched. Fills a->notes with an [%eval] comment per move,
+// plus a NAG and the engine's choice when the move lost ground against it.
+static void annotateGame(GameAnnotator *a) {
+    int plies = history.count;
+    const EngineConfig *e = a->engine;
+    searchOptions = e->options;
+    searchTT = &a->tt;
+    clearTransTable(&a->tt);
+
+    for (int i = plies; i >= 0; i--) {
+        seekPly(i);
+        int color = currentTurn % 2;
+        a->bestMoves[i] = 0;
+        a->best[i][0] = '\0';
+        if (!hasAnyLegalMove(color)) {
+            a->scores[i] = isKingInCheck(color) ? -MATE_SCORE : 0;
+            continue;
+        }
+        if (drawReason()) {
+            a->scores[i] = 0;
+            continue;
+        }
+        setSearchLimits(e->nodes, e->movetime);
+        Move m = findBestMove(e->depth > 0 ? e->depth : SEARCH_MAX_PLY - 1, &a->scores[i]);
+        a->bestMoves[i] = packMove(m);
+        encodeSAN(m, a->best[i]);
+        a->positions++;
+        a->nodes += searchNodes;
+    }
+    seekPly(plies);
+    searchTT = NULL;
+
+    for (int i = 0; i < plies; i++) {
+        int after = -a->scores[i + 1]; // for the side that made move i
+        bool white = (history.start.turn + i) % 2 == 0;
+        char eval[16], best[16];
+        formatEval(white ? after : -after, eval, sizeof(eval));
+        int loss = clampScore(a->scores[i]) - clampScore(after);
+        const char *nag = NULL;
+        if (a->bestMoves[i] && a->bestMoves[i] != history.moves[i]) {
+            if (loss >= ANNOTATE_BLUNDER) nag = "$4";
+            else if (loss >= ANNOTATE_MISTAKE) nag = "$2";
+            else if (loss >= ANNOTATE_INACCURACY) nag = "$6";
+        }
+        if (a->scores[i + 1] == -MATE_SCORE) {
+            a->notes[i][0] = '\0'; // checkmate speaks for itself
+        } else if (nag) {
+            formatEval(white ? a->scores[i] : -a->scores[i], best, sizeof(best));
+            snprintf(a->notes[i], PGN_NOTE_LEN, "%s {[%%eval %s] Best: %s [%s]}", nag, eval, a->best[i], best);
+        } else {
+            snprintf(a->notes[i], PGN_NOTE_LEN, "{[%%eval %s]}", eval);
+        }
+    }
+}
+
+// Replays and validates one game on the calling thread's position, filling res
+// with normalized PGN (Seven Tag Roster first, regenerated SAN), error lines
+// and the database record. With an annotator the movetext carries its
+// evaluations.
+static void convertGame(const PGNGame *game, ConvertResult *res, bool wantDB, GameAnnotator *annotator) {
+    res->pgn.len = res->errors.len = res->tags.len = res->moves.len = 0;
+    res->valid = false;
+
+    if (!setupPGNStart(game)) {
+        textPrintf(&res->errors, "Game %ld: bad FEN tag\n", game->number);
+        return;
+    }
+    for (int i = 0; i < game->plyCount; i++) {
+        Move m;
+        SANError err = decodeSAN(game->san[i], currentTurn % 2, &m);
+        if (err != SAN_OK) {
+            textPrintf(&res->errors, "Game %ld: move %d%s %s: %s\n", game->number, currentTurn / 2 + 1,
+                       currentTurn % 2 ? "..." : ".", game->san[i], sanErrorString(err));
+            return;
+        }
+        playMove(m);
+    }
+    if (game->truncated) {
+        textPrintf(&res->errors, "Game %ld: warning: truncated to %d plies\n", game->number, game->plyCount);
+    }
+    res->valid = true;
+
+    const char *result = game->result[0] ? game->result : "*";
+    res->result = gameDBResultString(resultCode(result));
+    for (int i = 0; i < 7; i++) {
+        const char *value = (i == 6) ? result : getPGNTag(game, SEVEN_TAG_ROSTER[i]);
+        appendTagPair(&res->pgn, SEVEN_TAG_ROSTER[i], value ? value : "?");
+    }
+    for (int i = 0; i < game->tagCount; i++) {
+        // The roster is written above; an annotated game gets our own Annotator
+        bool skip = annotator && strcmp(game->tags[i].name, "Annotator") == 0;
+        for (int k = 0; k < 7; k++) {
+            if (strcmp(game->tags[i].name, SEVEN_TAG_ROSTER[k]) == 0) skip = true;
+        }
+        if (!skip) appendTagPair(&res->pgn, game->tags[i].name, game->tags[i].value);
+    }
+    if (annotator) {
+        annotateGame(annotator);
+        const EngineConfig *e = annotator->engine;
+        char name[64];
+        if (e->nodes) snprintf(name, sizeof(name), "chess %llu nodes", (unsigned long long) e->nodes);
+        else if (e->movetime > 0) snprintf(name, sizeof(name), "chess %d ms", e->movetime);
+        else snprintf(name, sizeof(name), "chess depth %d", e->depth);
+        appendTagPair(&res->pgn, "Annotator", name);
+    }
+    textAppend(&res->pgn, "\n", 1);
+    if (annotator) {
+        formatAnnotatedMovetext(&res->pgn, result, annotator->notes);
+    } else {
+        formatPGNMovetext(&res->pgn, result);
+    }
+    textAppend(&res->pgn, "\n", 1);
+
+    if (wantDB) {
+        for (int i = 0; i < game->tagCount; i++) {
+            textAppend(&res->tags, game->tags[i].name, strlen(game->tags[i].name) + 1);
+            textAppend(&res->tags, game->tags[i].value, strlen(game->tags[i].value) + 1);
+        }
+        textAppend(&res->moves, history.moves, history.count * sizeof(PackedMove));
+    }
+}
+
+static int convertWorker(void *data) {
+    ConvertJob *job = data;
+    headless = true;
+    int slot = SDL_AtomicAdd(&job->nextSlot, 1);
+    PGNGame *game = &job->games[slot];
+    GameAnnotator *annotator = job->annotators ? &job->annotators[slot] : NULL;
+
+    while (popPGNGame(&job->queue, game)) {
+        // Wait until the game fits in the reorder window; its slot is then ours
+        SDL_LockMutex(job->lock);
+        while (game->number - job->nextToWrite >= job->windowSize) SDL_CondWait(job->slotFree, job->lock);
+        SDL_UnlockMutex(job->lock);
+
+        ConvertResult *res = &job->window[(game->number - 1) % job->windowSize];
+        convertGame(game, res, job->db != NULL, annotator);
+        SDL_AtomicAdd(res->valid ? &job->valid : &job->invalid, 1);
+        if (res->valid) SDL_AtomicAdd(&job->plies, history.count);
+
+        SDL_LockMutex(job->lock);
+        res->ready = true;
+        SDL_CondBroadcast(job->slotReady);
+        SDL_UnlockMutex(job->lock);
+    }
+    freeMoveHistory();
+    return 0;
+}
+
+// Writes finished games in input order as soon as the next one is ready.
+static int convertWriter(void *data) {
+    ConvertJob *job = data;
+    for (long n = 1;; n++) {
+        ConvertResult *res = &job->window[(n - 1) % job->windowSize];
+        SDL_LockMutex(job->lock);
+        while (!res->ready && (job->totalGames < 0 || n <= job->totalGames)) {
+            SDL_CondWait(job->slotReady, job->lock);
+        }
+        bool ready = res->ready;
+        SDL_UnlockMutex(job->lock);
+        if (!ready) break;
+
+        if (job->pgnOut && res->valid) fwrite(res->pgn.data, 1, res->pgn.len, job->pgnOut);
+        if (res->errors.len) fwrite(res->errors.data, 1, res->errors.len, job->errOut);
+        if (job->db && res->valid &&
+            !addGameToDB(job->db, res->tags.data, res->tags.len, (const PackedMove *) res->moves.data,
+                         (int) (res->moves.len / sizeof(PackedMove)), res->result)) {
+            fprintf(job->errOut, "Game %ld: not added to the game database\n", n);
+        }
+
+        SDL_LockMutex(job->lock);
+        res->ready = false;
+        job->nextToWrite = n + 1;
+        SDL_CondBroadcast(job->slotFree);
+        SDL_UnlockMutex(job->lock);
+    }
+    return 0;
+}
+
+static long runConvertJob(const char *inFile, const char *outFile, const char *errFile, const char *dbFile,
+                          const EngineConfig *engine, int hashMB, int threads);
+
+// Validates every game of inFile on a pool of worker threads and writes the
+// legal ones, in input order, as normalized PGN to outFile and into a game
+// database at dbFile (either may be NULL). Error lines go to errFile (stderr
+// if NULL). Returns the number of invalid games, or -1 if a file could not be
+// opened.
+long convertPGNFile(const char *inFile, const char *outFile, const char *errFile, const char *dbFile, int threads) {
+    return runConvertJob(inFile, outFile, errFile, dbFile, NULL, 0, threads);
+}
+
+// As convertPGNFile(), with every position searched within the engine's
+// limits and the moves annotated with evaluations and ?!/?/?? marks. Games
+// are the unit of work: each worker searches all positions of its game with
+// one table of hashMB, cleared between games.
+long annotatePGNFile(const char *inFile, const char *outFile, const char *errFile, const EngineConfig *engine,
+                     int hashMB, int threads) {
+    return runConvertJob(inFile, outFile, errFile, NULL, engine, hashMB > 0 ? hashMB : TT_DEFAULT_MB, threads);
+}
+
+static long runConvertJob(const char *inFile, const char *outFile, const char *errFile, const char *dbFile,
+                          const EngineConfig *engine, int hashMB, int threads) {
+    ConvertJob job = {0};
+    GameDBWriter db;
+    bool dbOpen = dbFile && openGameDBWriter(&db, dbFile);
+    job.pgnOut = outFile ? fopen(outFile, "wb") : NULL;
+    job.errOut = errFile ? fopen(errFile, "wb") : stderr;
+    job.db = dbOpen ? &db : NULL;
+    job.engine = engine;
+    job.hashMB = hashMB;
+    if ((outFile && !job.pgnOut) || !job.errOut || (dbFile && !dbOpen)) {
+        fprintf(stderr, "Could not open output files\n");
+        if (job.pgnOut) fclose(job.pgnOut);
+        if (job.errOut && job.errOut != stderr) fclose(job.errOut);
+        if (dbOpen) closeGameDBWriter(&db);
+        return -1;
+    }
+
+    if (threads < 1) threads = SDL_GetCPUCount();
+    job.windowSize = threads * 16;
+    job.window = calloc(job.windowSize, sizeof(ConvertResult));
+    job.nextToWrite = 1;
+    job.totalGames = -1;
+    job.lock = SDL_CreateMutex();
+    job.slotFree = SDL_CreateCond();
+    job.slotReady = SDL_CreateCond();
+    SDL_Thread **workers = malloc(threads * sizeof(SDL_Thread *));
+    job.games = malloc(threads * sizeof(PGNGame));
+    if (!job.window || !workers || !job.games || !initPGNGameQueue(&job.queue, threads * 4)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    // Each worker's game buffer and annotator exist before any thread runs,
+    // so a worker cannot fail part way. Without them, the writer or any
+    // worker, the ordered window and the queue would never drain, so those
+    // runs end before parsing starts.
+    int annotators = 0;
+    if (engine) {
+        job.annotators = calloc(threads, sizeof(GameAnnotator));
+        while (job.annotators && annotators < threads &&
+               initGameAnnotator(&job.annotators[annotators], engine, hashMB)) {
+            annotators++;
+        }
+        if (annotators < threads) {
+            if (job.annotators) freeGameAnnotator(&job.annotators[annotators]);
+            fprintf(stderr, "Out of memory\n");
+        }
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    SDL_Thread *writer = NULL;
+    if (!engine || annotators == threads) threads = startWorkers(workers, threads, convertWorker, "convert", &job);
+    else threads = 0;
+    if (threads > 0 && startWorkers(&writer, 1, convertWriter, "convert-out", &job) == 0) {
+        closePGNGameQueue(&job.queue);
+        for (int i = 0; i < threads; i++) SDL_WaitThread(workers[i], NULL);
+        threads = 0;
+    }
+    if (threads == 0) {
+        if (job.pgnOut) fclose(job.pgnOut);
+        if (job.errOut != stderr) fclose(job.errOut);
+        if (job.db) closeGameDBWriter(job.db);
+        for (int i = 0; i < annotators; i++) freeGameAnnotator(&job.annotators[i]);
+        free(job.annotators);
+        free(job.games);
+        free(job.window);
+        free(workers);
+        SDL_DestroyMutex(job.lock);
+        SDL_DestroyCond(job.slotFree);
+        SDL_DestroyCond(job.slotReady);
+        destroyPGNGameQueue(&job.queue);
+        return -1;
+    }
+
+    long games = parsePGNFile(inFile, pushPGNGame, &job.queue);
+    closePGNGameQueue(&job.queue);
+    SDL_LockMutex(job.lock);
+    job.totalGames = games < 0 ? 0 : games;
+    SDL_CondBroadcast(job.slotReady);
+    SDL_UnlockMutex(job.lock);
+
+    for (int i = 0; i < threads; i++) {
+        SDL_WaitThread(workers[i], NULL);
+    }
+    SDL_WaitThread(writer, NULL);
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    long positions = 0;
+    Uint64 nodes = 0;
+    for (int i = 0; i < annotators; i++) {
+        positions += job.annotators[i].positions;
+        nodes += job.annotators[i].nodes;
+        freeGameAnnotator(&job.annotators[i]);
+    }
+    free(job.annotators);
+    free(job.games);
+
+    long invalid = SDL_AtomicGet(&job.invalid);
+    if (games < 0) {
+        fprintf(stderr, "Could not open PGN file: %s\n", inFile);
+        invalid = -1;
+    } else {
+        printf("Converted %ld games (%d valid, %ld invalid, %d plies) in %.2fs (%.0f games/s, %d threads)\n",
+               games, SDL_AtomicGet(&job.valid), invalid, SDL_AtomicGet(&job.plies), secs,
+               secs > 0 ? games / secs : 0.0, threads);
+        if (job.engine) {
+            printf("Analysed %ld positions, %llu nodes (%.1f positions/s, %.0f nodes/s)\n", positions,
+                   (unsigned long long) nodes, secs > 0 ? positions / secs : 0.0, secs > 0 ? nodes / secs : 0.0);
+        }
+    }
+
+    if (job.pgnOut) fclose(job.pgnOut);
+    if (job.errOut != stderr) fclose(job.errOut);
+    if (job.db && !closeGameDBWriter(job.db)) {
+        fprintf(stderr, "Could not write game database: %s\n", dbFile);
+        invalid = -1;
+    }
+    for (int i = 0; i < job.windowSize; i++) {
+        freeTextBuffer(&job.window[i].pgn);
+        freeTextBuffer(&job.window[i].errors);
+        freeTextBuffer(&job.window[i].tags);
+        freeTextBuffer(&job.window[i].moves);
+    }
+    free(job.window);
+    free(workers);
+    SDL_DestroyMutex(job.lock);
+    SDL_DestroyCond(job.slotFree);
+    SDL_DestroyCond(job.slotReady);
+    destroyPGNGameQueue(&job.queue);
+    return invalid;
+}
+
+// -------------------------
+// Engine Matches
+// -------------------------
+
+typedef struct {
+    const MatchConfig *cfg;
+    MatchResult *result;
+    char date[16];
+    SDL_atomic_t next;
+    SDL_atomic_t stop;
+    SDL_mutex *lock;
+    Uint64 start;
+} MatchJob;
+
+// Bare kings, or a king and a single minor piece against a bare king.
+static bool insufficientMaterial() {
+    int minors = 0;
+    for (int r = 0; r < BOARD_SIZE; r++) {
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            char t = (char) toupper(board[r][c]);
+            if (t == 'P' || t == 'R' || t == 'Q') return false;
+            if (t == 'N' || t == 'B') minors++;
+        }
+    }
+    return minors <= 1;
+}
+
+// Plays game g from opening g / 2; engines[0] has White in even games. The
+// game ends on mate or a draw by the rules, or is adjudicated when it runs
+// too long or both engines agree one side is lost. Returns the PGN result.
+static const char *playMatchGame(const MatchConfig *cfg, int g, TransTable *tables, bool *adjudicated) {
+    *adjudicated = false;
+    if (!loadFEN(cfg->openings[(g / 2) % cfg->openingCount])) return "*";
+    clearTransTable(&tables[0]);
+    clearTransTable(&tables[1]);
+
+    int agreed = 0, lastSign = 0;
+    for (int ply = 0;; ply++) {
+        int color = currentTurn % 2;
+        if (!hasAnyLegalMove(color)) {
+            if (!isKingInCheck(color)) return "1/2-1/2";
+            return (color == 0) ? "0-1" : "1-0";
+        }
+        if (drawReason() || insufficientMaterial()) return "1/2-1/2";
+        if (ply >= MATCH_MAX_PLIES) {
+            *adjudicated = true;
+            return "1/2-1/2";
+        }
+
+        int side = (color + g) % 2;
+        const EngineConfig *e = &cfg->engines[side];
+        searchOptions = e->options;
+        searchTT = &tables[side];
+        setSearchLimits(e->nodes, e->movetime);
+        int score;
+        Move m = findBestMove(e->depth > 0 ? e->depth : SEARCH_MAX_PLY - 1, &score);
+
+        int white = (color == 0) ? score : -score;
+        int sign = (white >= MATCH_RESIGN_SCORE) - (white <= -MATCH_RESIGN_SCORE);
+        agreed = (sign != 0 && sign == lastSign) ? agreed + 1 : (sign != 0);
+        lastSign = sign;
+        if (agreed >= MATCH_RESIGN_PLIES) {
+            *adjudicated = true;
+            return (sign > 0) ? "1-0" : "0-1";
+        }
+        playMove(m);
+    }
+}
+
+static void appendMatchPGN(TextBuffer *out, const MatchJob *job, int g, const char *result, bool adjudicated) {
+    const MatchConfig *cfg = job->cfg;
+    char round[16], fen[FEN_MAX_LEN];
+    snprintf(round, sizeof(round), "%d", g + 1);
+    appendTagPair(out, "Event", "Engine match");
+    appendTagPair(out, "Site", "Local");
+    appendTagPair(out, "Date", job->date);
+    appendTagPair(out, "Round", round);
+    appendTagPair(out, "White", cfg->engines[g % 2].name);
+    appendTagPair(out, "Black", cfg->engines[(g + 1) % 2].name);
+    appendTagPair(out, "Result", result);
+    int played = history.count;
+    seekPly(0);
+    writeFEN(fen);
+    seekPly(played);
+    if (strcmp(fen, START_FEN) != 0) {
+        appendTagPair(out, "SetUp", "1");
+        appendTagPair(out, "FEN", fen);
+    }
+    appendTagPair(out, "Termination", adjudicated ? "adjudication" : "normal");
+    textAppend(out, "\n", 1);
+    formatPGNMovetext(out, result);
+    textAppend(out, "\n", 1);
+}
+
+// Expected score of a player rated elo points above the opponent.
+static double eloToScore(double elo) {
+    return 1.0 / (1.0 + pow(10.0, -elo / 400.0));
+}
+
+static double scoreToElo(double score) {
+    if (score <= 0.0) score = 1e-6;
+    if (score >= 1.0) score = 1.0 - 1e-6;
+    return -400.0 * log10(1.0 / score - 1.0);
+}
+
+// Elo difference of engines[0] over engines[1] with the half-width of its 95%
+// confidence interval.
+double matchElo(const MatchResult *r, double *margin) {
+    *margin = 0.0;
+    if (r->games == 0) return 0.0;
+    double n = r->games;
+    double score = (r->wins + 0.5 * r->draws) / n;
+    double variance = (r->wins + 0.25 * r->draws) / n - score * score;
+    double dev = 1.96 * sqrt(variance / n);
+    *margin = (scoreToElo(score + dev) - scoreToElo(score - dev)) / 2.0;
+    return scoreToElo(score) + 0.0; // no "-0.0" for an even score
+}
+
+// Log-likelihood ratio of H1 (elo1) against H0 (elo0) for the trinomial
+// results so far, in the normal approximation of the generalized SPRT.
+static double sprtLLR(const MatchResult *r, double elo0, double elo1) {
+    if (r->games == 0) return 0.0;
+    double n = r->games;
+    double score = (r->wins + 0.5 * r->draws) / n;
+    double variance = (r->wins + 0.25 * r->draws) / n - score * score;
+    if (variance <= 0.0) return 0.0;
+    double s0 = eloToScore(elo0), s1 = eloToScore(elo1);
+    return n * (s1 - s0) * (2.0 * score - s0 - s1) / (2.0 * variance);
+}
+
+static void printMatchProgress(const MatchJob *job) {
+    const MatchResult *r = job->result;
+    double margin, elo = matchElo(r, &margin);
+    double secs = (double) (SDL_GetPerformanceCounter() - job->start) / SDL_GetPerformanceFrequency();
+    printf("%6d games  +%d =%d -%d  Elo %+.1f +/- %.1f", r->games, r->wins, r->draws, r->losses, elo, margin);
+    if (job->cfg->sprt) printf("  LLR %.2f [%.2f, %.2f]", r->llr, r->lowerBound, r->upperBound);
+    printf("  %.1f games/s\n", secs > 0 ? r->games / secs : 0.0);
+}
+
+static int matchWorker(void *data) {
+    MatchJob *job = data;
+    const MatchConfig *cfg = job->cfg;
+    headless = true;
+    TransTable tables[2] = {{0}};
+    bool ready = initTransTable(&tables[0], cfg->hashMB) && initTransTable(&tables[1], cfg->hashMB);
+    TextBuffer pgn = {0};
+
+    while (ready && !SDL_AtomicGet(&job->stop)) {
+        int g = SDL_AtomicAdd(&job->next, 1);
+        if (g >= cfg->games) break;
+        bool adjudicated;
+        const char *result = playMatchGame(cfg, g, tables, &adjudicated);
+        if (strcmp(result, "*") == 0) continue;
+        if (cfg->pgnOut) {
+            pgn.len = 0;
+            appendMatchPGN(&pgn, job, g, result, adjudicated);
+        }
+
+        SDL_LockMutex(job->lock);
+        MatchResult *r = job->result;
+        if (cfg->pgnOut) fwrite(pgn.data, 1, pgn.len, cfg->pgnOut);
+        r->games++;
+        if (adjudicated) r->adjudicated++;
+        if (strcmp(result, "1/2-1/2") == 0) {
+            r->draws++;
+        } else if ((strcmp(result, "1-0") == 0) == (g % 2 == 0)) {
+            r->wins++;
+        } else {
+            r->losses++;
+        }
+        if (cfg->sprt) {
+            r->llr = sprtLLR(r, cfg->elo0, cfg->elo1);
+            if (!r->decision && r->llr >= r->upperBound) r->decision = 1;
+            if (!r->decision && r->llr <= r->lowerBound) r->decision = -1;
+            if (r->decision) SDL_AtomicSet(&job->stop, 1);
+        }
+        int every = cfg->games >= 200 ? cfg->games / 20 : 10;
+        if (r->games % every == 0) printMatchProgress(job);
+        SDL_UnlockMutex(job->lock);
+    }
+
+    freeTransTable(&tables[0]);
+    freeTransTable(&tables[1]);
+    freeTextBuffer(&pgn);
+    freeMoveHistory();
+    searchTT = NULL;
+    return 0;
+}
+
+// Plays cfg->games games between the two engines on cfg->threads threads,
+// each with its own pair of transposition tables. Games are handed out in
+// order and PGN is written as they finish. With cfg->sprt the match stops
+// once the test accepts either hypothesis; games already running still count.
+bool runMatch(const MatchConfig *cfg, MatchResult *out) {
+    memset(out, 0, sizeof(*out));
+    if (cfg->openingCount <= 0 || cfg->games <= 0) return false;
+    out->lowerBound = log(cfg->beta / (1.0 - cfg->alpha));
+    out->upperBound = log((1.0 - cfg->beta) / cfg->alpha);
+
+    MatchJob job;
+    memset(&job, 0, sizeof(job));
+    job.cfg = cfg;
+    job.result = out;
+    job.lock = SDL_CreateMutex();
+    time_t now = time(NULL);
+    strftime(job.date, sizeof(job.date), "%Y.%m.%d", localtime(&now));
+
+    int threads = cfg->threads > 0 ? cfg->threads : SDL_GetCPUCount();
+    if (threads > cfg->games) threads = cfg->games;
+    SDL_Thread **workers = malloc(threads * sizeof(SDL_Thread *));
+    if (!workers || !job.lock) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    job.start = SDL_GetPerformanceCounter();
+    threads = startWorkers(workers, threads, matchWorker, "match", &job);
+    for (int i = 0; i < threads; i++) SDL_WaitThread(workers[i], NULL);
+    out->seconds = (double) (SDL_GetPerformanceCounter() - job.start) / SDL_GetPerformanceFrequency();
+    if (out->games % (cfg->games >= 200 ? cfg->games / 20 : 10) != 0) printMatchProgress(&job);
+
+    free(workers);
+    SDL_DestroyMutex(job.lock);
+    return true;
+}
+
+// -------------------------
+// Evaluation Tuning
+// -------------------------
+
+typedef struct {
+    TuneSet *set;
+    const double *weights; // NULL while extracting features
+    double k;
+    double *chunkError;    // per chunk, summed in chunk order so that results
+    double *chunkGrad;     // do not depend on the thread count; may be NULL
+    SDL_atomic_t next;
+    SDL_atomic_t mismatches;
+} TuneJob;
+
+static int tuneChunkCount(const TuneSet *set) {
+    return (set->count + TUNE_CHUNK - 1) / TUNE_CHUNK;
+}
+
+static void runTuneWorkers(TuneJob *job, SDL_ThreadFunction fn, int threads) {
+    if (threads < 1) threads = SDL_GetCPUCount();
+    SDL_Thread **workers = malloc(threads * sizeof(SDL_Thread *));
+    if (!workers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    SDL_AtomicSet(&job->next, 0);
+    threads = startWorkers(workers, threads, fn, "tune", job);
+    if (threads == 0) exit(1);
+    for (int i = 0; i < threads; i++) SDL_WaitThread(workers[i], NULL);
+    free(workers);
+}
+
+// Packs the board as the next position of the set.
+bool addTunePosition(TuneSet *set, float result) {
+    if (set->count == set->capacity) {
+        int cap = set->capacity ? set->capacity * 2 : 4096;
+        PackedPosition *positions = realloc(set->positions, cap * sizeof(PackedPosition));
+        if (positions) set->positions = positions;
+        float *results = realloc(set->results, cap * sizeof(float));
+        if (results) set->results = results;
+        if (!positions || !results) return false;
+        set->capacity = cap;
+    }
+    packPosition(&set->positions[set->count]);
+    set->results[set->count++] = result;
+    return true;
+}
+
+// Traces the positions of each claimed chunk into a scratch buffer, then
+// keeps the chunk's features in one exact-size block.
+static int tuneExtractWorker(void *data) {
+    TuneJob *job = data;
+    TuneSet *set = job->set;
+    const int *weights = (const int *) &EVAL_WEIGHTS;
+    headless = true;
+    TuneFeature *scratch = malloc(TUNE_CHUNK * TUNE_MAX_FEATURES * sizeof(TuneFeature));
+    if (!scratch) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    searchStopped = searchLimited = false;
+    for (;;) {
+        int k = SDL_AtomicAdd(&job->next, 1);
+        if (k >= tuneChunkCount(set)) break;
+        int first = k * TUNE_CHUNK, last = first + TUNE_CHUNK < set->count ? first + TUNE_CHUNK : set->count;
+        int n = 0;
+        for (int i = first; i < last; i++) {
+            set->featureCount[i] = TUNE_DROPPED;
+            unpackPosition(&set->positions[i]);
+            int color = currentTurn % 2;
+            if (isKingInCheck(color) || quiesce(-INF_SCORE, INF_SCORE, 0) != evaluate(color)) continue;
+
+            EvalTrace trace;
+            int sc = traceEvaluation(&trace), count = 0;
+            long dot = 0;
+            for (int w = 0; w < EVAL_WEIGHT_COUNT; w++) {
+                if (!trace.coef[w]) continue;
+                dot += (long) trace.coef[w] * weights[w];
+                if (count < TUNE_MAX_FEATURES) scratch[n + count] = (TuneFeature){(Sint16) trace.coef[w], (Uint8) w};
+                count++;
+            }
+            if (count > TUNE_MAX_FEATURES || dot != sc) {
+                SDL_AtomicAdd(&job->mismatches, 1);
+                continue;
+            }
+            set->featureCount[i] = (Uint8) count;
+            n += count;
+        }
+        set->features[k] = malloc(n ? n * sizeof(TuneFeature) : 1);
+        if (!set->features[k]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memcpy(set->features[k], scratch, n * sizeof(TuneFeature));
+    }
+    free(scratch);
+    return 0;
+}
+
+// Drops the positions that are in check or not quiet (quiescence search
+// changes the score) and stores the evaluation coefficients of the rest.
+// Returns the number of positions whose coefficients do not reproduce
+// evaluate(), which should be none.
+int extractTuneFeatures(TuneSet *set, int threads) {
+    int chunks = tuneChunkCount(set);
+    set->featureCount = malloc(set->count ? set->count : 1);
+    set->features = calloc(chunks ? chunks : 1, sizeof(TuneFeature *));
+    if (!set->featureCount || !set->features) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    TuneJob job;
+    memset(&job, 0, sizeof(job));
+    job.set = set;
+    runTuneWorkers(&job, tuneExtractWorker, threads);
+    set->used = 0;
+    for (int i = 0; i < set->count; i++) set->used += set->featureCount[i] != TUNE_DROPPED;
+    return SDL_AtomicGet(&job.mismatches);
+}
+
+static int tuneErrorWorker(void *data) {
+    TuneJob *job = data;
+    TuneSet *set = job->set;
+    double scale = job->k * log(10.0) / 400.0; // 1 / (1 + 10^(-k e / 400)) = 1 / (1 + exp(-scale e))
+    for (;;) {
+        int k = SDL_AtomicAdd(&job->next, 1);
+        if (k >= tuneChunkCount(set)) break;
+        int first = k * TUNE_CHUNK, last = first + TUNE_CHUNK < set->count ? first + TUNE_CHUNK : set->count;
+        double error = 0.0, *grad = job->chunkGrad ? job->chunkGrad + (size_t) k * EVAL_WEIGHT_COUNT : NULL;
+        if (grad) memset(grad, 0, EVAL_WEIGHT_COUNT * sizeof(double));
+        const TuneFeature *f = set->features[k];
+        for (int i = first; i < last; i++) {
+            int n = set->featureCount[i];
+            if (n == TUNE_DROPPED) continue;
+            double e = 0.0;
+            for (int j = 0; j < n; j++) e += job->weights[f[j].index] * f[j].coef;
+            double s = 1.0 / (1.0 + exp(-scale * e)), d = set->results[i] - s;
+            error += d * d;
+            if (grad) {
+                double g = -2.0 * d * s * (1.0 - s) * scale;
+                for (int j = 0; j < n; j++) grad[f[j].index] += g * f[j].coef;
+            }
+            f += n;
+        }
+        job->chunkError[k] = error;
+    }
+    return 0;
+}
+
+// Mean squared difference between the results and the win probability the
+// weights predict with scaling constant k. With grad, also its gradient.
+double tuneError(TuneSet *set, const double *weights, double k, double *grad, int threads) {
+    int chunks = tuneChunkCount(set);
+    TuneJob job;
+    memset(&job, 0, sizeof(job));
+    job.set = set;
+    job.weights = weights;
+    job.k = k;
+    job.chunkError = malloc((chunks ? chunks : 1) * sizeof(double));
+    job.chunkGrad = grad ? malloc((size_t) (chunks ? chunks : 1) * EVAL_WEIGHT_COUNT * sizeof(double)) : NULL;
+    if (!job.chunkError || (grad && !job.chunkGrad)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    runTuneWorkers(&job, tuneErrorWorker, threads);
+
+    double error = 0.0, n = set->used ? set->used : 1;
+    if (grad) memset(grad, 0, EVAL_WEIGHT_COUNT * sizeof(double));
+    for (int k = 0; k < chunks; k++) {
+        error += job.chunkError[k];
+        for (int w = 0; grad && w < EVAL_WEIGHT_COUNT; w++) grad[w] += job.chunkGrad[(size_t) k * EVAL_WEIGHT_COUNT + w];
+    }
+    for (int w = 0; grad && w < EVAL_WEIGHT_COUNT; w++) grad[w] /= n;
+    free(job.chunkError);
+    free(job.chunkGrad);
+    return error / n;
+}
+
+// The scaling constant that best fits the untuned weights to the results,
+// by golden-section search.
+double fitTuneScaling(TuneSet *set, const double *weights, int threads) {
+    const double phi = (sqrt(5.0) - 1.0) / 2.0;
+    double lo = 0.0, hi = 4.0;
+    double a = hi - phi * (hi - lo), b = lo + phi * (hi - lo);
+    double ea = tuneError(set, weights, a, NULL, threads), eb = tuneError(set, weights, b, NULL, threads);
+    for (int i = 0; i < 30; i++) {
+        if (ea < eb) {
+            hi = b, b = a, eb = ea;
+            a = hi - phi * (hi - lo);
+            ea = tuneError(set, weights, a, NULL, threads);
+        } else {
+            lo = a, a = b, ea = eb;
+            b = lo + phi * (hi - lo);
+            eb = tuneError(set, weights, b, NULL, threads);
+        }
+    }
+    return (a + b) / 2.0;
+}
+
+// One full-batch Adam step (epoch counts from 1); moments holds the first and
+// second moment estimates, 2 * EVAL_WEIGHT_COUNT values starting at zero.
+// Returns the error before the step.
+double tuneEpoch(TuneSet *set, double *weights, double *moments, int epoch, double k, double rate, int threads) {
+    const double beta1 = 0.9, beta2 = 0.999;
+    double grad[EVAL_WEIGHT_COUNT];
+    double error = tuneError(set, weights, k, grad, threads);
+    for (int w = 0; w < EVAL_WEIGHT_COUNT; w++) {
+        double *m = &moments[w], *v = &moments[EVAL_WEIGHT_COUNT + w];
+        *m = beta1 * *m + (1.0 - beta1) * grad[w];
+        *v = beta2 * *v + (1.0 - beta2) * grad[w] * grad[w];
+        double mHat = *m / (1.0 - pow(beta1, epoch)), vHat = *v / (1.0 - pow(beta2, epoch));
+        weights[w] -= rate * mHat / (sqrt(vHat) + 1e-12);
+    }
+    return error;
+}
+
+// Writes weights, rounded, as an EVAL_WEIGHTS initializer that replaces the
+// built-in one when the program is compiled with EVAL_WEIGHTS_FILE naming it.
+bool writeTunedWeights(const char *path, const double *weights, const char *comment) {
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "// Generated by \"chess tune\"; %s\n", comment);
+    fprintf(f, "static const EvalWeights EVAL_WEIGHTS = {\n");
+    int fields = (int) (sizeof(EVAL_WEIGHT_FIELDS) / sizeof(EVAL_WEIGHT_FIELDS[0]));
+    for (int i = 0; i < fields; i++) {
+        const double *w = weights + EVAL_WEIGHT_FIELDS[i].first;
+        int count = EVAL_WEIGHT_FIELDS[i].count;
+        const char *end = (i + 1 < fields) ? ",\n" : "\n";
+        fprintf(f, "    .%s = ", EVAL_WEIGHT_FIELDS[i].name);
+        if (count == 1) {
+            fprintf(f, "%ld%s", lround(w[0]), end);
+            continue;
+        }
+        fprintf(f, count > 8 ? "{\n        " : "{");
+        for (int j = 0; j < count; j++) {
+            const char *sep = (j + 1 == count) ? "" : (j % 8 == 7) ? ",\n        " : ", ";
+            fprintf(f, "%ld%s", lround(w[j]), sep);
+        }
+        fprintf(f, count > 8 ? "\n    }%s" : "}%s", end);
+    }
+    fprintf(f, "};\n");
+    return fclose(f) == 0;
+}
+
+void freeTuneSet(TuneSet *set) {
+    for (int k = 0; set->features && k < tuneChunkCount(set); k++) free(set->features[k]);
+    free(set->features);
+    free(set->featureCount);
+    free(set->positions);
+    free(set->results);
+    memset(set, 0, sizeof(*set));
+}
+
+// -------------------------
+// Self-Play Training Data
+// -------------------------
+
+typedef struct {
+    const DatagenConfig *cfg;
+    DatagenResult *result;
+    TrainingWriter *writer;
+    SDL_atomic_t next;
+    SDL_atomic_t stop; // set when a shard cannot be written
+    SDL_mutex *lock;
+    Uint64 start;
+} DatagenJob;
+
+static void trainingShardPath(char *buf, size_t size, const char *prefix, int shard) {
+    snprintf(buf, size, "%s_%03d.bin", prefix, shard);
+}
+
+// Shards are opened as records arrive, so a run that keeps nothing writes
+// no files.
+void initTrainingWriter(TrainingWriter *w, const char *prefix, Uint64 shardRecords) {
+    memset(w, 0, sizeof(*w));
+    snprintf(w->prefix, sizeof(w->prefix), "%s", prefix);
+    w->shardRecords = shardRecords > 0 ? shardRecords : DATAGEN_SHARD_RECORDS;
+}
+
+// Appends records, starting the next shard whenever the current one is full.
+bool writeTrainingRecords(TrainingWriter *w, const TrainingRecord *recs, int count) {
+    while (count > 0 && !w->failed) {
+        if (!w->file || w->inShard == w->shardRecords) {
+            char path[600];
+            if (w->file && fclose(w->file) != 0) w->failed = true;
+            trainingShardPath(path, sizeof(path), w->prefix, w->shards++);
+            w->file = fopen(path, "wb");
+            w->inShard = 0;
+            if (!w->file) {
+                w->failed = true;
+                break;
+            }
+        }
+        Uint64 room = w->shardRecords - w->inShard;
+        int n = (Uint64) count < room ? count : (int) room;
+        if (fwrite(recs, sizeof(TrainingRecord), n, w->file) != (size_t) n) w->failed = true;
+        w->inShard += n;
+        w->total += n;
+        recs += n;
+        count -= n;
+    }
+    return !w->failed;
+}
+
+bool closeTrainingWriter(TrainingWriter *w) {
+    if (w->file && fclose(w->file) != 0) w->failed = true;
+    w->file = NULL;
+    return !w->failed;
+}
+
+// Maps a shard; its records are used in place.
+bool openTrainingData(TrainingData *data, const char *path) {
+    memset(data, 0, sizeof(*data));
+    if (!mapFile(&data->map, path)) return false;
+    if (data->map.size % sizeof(TrainingRecord) != 0) {
+        unmapFile(&data->map);
+        return false;
+    }
+    data->records = (const TrainingRecord *) data->map.base;
+    data->count = data->map.size / sizeof(TrainingRecord);
+    return true;
+}
+
+void closeTrainingData(TrainingData *data) {
+    unmapFile(&data->map);
+    memset(data, 0, sizeof(*data));
+}
+
+// Plays game g: random legal moves from its opening (one more in odd games,
+// so that either side can be to move when the engine takes over), then the
+// engine on both sides with cfg->nodes per move. Positions that are in check,
+// whose best move is a capture or promotion, or that are scored as mate are
+// skipped; the rest go to recs, with the result once the game is over.
+// Returns the number of records, or -1 if the random moves ended the game.
+static int playDatagenGame(const DatagenConfig *cfg, int g, TransTable *tt, TrainingRecord *recs, int *skipped) {
+    Uint64 rng = cfg->seed + (Uint64) g;
+    rng = splitMix64(&rng);
+    if (!loadFEN(cfg->openingCount ? cfg->openings[g % cfg->openingCount] : START_FEN)) return -1;
+    clearTransTable(tt);
+
+    int randomPlies = cfg->randomPlies + g % 2;
+    for (int i = 0; i < randomPlies; i++) {
+        Move list[MAX_MOVES];
+        int n = generateLegalMoves(currentTurn % 2, list);
+        if (n == 0) return -1;
+        playMove(list[splitMix64(&rng) % n]);
+    }
+
+    int count = 0, agreed = 0, lastSign = 0, result = 1;
+    *skipped = 0;
+    for (int ply = 0;; ply++) {
+        int color = currentTurn % 2;
+        if (!hasAnyLegalMove(color)) {
+            if (isKingInCheck(color)) result = (color == 0) ? 0 : 2;
+            break;
+        }
+        if (drawReason() || insufficientMaterial() || ply >= MATCH_MAX_PLIES) break;
+
+        setSearchLimits(cfg->nodes, 0);
+        int score;
+        Move m = findBestMove(SEARCH_MAX_PLY - 1, &score);
+        int white = (color == 0) ? score : -score;
+        if (isKingInCheck(color) || isCapture(m) || m.promo || abs(score) >= MATE_BOUND) {
+            (*skipped)++;
+        } else {
+            TrainingRecord *r = &recs[count++];
+            packPosition(&r->pos);
+            r->score = (Sint16) (white > 32000 ? 32000 : white < -32000 ? -32000 : white);
+            r->ply = (Uint16) (randomPlies + ply);
+            r->reserved = 0;
+        }
+
+        int sign = (white >= MATCH_RESIGN_SCORE) - (white <= -MATCH_RESIGN_SCORE);
+        agreed = (sign != 0 && sign == lastSign) ? agreed + 1 : (sign != 0);
+        lastSign = sign;
+        if (agreed >= MATCH_RESIGN_PLIES) {
+            result = (sign > 0) ? 2 : 0;
+            break;
+        }
+        playMove(m);
+    }
+    for (int i = 0; i < count; i++) recs[i].result = (Uint8) result;
+    return count;
+}
+
+static void printDatagenProgress(const DatagenJob *job) {
+    const DatagenResult *r = job->result;
+    double secs = (double) (SDL_GetPerformanceCounter() - job->start) / SDL_GetPerformanceFrequency();
+    printf("%8d games %12llu positions  %.1f games/s  %.0f positions/s\n", r->games,
+           (unsigned long long) r->positions, secs > 0 ? r->games / secs : 0.0,
+           secs > 0 ? r->positions / secs : 0.0);
+}
+
+static int datagenWorker(void *data) {
+    DatagenJob *job = data;
+    const DatagenConfig *cfg = job->cfg;
+    headless = true;
+    TransTable tt = {0};
+    TrainingRecord *recs = malloc(MATCH_MAX_PLIES * sizeof(TrainingRecord));
+    bool ready = recs && initTransTable(&tt, cfg->hashMB);
+    searchTT = &tt;
+
+    while (ready && !SDL_AtomicGet(&job->stop)) {
+        int g = SDL_AtomicAdd(&job->next, 1);
+        if (g >= cfg->games) break;
+        int skipped;
+        int count = playDatagenGame(cfg, g, &tt, recs, &skipped);
+        if (count < 0) continue;
+
+        SDL_LockMutex(job->lock);
+        DatagenResult *r = job->result;
+        if (!writeTrainingRecords(job->writer, recs, count)) SDL_AtomicSet(&job->stop, 1);
+        r->games++;
+        r->positions += count;
+        r->skipped += skipped;
+        int every = cfg->games >= 200 ? cfg->games / 20 : 10;
+        if (r->games % every == 0) printDatagenProgress(job);
+        SDL_UnlockMutex(job->lock);
+    }
+
+    freeTransTable(&tt);
+    free(recs);
+    freeMoveHistory();
+    searchTT = NULL;
+    return 0;
+}
+
+// Plays cfg->games self-play games on cfg->threads threads, each with its own
+// transposition table, and streams the kept positions to w as games finish.
+// Every game depends only on the seed and its number, not on the thread that
+// plays it, although the order of games in the shards does.
+bool runDatagen(const DatagenConfig *cfg, TrainingWriter *w, DatagenResult *out) {
+    memset(out, 0, sizeof(*out));
+    if (cfg->games <= 0) return false;
+
+    DatagenJob job;
+    memset(&job, 0, sizeof(job));
+    job.cfg = cfg;
+    job.result = out;
+    job.writer = w;
+    job.lock = SDL_CreateMutex();
+
+    int threads = cfg->threads > 0 ? cfg->threads : SDL_GetCPUCount();
+    if (threads > cfg->games) threads = cfg->games;
+    SDL_Thread **workers = malloc(threads * sizeof(SDL_Thread *));
+    if (!workers || !job.lock) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    job.start = SDL_GetPerformanceCounter();
+    threads = startWorkers(workers, threads, datagenWorker, "datagen", &job);
+    for (int i = 0; i < threads; i++) SDL_WaitThread(workers[i], NULL);
+    out->seconds = (double) (SDL_GetPerformanceCounter() - job.start) / SDL_GetPerformanceFrequency();
+    if (out->games % (cfg->games >= 200 ? cfg->games / 20 : 10) != 0) printDatagenProgress(&job);
+
+    free(workers);
+    SDL_DestroyMutex(job.lock);
+    return !SDL_AtomicGet(&job.stop);
+}
+
+// Shuffles the records of the input shards into new shards of about
+// shardRecords records each, in two passes so that only one shard is ever in
+// memory: every record is appended to a random output shard, then each
+// output shard is shuffled in place. Output shards are built under temporary
+// names and renamed once every input has been read, so the output may reuse
+// the inputs' prefix. Returns the number of records written, or -1 on an
+// I/O error.
+long long shuffleTrainingData(const char **inputs, int inputCount, const char *outPrefix, Uint64 shardRecords,
+                              Uint64 seed) {
+    Uint64 total = 0;
+    for (int i = 0; i < inputCount; i++) {
+        TrainingData data;
+        if (!openTrainingData(&data, inputs[i])) {
+            fprintf(stderr, "Not a training data file: %s\n", inputs[i]);
+            return -1;
+        }
+        total += data.count;
+        closeTrainingData(&data);
+    }
+    if (shardRecords == 0) shardRecords = DATAGEN_SHARD_RECORDS;
+    int shards = (int) ((total + shardRecords - 1) / shardRecords);
+    if (shards < 1) shards = 1;
+
+    FILE **out = calloc(shards, sizeof(FILE *));
+    if (!out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    char path[600], tmp[610];
+    bool ok = true;
+    for (int s = 0; s < shards && ok; s++) {
+        trainingShardPath(path, sizeof(path), outPrefix, s);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        out[s] = fopen(tmp, "wb");
+        ok = out[s] != NULL;
+    }
+    Uint64 rng = seed;
+    for (int i = 0; i < inputCount && ok; i++) {
+        TrainingData data;
+        if (!openTrainingData(&data, inputs[i])) {
+            ok = false;
+            break;
+        }
+        for (Uint64 r = 0; r < data.count && ok; r++) {
+            ok = fwrite(&data.records[r], sizeof(TrainingRecord), 1, out[splitMix64(&rng) % shards]) == 1;
+        }
+        closeTrainingData(&data);
+    }
+    for (int s = 0; s < shards; s++) {
+        if (out[s] && fclose(out[s]) != 0) ok = false;
+    }
+    free(out);
+
+    for (int s = 0; s < shards && ok; s++) {
+        trainingShardPath(path, sizeof(path), outPrefix, s);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *f = fopen(tmp, "rb");
+        if (!f) {
+            ok = false;
+            break;
+        }
+        fseek(f, 0, SEEK_END);
+        long bytes = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        size_t n = bytes > 0 ? (size_t) bytes / sizeof(TrainingRecord) : 0;
+        TrainingRecord *recs = malloc(n ? n * sizeof(TrainingRecord) : 1);
+        if (!recs) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        ok = fread(recs, sizeof(TrainingRecord), n, f) == n;
+        fclose(f);
+        for (size_t i = n; ok && i > 1; i--) {
+            size_t j = splitMix64(&rng) % i;
+            TrainingRecord t = recs[i - 1];
+            recs[i - 1] = recs[j];
+            recs[j] = t;
+        }
+        f = ok ? fopen(tmp, "wb") : NULL;
+        ok = f && fwrite(recs, sizeof(TrainingRecord), n, f) == n;
+        if (f && fclose(f) != 0) ok = false;
+        free(recs);
+    }
+
+    for (int s = 0; s < shards; s++) {
+        trainingShardPath(path, sizeof(path), outPrefix, s);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        if (ok && !replaceFile(tmp, path)) {
+            fprintf(stderr, "Could not rename %s to %s\n", tmp, path);
+            ok = false;
+        }
+        if (!ok) remove(tmp);
+    }
+    return ok ? (long long) total : -1;
+}
+
+// -------------------------
+// Event Handling
+// -------------------------
+
+static void handleClick(int mx, int my) {
+    if (awaitingPromotion) {
+        const char *options = "qrbn";
+        for (int i = 0; i < 4; i++) {
+            SDL_Rect optRect = {BOARD_WIDTH + 40 + i * 60, 200, 50, 50};
+            if (mx >= optRect.x && mx <= optRect.x + optRect.w &&
+                my >= optRect.y && my <= optRect.y + optRect.h) {
+                Move m = pendingPromotion;
+                m.promo = (char) toupper(options[i]);
+                awaitingPromotion = false;
+                promotionJustCompleted = true;
+                playMove(m);
+                break;
+            }
+        }
+        return;
+    }
+
+    if (currentState == MAIN_MENU) {
+        if (SDL_PointInRect(&(SDL_Point){mx, my}, &playButton)) {
+            playWithBot = false;
+            currentState = CHESS_BOARD;
+            startJournal();
+        } else if (SDL_PointInRect(&(SDL_Point){mx, my}, &botButton)) {
+            playWithBot = true;
+            currentState = CHESS_BOARD;
+            startJournal();
+        } else if (SDL_PointInRect(&(SDL_Point){mx, my}, &pgnButton)) {
+            playPGNFile(pgnFilePath);
+            if (currentState == CHESS_BOARD) startJournal();
+        }
+    } else if (currentState == CHESS_BOARD) {
+        // “Back” button
+        if (SDL_PointInRect(&(SDL_Point){mx, my}, &backButton)) {
+            stopJournal(true);
+            resetGameState();
+            currentState = MAIN_MENU;
+            return;
+        }
+        // “Save PGN” button; a replay (headless) must not overwrite the user's files
+        if (SDL_PointInRect(&(SDL_Point){mx, my}, &savePGNButton)) {
+            if (!headless) {
+                savePGN(pgnFilePath);
+                saveGame(SAVE_FILE);
+            }
+            return;
+        }
+
+        int col = mx / TILE_SIZE;
+        int row = my / TILE_SIZE;
+        if (row < 0 || row >= BOARD_SIZE || col < 0 || col >= BOARD_SIZE) {
+            // clicked on side panel; ignore
+            return;
+        }
+
+        if (!pieceSelected) {
+            // Select a piece
+            char p = board[row][col];
+            if (p != ' ' &&
+                ((currentTurn % 2 == 0 && isWhitePiece(p)) ||
+                 (currentTurn % 2 == 1 && !isWhitePiece(p)))) {
+                selectedRow = row;
+                selectedCol = col;
+                pieceSelected = true;
+                computeValidMoves(row, col);
+            }
+        } else {
+            // Already have a piece selected
+            if (validMoves[row][col]) {
+                // Do the human move
+                char mv[6] = {
+                    (char) ('a' + selectedCol),
+                    (char) ('8' - selectedRow),
+                    (char) ('a' + col),
+                    (char) ('8' - row),
+                    '\0'
+                };
+                movePieceStoringLog(mv);
+
+                // Redraw after human move
+                SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255);
+                SDL_RenderClear(renderer);
+                renderBoardWithBack();
+                Uint64 delay = traceBegin();
+                SDL_Delay(200);
+                traceEnd(delay, "SDL_Delay");
+
+                if (playWithBot && currentTurn % 2 == botPlaysColor) {
+                    delay = traceBegin();
+                    SDL_Delay(300);
+                    traceEnd(delay, "SDL_Delay");
+                    engineMove(1);
+                }
+            }
+            // Clear selection
+            pieceSelected = false;
+            memset(validMoves, 0, sizeof(validMoves));
+        }
+    }
+}
+
+void handleMouseClick(int mx, int my) {
+    Uint64 zone = traceBegin();
+    handleClick(mx, my);
+    traceEnd(zone, "handleMouseClick");
+}
+
+// Left/Right step one ply, PageUp/PageDown ten, Home/End jump to the start or
+// the latest move. Key repeat makes holding a key scrub through the game.
+// V switches to the next variation that branches at the shown ply.
+// A toggles the analysis lines in the side panel, F the frame-time graph, and
+// T starts tracing or, when it runs, writes TRACE_FILE and stops it.
+void handleKeyDown(SDL_Keycode key) {
+    if (currentState != CHESS_BOARD || awaitingPromotion) return;
+    Uint64 zone = traceBegin();
+    switch (key) {
+        case SDLK_a:
+            analysisEnabled = !analysisEnabled;
+            analysisCount = 0;
+            return;
+        case SDLK_f:
+            frameGraphEnabled = !frameGraphEnabled;
+            return;
+        case SDLK_t:
+            if (SDL_AtomicGet(&tracingEnabled)) {
+                stopTracing();
+                writeTrace(TRACE_FILE);
+            } else {
+                startTracing();
+                printf("Tracing started, press T again to write %s\n", TRACE_FILE);
+            }
+            return;
+        case SDLK_LEFT: seekPly(history.cursor - 1); break;
+        case SDLK_RIGHT: seekPly(history.cursor + 1); break;
+        case SDLK_PAGEUP: seekPly(history.cursor - 10); break;
+        case SDLK_PAGEDOWN: seekPly(history.cursor + 10); break;
+        case SDLK_HOME: seekPly(0); break;
+        case SDLK_END: seekPly(history.count); break;
+        case SDLK_v: switchVariation(); break;
+        default: return;
+    }
+    pieceSelected = false;
+    memset(validMoves, 0, sizeof(validMoves));
+    traceEnd(zone, "handleKeyDown");
+}
+
+// Dispatches one window event, adding it to the input recording if one is
+// open. Returns false when the window is being closed.
+bool handleEvent(const SDL_Event *e) {
+    if (e->type == SDL_QUIT) {
+        recordInput(e);
+        stopJournal(true);
+        return false;
+    }
+    if (e->type == SDL_MOUSEBUTTONDOWN && e->button.button == SDL_BUTTON_LEFT) {
+        recordInput(e);
+        handleMouseClick(e->button.x, e->button.y);
+    }
+    if (e->type == SDL_KEYDOWN) {
+        recordInput(e);
+        handleKeyDown(e->key.keysym.sym);
+    }
+    return true;
+}
+
+// -------------------------
+// Input Recording
+// -------------------------
+
+// A recording is text: INPUT_RECORDING_HEADER, a start line with the screen,
+// the bot settings and the position as FEN, then one line per input with its
+// time in milliseconds since the recording started:
+//   start board 1 1 rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1
+//   1520 click 285 420
+//   2210 key 1073741904
+//   9000 quit
+// Move history from before the recording is not part of it.
+bool startInputRecording(const char *path) {
+    inputRecording = fopen(path, "w");
+    if (!inputRecording) {
+        printf("Could not open input recording %s\n", path);
+        return false;
+    }
+    char fen[FEN_MAX_LEN];
+    writeFEN(fen);
+    fprintf(inputRecording, "%s\nstart %s %d %d %s\n", INPUT_RECORDING_HEADER,
+            currentState == CHESS_BOARD ? "board" : "menu", playWithBot, botPlaysColor, fen);
+    recordingStart = SDL_GetTicks();
+    return true;
+}
+
+void stopInputRecording() {
+    if (inputRecording) fclose(inputRecording);
+    inputRecording = NULL;
+}
+
+void recordInput(const SDL_Event *e) {
+    if (!inputRecording) return;
+    Uint32 millis = SDL_GetTicks() - recordingStart;
+    if (e->type == SDL_MOUSEBUTTONDOWN) {
+        fprintf(inputRecording, "%u click %d %d\n", millis, e->button.x, e->button.y);
+    } else if (e->type == SDL_KEYDOWN) {
+        fprintf(inputRecording, "%u key %d\n", millis, (int) e->key.keysym.sym);
+    } else if (e->type == SDL_QUIT) {
+        fprintf(inputRecording, "%u quit\n", millis);
+    }
+    fflush(inputRecording); // inputs are rare; keep the file usable after a crash
+}
+
+// Turns an input line into the event it recorded; false for other lines.
+static bool parseRecordedInput(const char *line, Uint32 *millis, SDL_Event *e) {
+    char kind[16];
+    int a = 0, b = 0;
+    int fields = sscanf(line, "%u %15s %d %d", millis, kind, &a, &b);
+    if (fields < 2) return false;
+    memset(e, 0, sizeof(*e));
+    if (strcmp(kind, "click") == 0 && fields == 4) {
+        e->type = SDL_MOUSEBUTTONDOWN;
+        e->button.button = SDL_BUTTON_LEFT;
+        e->button.x = a;
+        e->button.y = b;
+    } else if (strcmp(kind, "key") == 0 && fields >= 3) {
+        e->type = SDL_KEYDOWN;
+        e->key.keysym.sym = a;
+    } else if (strcmp(kind, "quit") == 0) {
+        e->type = SDL_QUIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool applyRecordingStart(const char *line) {
+    char screen[8], fen[FEN_MAX_LEN];
+    int withBot, botColor;
+    if (sscanf(line, "start %7s %d %d %95[^\n]", screen, &withBot, &botColor, fen) != 4 || !loadFEN(fen)) {
+        return false;
+    }
+    currentState = strcmp(screen, "board") == 0 ? CHESS_BOARD : MAIN_MENU;
+    playWithBot = withBot != 0;
+    botPlaysColor = botColor ? 1 : 0;
+    analysisEnabled = frameGraphEnabled = false;
+    analysisCount = 0;
+    analysisRequest = 0;
+    return true;
+}
+
+// One frame as the window loop runs it, minus the sleep; returns milliseconds.
+static double replayFrame(const SDL_Event *e) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (e) handleEvent(e);
+    drawFrame();
+    double millis = 1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    recordFrameTime(millis);
+    return millis;
+}
+
+// Plays a recording back on the calling thread's (offscreen) renderer as fast
+// as it renders. Each input gets a frame of its own; a pause before it becomes
+// up to REPLAY_IDLE_FRAMES idle frames, enough for deferred work such as the
+// analysis refresh to land in some frame without replaying the user's think time.
+bool replayInputRecording(const char *path, ReplayTimings *out) {
+    memset(out, 0, sizeof(*out));
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open input recording: %s\n", path);
+        return false;
+    }
+    char line[256];
+    if (!fgets(line, sizeof(line), f) || strncmp(line, INPUT_RECORDING_HEADER, strlen(INPUT_RECORDING_HEADER)) != 0) {
+        fprintf(stderr, "%s is not an input recording\n", path);
+        fclose(f);
+        return false;
+    }
+
+    // Size the timing arrays from a first pass over the inputs
+    int inputs = 0;
+    Uint32 millis;
+    SDL_Event e;
+    while (fgets(line, sizeof(line), f)) {
+        if (parseRecordedInput(line, &millis, &e)) inputs++;
+    }
+    out->inputMillis = malloc((inputs + 1) * sizeof(double));
+    out->frameMillis = malloc((inputs + 1) * (REPLAY_IDLE_FRAMES + 1) * sizeof(double));
+    if (!out->inputMillis || !out->frameMillis) {
+        fprintf(stderr, "Out of memory\n");
+        fclose(f);
+        freeReplayTimings(out);
+        return false;
+    }
+
+    rewind(f);
+    bool started = false;
+    Uint32 last = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "start ", 6) == 0) {
+            started = applyRecordingStart(line);
+            if (!started) break;
+            continue;
+        }
+        if (!started || !parseRecordedInput(line, &millis, &e)) continue;
+
+        int idle = millis > last ? (int) ((millis - last) / FRAME_DELAY_MS) : 0;
+        if (idle > REPLAY_IDLE_FRAMES) idle = REPLAY_IDLE_FRAMES;
+        for (int i = 0; i < idle; i++) out->frameMillis[out->frames++] = replayFrame(NULL);
+        last = millis;
+        if (e.type == SDL_QUIT) break;
+
+        double ms = replayFrame(&e);
+        out->inputMillis[out->inputs++] = ms;
+        out->frameMillis[out->frames++] = ms;
+    }
+    fclose(f);
+    if (!started) {
+        fprintf(stderr, "%s has no valid start line\n", path);
+        freeReplayTimings(out);
+        return false;
+    }
+    return true;
+}
+
+void freeReplayTimings(ReplayTimings *t) {
+    free(t->inputMillis);
+    free(t->frameMillis);
+    memset(t, 0, sizeof(*t));
+}
+
+// -------------------------
+// Command Line
+// -------------------------
+
+static void printUsage() {
+    printf("Usage:\n");
+    printf("  chess [--pgn file.pgn]                  start the game window\n");
+    printf("  chess --resume [save.bin]               continue a game saved with \"Save\"\n");
+    printf("        [--journal-sync none|group|always] fsync policy of the crash journal\n");
+    printf("  chess [--trace trace.json] ...          record Chrome trace events of any run\n");
+    printf("  chess --record input.rec                record the window's input for \"replay\"\n");
+    printf("  chess replay <input.rec>...             replay recordings offscreen, report latency\n");
+    printf("  chess render --fen <FEN> [--out file.png]\n");
+    printf("  chess render --pgn <file.pgn> [--ply N] [--out file.png]\n");
+    printf("  chess render-batch <file.pgn> <outdir> [--threads N] [--every N]\n");
+    printf("  chess pgn-scan <file.pgn>\n");
+    printf("  chess pgn-convert <in.pgn> <out.pgn> [--errors file] [--db file] [--threads N]\n");
+    printf("  chess db-build <in.pgn> <out.db> [--errors file] [--threads N]\n");
+    printf("  chess db-info <file.db> [--game N]\n");
+    printf("  chess pos-index <file.db> <out.idx> [--threads N]\n");
+    printf("  chess pos-query <file.db> <file.idx> [--fen FEN | --moves \"e4 e5 ...\"] [--list N] [--bench N]\n");
+    printf("  chess san-bench <file.pgn>\n");
+    printf("  chess see [--bench N]\n");
+    printf("  chess mate <file.epd> [--moves N] [--nodes N] [--threads N]\n");
+    printf("  chess search [--fen FEN] [--depth N] [--hash MB] [--multipv N] [--uci] [--json]\n");
+    printf("        [--no-pvs] [--no-aspiration] [--no-null] [--no-lmr] [--no-check-ext] [--no-futility]\n");
+    printf("  chess bench [--depth N] [--hash MB]       node-count signature of the search\n");
+    printf("  chess microbench [--ms N]\n");
+    printf("  chess match <openings.epd|.pgn> [--out file.pgn] [--games N] [--threads N] [--hash MB]\n");
+    printf("        [--engine1 SPEC] [--engine2 SPEC] [--nodes N] [--movetime MS] [--depth N]\n");
+    printf("        [--sprt elo0,elo1] [--alpha A] [--beta B]\n");
+    printf("        SPEC: comma list of name=X depth=N nodes=N movetime=MS nopvs noaspiration\n");
+    printf("              nonull nolmr nocheckext nofutility\n");
+    printf("  chess annotate <in.pgn> <out.pgn> [--nodes N] [--movetime MS] [--depth N] [--engine SPEC]\n");
+    printf("        [--hash MB] [--threads N] [--errors file]\n");
+    printf("  chess tune <positions.epd|.pgn> [--out eval_weights.h] [--epochs N] [--rate R] [--threads N]\n");
+    printf("  chess datagen <out-prefix> [--games N] [--nodes N] [--random-plies N] [--openings file.epd|.pgn]\n");
+    printf("        [--threads N] [--hash MB] [--shard N] [--seed S]  writes out-prefix_000.bin, ...\n");
+    printf("  chess datagen-info <shard.bin>... [--dump N]\n");
+    printf("  chess datagen-shuffle <out-prefix> <shard.bin>... [--shard N] [--seed S]\n");
+}
+
+typedef struct {
+    long plies;
+    long comments;
+    long variations;
+    long truncated;
+} PGNScanStats;
+
+static bool scanPGNGame(const PGNGame *game, void *ctx) {
+    PGNScanStats *st = ctx;
+    st->plies += game->plyCount;
+    st->comments += game->commentCount;
+    st->variations += game->variationCount;
+    if (game->truncated) st->truncated++;
+    return true;
+}
+
+// Parses a whole file without replaying it and reports parser throughput.
+static int cmdPGNScan(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    FILE *f = fopen(argv[0], "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open PGN file: %s\n", argv[0]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    double mb = ftell(f) / (1024.0 * 1024.0);
+    fclose(f);
+
+    PGNScanStats st = {0};
+    Uint64 start = SDL_GetPerformanceCounter();
+    long games = parsePGNFile(argv[0], scanPGNGame, &st);
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    printf("%ld games, %ld plies, %ld comments, %ld variations, %ld truncated\n",
+           games, st.plies, st.comments, st.variations, st.truncated);
+    printf("%.1f MB in %.3fs (%.1f MB/s, %.0f games/s)\n",
+           mb, secs, secs > 0 ? mb / secs : 0.0, secs > 0 ? games / secs : 0.0);
+    return 0;
+}
+
+typedef struct {
+    int maxPly;
+    bool ok;
+} ReplayTarget;
+
+static bool replayFirstGameTo(const PGNGame *game, void *ctx) {
+    ReplayTarget *target = ctx;
+    target->ok = replayPGNGame(game, target->maxPly, NULL, NULL) >= 0;
+    return false;
+}
+
+static int cmdRender(int argc, char *argv[]) {
+    const char *fen = NULL;
+    const char *pgn = NULL;
+    const char *out = "board.png";
+    int ply = -1;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--fen") == 0) fen = argv[i + 1];
+        else if (strcmp(argv[i], "--pgn") == 0) pgn = argv[i + 1];
+        else if (strcmp(argv[i], "--ply") == 0) ply = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--out") == 0) out = argv[i + 1];
+    }
+    if (!fen && !pgn) {
+        printUsage();
+        return 1;
+    }
+
+    initHeadless();
+    headless = true;
+    int status = 0;
+    if (fen) {
+        if (!loadFEN(fen)) {
+            fprintf(stderr, "Invalid FEN: %s\n", fen);
+            status = 1;
+        }
+    } else {
+        ReplayTarget target = {ply, false};
+        resetGameState();
+        if (parsePGNFile(pgn, replayFirstGameTo, &target) <= 0 || !target.ok) {
+            fprintf(stderr, "Could not replay %s\n", pgn);
+            status = 1;
+        }
+    }
+
+    if (status == 0) {
+        if (initOffscreenRenderer(BOARD_WIDTH, BOARD_WIDTH)) {
+            status = renderBoardToPNG(out) ? 0 : 1;
+            cleanupOffscreenRenderer();
+        } else {
+            status = 1;
+        }
+    }
+    cleanupHeadless();
+    return status;
+}
+
+static int cmdRenderBatch(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    int threads = 0, every = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--every") == 0) every = atoi(argv[i + 1]);
+    }
+    initHeadless();
+    renderBatch(argv[0], argv[1], threads, every < 0 ? 0 : every);
+    cleanupHeadless();
+    return 0;
+}
+
+static int cmdPGNConvert(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    const char *errFile = NULL, *dbFile = NULL;
+    int threads = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--errors") == 0) errFile = argv[i + 1];
+        else if (strcmp(argv[i], "--db") == 0) dbFile = argv[i + 1];
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    }
+    long invalid = convertPGNFile(argv[0], argv[1], errFile, dbFile, threads);
+    if (invalid < 0) return 1;
+    return invalid ? 2 : 0;
+}
+
+static int cmdDBBuild(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    const char *errFile = NULL;
+    int threads = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--errors") == 0) errFile = argv[i + 1];
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    }
+    long invalid = convertPGNFile(argv[0], NULL, errFile, argv[1], threads);
+    if (invalid < 0) return 1;
+    return invalid ? 2 : 0;
+}
+
+// Opens a database and reports how long that took; with --game N also prints
+// that game (1-based) as PGN.
+static int cmdDBInfo(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    long gameNumber = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--game") == 0) gameNumber = atol(argv[i + 1]);
+    }
+
+    GameDB db;
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (!openGameDB(&db, argv[0])) {
+        fprintf(stderr, "Could not open game database: %s\n", argv[0]);
+        return 1;
+    }
+    double ms = (double) (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    printf("%ld games, %llu moves, %.1f MB, opened in %.3f ms\n", gameDBCount(&db),
+           (unsigned long long) db.header->moveCount, db.map.size / (1024.0 * 1024.0), ms);
+
+    int status = 0;
+    if (gameNumber > 0) {
+        headless = true;
+        long id = gameNumber - 1;
+        if (!replayGameDBGame(&db, id, -1)) {
+            fprintf(stderr, "No game %ld\n", gameNumber);
+            status = 1;
+        } else {
+            const GameIndexEntry *e = &db.index[id];
+            const char *p = db.tags + e->tagOffset, *end = p + e->tagBytes;
+            TextBuffer text = {0};
+            while (p && p < end) {
+                const char *value, *next = nextGameDBTag(p, end, &value);
+                if (next) appendTagPair(&text, p, value);
+                p = next;
+            }
+            textAppend(&text, "\n", 1);
+            formatPGNMovetext(&text, gameDBResultString(e->result));
+            fwrite(text.data, 1, text.len, stdout);
+            freeTextBuffer(&text);
+        }
+    }
+    closeGameDB(&db);
+    return status;
+}
+
+static int cmdPosIndex(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    int threads = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    }
+    return buildPositionIndex(argv[0], argv[1], threads) ? 0 : 1;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Times `samples` lookups of positions drawn from the index itself and prints
+// latency percentiles.
+static void benchPositionQueries(const PositionIndex *idx, const GameDB *db, int samples) {
+    double *micros = malloc(samples * sizeof(double));
+    if (!micros || idx->header->keyCount == 0) {
+        free(micros);
+        return;
+    }
+    PositionMoveStats stats[MAX_MOVES];
+    Uint64 state = 12345;
+    for (int i = 0; i < samples; i++) {
+        Uint64 key = idx->keys[splitMix64(&state) % idx->header->keyCount].key;
+        long games;
+        Uint64 start = SDL_GetPerformanceCounter();
+        positionMoveStats(idx, db, key, stats, MAX_MOVES, &games);
+        micros[i] = (double) (SDL_GetPerformanceCounter() - start) * 1e6 / SDL_GetPerformanceFrequency();
+    }
+    qsort(micros, samples, sizeof(double), compareDoubles);
+    printf("%d queries: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", samples,
+           micros[samples / 2], micros[samples * 9 / 10], micros[samples * 99 / 100], micros[samples - 1]);
+    free(micros);
+}
+
+// Looks up a position given as FEN or as SAN moves from the start and prints
+// the moves played from it with their statistics.
+static int cmdPosQuery(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    const char *fen = NULL, *moves = NULL;
+    int list = 0, bench = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--fen") == 0) fen = argv[i + 1];
+        else if (strcmp(argv[i], "--moves") == 0) moves = argv[i + 1];
+        else if (strcmp(argv[i], "--list") == 0) list = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--bench") == 0) bench = atoi(argv[i + 1]);
+    }
+
+    GameDB db;
+    PositionIndex idx;
+    if (!openGameDB(&db, argv[0])) {
+        fprintf(stderr, "Could not open game database: %s\n", argv[0]);
+        return 1;
+    }
+    if (!openPositionIndex(&idx, argv[1], &db)) {
+        fprintf(stderr, "Could not open position index: %s\n", argv[1]);
+        closeGameDB(&db);
+        return 1;
+    }
+
+    headless = true;
+    int status = 0;
+    if (fen) {
+        if (!loadFEN(fen)) {
+            fprintf(stderr, "Invalid FEN: %s\n", fen);
+            status = 1;
+        }
+    } else {
+        resetGameState();
+        char san[PGN_SAN_LEN];
+        for (const char *p = moves; p && *p && status == 0;) {
+            int len = 0;
+            while (*p == ' ') p++;
+            while (*p && *p != ' ') {
+                if (len < PGN_SAN_LEN - 1) san[len++] = *p;
+                p++;
+            }
+            san[len] = '\0';
+            SANError err = len > 0 ? applySANMove(san) : SAN_OK;
+            if (err != SAN_OK) {
+                fprintf(stderr, "Bad move %s: %s\n", san, sanErrorString(err));
+                status = 1;
+            }
+        }
+    }
+
+    if (status == 0) {
+        Uint64 key = computeZobristKey();
+        PositionMoveStats stats[MAX_MOVES];
+        long games;
+        int n = positionMoveStats(&idx, &db, key, stats, MAX_MOVES, &games);
+        printf("Position %016llx reached in %ld games\n", (unsigned long long) key, games);
+        for (int i = 0; i < n; i++) {
+            char san[PGN_SAN_LEN];
+            encodeSAN(unpackMove(stats[i].move), san);
+            printf("  %-8s %7ld games  %5.1f%%  ", san, stats[i].games,
+                   stats[i].scored ? 100.0 * stats[i].points / stats[i].scored : 0.0);
+            if (stats[i].rated) {
+                printf("avg rating %.0f\n", stats[i].ratingSum / stats[i].rated);
+            } else {
+                printf("unrated\n");
+            }
+        }
+
+        const PositionKey *k = findPosition(&idx, key);
+        for (Uint64 i = 0; k && i < k->count && list > 0; i++) {
+            const PositionEntry *e = &idx.entries[k->first + i];
+            if (e->game >= gameDBCount(&db)) continue;
+            if (i > 0 && e->game == idx.entries[k->first + i - 1].game) continue;
+            const char *white = gameDBTag(&db, e->game, "White");
+            const char *black = gameDBTag(&db, e->game, "Black");
+            printf("  game %lu, ply %d: %s - %s %s\n", (unsigned long) e->game + 1, e->ply,
+                   white ? white : "?", black ? black : "?", gameDBResultString(db.index[e->game].result));
+            list--;
+        }
+    }
+
+    if (bench > 0) benchPositionQueries(&idx, &db, bench);
+    closePositionIndex(&idx);
+    closeGameDB(&db);
+    return status;
+}
+
+typedef struct {
+    long moves;
+    long games;
+    long failedGames;
+    long errors[SAN_BAD_PROMOTION + 1];
+    Uint64 ticks;
+} SANBenchStats;
+
+static bool benchSANGame(const PGNGame *game, void *ctx) {
+    SANBenchStats *st = ctx;
+    if (!setupPGNStart(game)) {
+        st->errors[SAN_BAD_SYNTAX]++;
+        st->failedGames++;
+        return true;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < game->plyCount; i++) {
+        Move m;
+        Undo u;
+        SANError err = decodeSAN(game->san[i], currentTurn % 2, &m);
+        if (err != SAN_OK) {
+            st->errors[err]++;
+            st->failedGames++;
+            break;
+        }
+        makeMove(m, &u);
+        currentTurn++;
+        st->moves++;
+    }
+    st->ticks += SDL_GetPerformanceCounter() - start;
+    st->games++;
+    return true;
+}
+
+// Times decodeSAN() + makeMove() over every game of a file (parsing excluded).
+static int cmdSANBench(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    headless = true;
+    SANBenchStats st = {0};
+    if (parsePGNFile(argv[0], benchSANGame, &st) < 0) {
+        fprintf(stderr, "Could not open PGN file: %s\n", argv[0]);
+        return 1;
+    }
+    double secs = (double) st.ticks / SDL_GetPerformanceFrequency();
+    printf("%ld moves decoded in %ld games, %.3fs (%.0f moves/s)\n",
+           st.moves, st.games, secs, secs > 0 ? st.moves / secs : 0.0);
+    for (int e = SAN_BAD_SYNTAX; e <= SAN_BAD_PROMOTION; e++) {
+        if (st.errors[e]) printf("  %ld games stopped: %s\n", st.errors[e], sanErrorString((SANError) e));
+    }
+    return st.failedGames ? 2 : 0;
+}
+
+typedef struct {
+    char fen[FEN_MAX_LEN];
+    char id[48];
+    int expected; // "dm" operation, 0 if absent
+    MateResult result;
+    bool valid;
+    double millis;
+    char line[256];
+} MateProblem;
+
+typedef struct {
+    MateProblem *problems;
+    int count;
+    int maxMoves;
+    Uint64 maxNodes;
+    SDL_atomic_t next;
+} MateJob;
+
+static int mateWorker(void *data) {
+    MateJob *job = data;
+    headless = true;
+    for (;;) {
+        int i = SDL_AtomicAdd(&job->next, 1);
+        if (i >= job->count) break;
+        MateProblem *p = &job->problems[i];
+        if (!loadFEN(p->fen)) continue;
+        p->valid = true;
+        int maxMoves = p->expected ? p->expected : job->maxMoves;
+        Uint64 start = SDL_GetPerformanceCounter();
+        solveMate(maxMoves, job->maxNodes, &p->result);
+        p->millis = 1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+        if (p->result.found) formatPVLine(&p->result.line, SEARCH_MAX_PLY, p->line, sizeof(p->line));
+    }
+    freeMateTable();
+    return 0;
+}
+
+// Splits an EPD record into a FEN (its four position fields, with clocks
+// "0 1") and the operations that follow. Returns false for blank and
+// comment lines.
+static bool parseEPDRecord(const char *line, char *fen, const char **ops) {
+    char placement[72], side[4], castling[8], ep[4];
+    int used = 0;
+    if (sscanf(line, "%71s %3s %7s %3s %n", placement, side, castling, ep, &used) < 4) return false;
+    if (placement[0] == '#') return false;
+    snprintf(fen, FEN_MAX_LEN, "%s %s %s %s 0 1", placement, side, castling, ep);
+    *ops = line + used;
+    return true;
+}
+
+// Finds the operation `opcode` in the operations of an EPD record (as in
+// `dm 3; id "WAC.001";`) and copies its first operand, without quotes, into
+// operand (empty if it has none). Opcodes match whole words only; a quoted
+// operand may contain spaces and semicolons.
+static bool findEPDOperation(const char *ops, const char *opcode, char *operand, size_t size) {
+    size_t n = strlen(opcode);
+    const char *p = ops;
+    for (;;) {
+        while (isspace((unsigned char) *p) || *p == ';') p++;
+        if (!*p) return false;
+        const char *op = p;
+        while (*p && !isspace((unsigned char) *p) && *p != ';') p++;
+        bool match = (size_t) (p - op) == n && strncmp(op, opcode, n) == 0;
+        if (match) operand[0] = '\0';
+        for (bool first = true; *p && *p != ';'; first = false) {
+            while (isspace((unsigned char) *p)) p++;
+            if (!*p || *p == ';') break;
+            const char *start = p;
+            size_t len;
+            if (*p == '"') {
+                start = ++p;
+                while (*p && *p != '"') p++;
+                len = (size_t) (p - start);
+                if (*p) p++;
+            } else {
+                while (*p && !isspace((unsigned char) *p) && *p != ';') p++;
+                len = (size_t) (p - start);
+            }
+            if (match && first) {
+                snprintf(operand, size, "%.*s", (int) len, start);
+                return true;
+            }
+        }
+        if (match) return true;
+    }
+}
+
+// Reads EPD records: four FEN fields, then operations such as dm (mate
+// length, which also caps the search) and id.
+static int readMateProblems(const char *path, MateProblem **out) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int count = 0, capacity = 0;
+    MateProblem *problems = NULL;
+    char buf[512], fen[FEN_MAX_LEN];
+    const char *ops;
+    while (fgets(buf, sizeof(buf), f)) {
+        if (!parseEPDRecord(buf, fen, &ops)) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            MateProblem *grown = realloc(problems, capacity * sizeof(MateProblem));
+            if (!grown) break;
+            problems = grown;
+        }
+        MateProblem *p = &problems[count];
+        memset(p, 0, sizeof(*p));
+        memcpy(p->fen, fen, sizeof(p->fen));
+        snprintf(p->id, sizeof(p->id), "#%d", count + 1);
+        char operand[sizeof(p->id)];
+        if (findEPDOperation(ops, "dm", operand, sizeof(operand))) p->expected = atoi(operand);
+        if (findEPDOperation(ops, "id", operand, sizeof(operand)) && operand[0]) {
+            memcpy(p->id, operand, sizeof(p->id));
+        }
+        count++;
+    }
+    fclose(f);
+    *out = problems;
+    return count;
+}
+
+// Solves every problem of an EPD file on a pool of threads, each with its own
+// mate table, and prints the solution and solve time per problem.
+static int cmdMate(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    int maxMoves = 5, threads = 0;
+    Uint64 maxNodes = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--moves") == 0) maxMoves = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--nodes") == 0) maxNodes = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    }
+
+    MateJob job;
+    memset(&job, 0, sizeof(job));
+    job.count = readMateProblems(argv[0], &job.problems);
+    if (job.count < 0) {
+        fprintf(stderr, "Could not open EPD file: %s\n", argv[0]);
+        return 1;
+    }
+    job.maxMoves = maxMoves < 1 ? 1 : maxMoves;
+    job.maxNodes = maxNodes;
+
+    if (threads < 1) threads = SDL_GetCPUCount();
+    SDL_Thread **workers = malloc(threads * sizeof(SDL_Thread *));
+    if (!workers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    threads = startWorkers(workers, threads, mateWorker, "mate", &job);
+    if (threads == 0) {
+        free(workers);
+        free(job.problems);
+        return 1;
+    }
+    for (int i = 0; i < threads; i++) SDL_WaitThread(workers[i], NULL);
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    int solved = 0, wrong = 0;
+    double total = 0;
+    for (int i = 0; i < job.count; i++) {
+        const MateProblem *p = &job.problems[i];
+        total += p->millis;
+        if (!p->valid) {
+            printf("%-16s invalid FEN\n", p->id);
+            wrong++;
+            continue;
+        }
+        if (!p->result.found) {
+            printf("%-16s no mate found  %9.1f ms %10llu nodes\n", p->id, p->millis,
+                   (unsigned long long) p->result.nodes);
+            wrong++;
+            continue;
+        }
+        solved++;
+        bool mismatch = p->expected && p->result.mateIn != p->expected;
+        if (mismatch) wrong++;
+        printf("%-16s mate in %-2d %s %9.1f ms %10llu nodes  %s\n", p->id, p->result.mateIn,
+               mismatch ? "(!)" : "   ", p->millis, (unsigned long long) p->result.nodes, p->line);
+    }
+    printf("%d/%d solved, %.1f ms solving, %.3fs wall on %d threads\n", solved, job.count, total, secs, threads);
+    free(workers);
+    free(job.problems);
+    return wrong ? 2 : 0;
+}
+
+typedef struct {
+    char (*fens)[FEN_MAX_LEN];
+    int count, capacity;
+} OpeningList;
+
+static bool addOpening(OpeningList *list, const char *fen) {
+    if (list->count == list->capacity) {
+        int cap = list->capacity ? list->capacity * 2 : 64;
+        char (*grown)[FEN_MAX_LEN] = realloc(list->fens, cap * sizeof(*grown));
+        if (!grown) return false;
+        list->fens = grown;
+        list->capacity = cap;
+    }
+    memcpy(list->fens[list->count++], fen, FEN_MAX_LEN);
+    return true;
+}
+
+static bool addPGNOpening(const PGNGame *game, void *ctx) {
+    char fen[FEN_MAX_LEN];
+    if (replayPGNGame(game, -1, NULL, NULL) < 0) return true;
+    writeFEN(fen);
+    return addOpening(ctx, fen);
+}
+
+// Opening positions: every record of an EPD file, or the final position of
+// every game of a PGN file. Returns the count, -1 if the file cannot be read.
+static int readOpenings(const char *path, OpeningList *list) {
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".pgn") == 0) {
+        return parsePGNFile(path, addPGNOpening, list) < 0 ? -1 : list->count;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[512], fen[FEN_MAX_LEN];
+    const char *ops;
+    while (fgets(buf, sizeof(buf), f)) {
+        if (parseEPDRecord(buf, fen, &ops) && loadFEN(fen) && !addOpening(list, fen)) break;
+    }
+    fclose(f);
+    return list->count;
+}
+
+// Comma-separated engine settings: name=X, depth=N, nodes=N, movetime=MS and
+// nopvs, noaspiration, nonull, nolmr, nocheckext, nofutility.
+static bool parseEngineSpec(const char *spec, EngineConfig *e) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        if (strncmp(item, "name=", 5) == 0) snprintf(e->name, sizeof(e->name), "%s", item + 5);
+        else if (strncmp(item, "depth=", 6) == 0) e->depth = atoi(item + 6);
+        else if (strncmp(item, "nodes=", 6) == 0) e->nodes = strtoull(item + 6, NULL, 10);
+        else if (strncmp(item, "movetime=", 9) == 0) e->movetime = atoi(item + 9);
+        else if (strcmp(item, "nopvs") == 0) e->options.pvs = false;
+        else if (strcmp(item, "noaspiration") == 0) e->options.aspiration = false;
+        else if (strcmp(item, "nonull") == 0) e->options.nullMove = false;
+        else if (strcmp(item, "nolmr") == 0) e->options.lmr = false;
+        else if (strcmp(item, "nocheckext") == 0) e->options.checkExtensions = false;
+        else if (strcmp(item, "nofutility") == 0) e->options.futility = false;
+        else {
+            fprintf(stderr, "Unknown engine setting: %s\n", item);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Plays engine1 against engine2 from the openings of an EPD or PGN file and
+// reports the score as Elo; with --sprt the match stops early once the
+// sequential test decides between elo0 and elo1.
+static int cmdMatch(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    MatchConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.games = 100;
+    cfg.hashMB = 4;
+    cfg.alpha = cfg.beta = 0.05;
+    const char *specs[2] = {"", ""}, *out = NULL;
+    Uint64 nodes = 20000;
+    int depth = 0, movetime = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--out") == 0) out = argv[i + 1];
+        else if (strcmp(argv[i], "--games") == 0) cfg.games = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--threads") == 0) cfg.threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--engine1") == 0) specs[0] = argv[i + 1];
+        else if (strcmp(argv[i], "--engine2") == 0) specs[1] = argv[i + 1];
+        else if (strcmp(argv[i], "--nodes") == 0) nodes = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--movetime") == 0) movetime = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--depth") == 0) depth = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--hash") == 0) cfg.hashMB = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--alpha") == 0) cfg.alpha = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--beta") == 0) cfg.beta = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--sprt") == 0) {
+            cfg.sprt = sscanf(argv[i + 1], "%lf,%lf", &cfg.elo0, &cfg.elo1) == 2;
+        } else {
+            printUsage();
+            return 1;
         }
     }
-    if (inCheck) {
-        return "Check";
+    if (cfg.hashMB < 1) cfg.hashMB = 4;
+    if (cfg.alpha <= 0 || cfg.alpha >= 1 || cfg.beta <= 0 || cfg.beta >= 1) cfg.alpha = cfg.beta = 0.05;
+    // A time or depth limit given on its own replaces the default node limit
+    if ((movetime > 0 || depth > 0) && nodes == 20000) nodes = 0;
+
+    for (int k = 0; k < 2; k++) {
+        EngineConfig *e = &cfg.engines[k];
+        snprintf(e->name, sizeof(e->name), "engine%d", k + 1);
+        e->options = (SearchOptions) {true, true, true, true, true, true};
+        e->depth = depth;
+        e->nodes = nodes;
+        e->movetime = movetime;
+        if (!parseEngineSpec(specs[k], e)) return 1;
+        if (e->depth <= 0 && e->nodes == 0 && e->movetime <= 0) {
+            fprintf(stderr, "%s has no depth, node or time limit\n", e->name);
+            return 1;
+        }
     }
-    return "";
-}
 
-void drawTurnIndicator(int turn) {
-    const char *turnText = (turn % 2 == 0) ? "White's Turn" : "Black's Turn";
-    SDL_Rect textRect = {BOARD_WIDTH + 20, 100, 260, 40};
-    drawText(turnText, textRect);
+    headless = true;
+    OpeningList openings = {0};
+    if (readOpenings(argv[0], &openings) <= 0) {
+        fprintf(stderr, "No opening positions in %s\n", argv[0]);
+        free(openings.fens);
+        return 1;
+    }
+    cfg.openings = openings.fens;
+    cfg.openingCount = openings.count;
+    if (out) {
+        cfg.pgnOut = fopen(out, "w");
+        if (!cfg.pgnOut) {
+            fprintf(stderr, "Could not create %s\n", out);
+            free(openings.fens);
+            return 1;
+        }
+    }
 
-    const char *status = getGameStatusText();
-    if (strlen(status) > 0) {
-        SDL_Rect statusRect = {BOARD_WIDTH + 20, 140, 260, 30};
-        drawTextWithFont(status, statusRect, smallFont);
+    printf("%s vs %s, %d games from %d openings\n", cfg.engines[0].name, cfg.engines[1].name, cfg.games,
+           cfg.openingCount);
+    MatchResult r;
+    runMatch(&cfg, &r);
+    double margin, elo = matchElo(&r, &margin);
+    printf("%s vs %s: +%d =%d -%d (%d adjudicated), Elo %+.1f +/- %.1f, %.3fs, %.2f games/s\n",
+           cfg.engines[0].name, cfg.engines[1].name, r.wins, r.draws, r.losses, r.adjudicated, elo, margin,
+           r.seconds, r.seconds > 0 ? r.games / r.seconds : 0.0);
+    if (cfg.sprt) {
+        printf("SPRT elo0=%.1f elo1=%.1f alpha=%.2f beta=%.2f: LLR %.2f [%.2f, %.2f], %s\n", cfg.elo0, cfg.elo1,
+               cfg.alpha, cfg.beta, r.llr, r.lowerBound, r.upperBound,
+               r.decision > 0 ? "H1 accepted" : r.decision < 0 ? "H0 accepted" : "inconclusive");
     }
+    if (cfg.pgnOut) fclose(cfg.pgnOut);
+    free(openings.fens);
+    return 0;
 }
 
-void renderBoardWithBack() {
-    renderBoard();
-    drawButton(backButton, "Back");
-    drawButton(savePGNButton, "Save");
-    drawTurnIndicator(currentTurn);
-    drawCapturedPieces();
+// Annotates every game of a PGN file with a fixed search budget per position.
+static int cmdAnnotate(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    EngineConfig engine;
+    memset(&engine, 0, sizeof(engine));
+    snprintf(engine.name, sizeof(engine.name), "chess");
+    engine.options = (SearchOptions) {true, true, true, true, true, true};
+    engine.nodes = 100000;
+    const char *errFile = NULL, *spec = "";
+    int threads = 0, hashMB = TT_DEFAULT_MB;
+    bool nodesGiven = false;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--errors") == 0) errFile = argv[i + 1];
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--hash") == 0) hashMB = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--depth") == 0) engine.depth = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--movetime") == 0) engine.movetime = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--engine") == 0) spec = argv[i + 1];
+        else if (strcmp(argv[i], "--nodes") == 0) {
+            engine.nodes = strtoull(argv[i + 1], NULL, 10);
+            nodesGiven = true;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    // A time or depth limit given on its own replaces the default node limit
+    if ((engine.movetime > 0 || engine.depth > 0) && !nodesGiven) engine.nodes = 0;
+    if (!parseEngineSpec(spec, &engine)) return 1;
+    if (engine.depth <= 0 && engine.nodes == 0 && engine.movetime <= 0) {
+        fprintf(stderr, "No depth, node or time limit\n");
+        return 1;
+    }
+    long invalid = annotatePGNFile(argv[0], argv[1], errFile, &engine, hashMB, threads);
+    if (invalid < 0) return 1;
+    return invalid ? 2 : 0;
 }
 
-// -------------------------
-// Event Handling
-// -------------------------
-
-void handleMouseClick(int mx, int my) {
-    if (awaitingPromotion) {
-        const char *options = "qrbn";
-        for (int i = 0; i < 4; i++) {
-            SDL_Rect optRect = {BOARD_WIDTH + 40 + i * 60, 200, 50, 50};
-            if (mx >= optRect.x && mx <= optRect.x + optRect.w &&
-                my >= optRect.y && my <= optRect.y + optRect.h) {
-                char chosen = (promoColor == 'w') ? toupper(options[i]) : tolower(options[i]);
-                board[promoRow][promoCol] = chosen;
-                awaitingPromotion = false;
-                promotionJustCompleted = true;
-                currentTurn++;
-                break;
+// Checks see() against SEE_TESTS; with --bench, also times it over every
+// capture in the test and bench positions, N rounds.
+static int cmdSEE(int argc, char *argv[]) {
+    int rounds = 0;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--bench") == 0) rounds = atoi(argv[i + 1]);
+    }
+    headless = true;
+
+    int count = (int) (sizeof(SEE_TESTS) / sizeof(SEE_TESTS[0]));
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        Move m;
+        if (!loadFEN(SEE_TESTS[i].fen) || decodeSAN(SEE_TESTS[i].san, currentTurn % 2, &m) != SAN_OK) {
+            printf("BAD   %-8s %s\n", SEE_TESTS[i].san, SEE_TESTS[i].fen);
+            failed++;
+            continue;
+        }
+        int gain = see(m);
+        bool ok = gain == SEE_TESTS[i].expected;
+        if (!ok) failed++;
+        printf("%s %-8s %5d (expected %5d)  %s\n", ok ? "ok  " : "FAIL", SEE_TESTS[i].san, gain,
+               SEE_TESTS[i].expected, SEE_TESTS[i].fen);
+    }
+    printf("%d/%d exchanges correct\n", count - failed, count);
+
+    if (rounds > 0) {
+        int benchCount = (int) (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]));
+        Uint64 calls = 0, ticks = 0;
+        volatile int sink = 0;
+        for (int i = 0; i < count + benchCount; i++) {
+            loadFEN(i < count ? SEE_TESTS[i].fen : BENCH_FENS[i - count]);
+            Move list[MAX_MOVES], captures[MAX_MOVES];
+            int n = generateLegalMoves(currentTurn % 2, list), k = 0;
+            for (int j = 0; j < n; j++) {
+                if (isCapture(list[j])) captures[k++] = list[j];
             }
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (int r = 0; r < rounds; r++) {
+                for (int j = 0; j < k; j++) sink += see(captures[j]);
+            }
+            ticks += SDL_GetPerformanceCounter() - start;
+            calls += (Uint64) rounds * k;
         }
-        return;
+        double secs = (double) ticks / SDL_GetPerformanceFrequency();
+        printf("%llu see() calls, %.3fs, %.1f ns/call\n", (unsigned long long) calls, secs,
+               calls ? secs * 1e9 / calls : 0.0);
     }
+    return failed ? 2 : 0;
+}
 
-    if (currentState == MAIN_MENU) {
-        if (SDL_PointInRect(&(SDL_Point){mx, my}, &playButton)) {
-            playWithBot = false;
-            currentState = CHESS_BOARD;
-        } else if (SDL_PointInRect(&(SDL_Point){mx, my}, &botButton)) {
-            playWithBot = true;
-            currentState = CHESS_BOARD;
-        } else if (SDL_PointInRect(&(SDL_Point){mx, my}, &pgnButton)) {
-            playPGNFile("game.pgn");
+static void printPVLines(int depth, const PVLine *lines, int count, void *ctx) {
+    for (int i = 0; i < count; i++) {
+        char score[16], pv[512];
+        formatScore(lines[i].score, score, sizeof(score));
+        formatPVLine(&lines[i], SEARCH_MAX_PLY, pv, sizeof(pv));
+        printf("  depth %2d  %d. %6s  %s\n", depth, i + 1, score, pv);
+    }
+}
+
+// Searches one position, or the BENCH_FENS set, to a fixed depth with a cleared
+// table per position. The --no-* switches turn single search features off so
+// their effect on nodes and time can be compared. --uci prints "info" lines
+// per depth, --json the search statistics per position and in total.
+static int cmdSearch(int argc, char *argv[]) {
+    const char *fen = NULL;
+    int depth = 5, hashMB = TT_DEFAULT_MB, multiPV = 1;
+    bool uci = false, json = false;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--fen") == 0 && i + 1 < argc) fen = argv[++i];
+        else if (strcmp(argv[i], "--uci") == 0) uci = true;
+        else if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--multipv") == 0 && i + 1 < argc) multiPV = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) hashMB = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-pvs") == 0) searchOptions.pvs = false;
+        else if (strcmp(argv[i], "--no-aspiration") == 0) searchOptions.aspiration = false;
+        else if (strcmp(argv[i], "--no-null") == 0) searchOptions.nullMove = false;
+        else if (strcmp(argv[i], "--no-lmr") == 0) searchOptions.lmr = false;
+        else if (strcmp(argv[i], "--no-check-ext") == 0) searchOptions.checkExtensions = false;
+        else if (strcmp(argv[i], "--no-futility") == 0) searchOptions.futility = false;
+        else {
+            printUsage();
+            return 1;
         }
-    } else if (currentState == CHESS_BOARD) {
-        // “Back” button
-        if (SDL_PointInRect(&(SDL_Point){mx, my}, &backButton)) {
-            resetGameState();
-            currentState = MAIN_MENU;
-            return;
+    }
+    if (depth < 1 || depth >= SEARCH_MAX_PLY) depth = 5;
+    if (multiPV < 1 || multiPV > MULTI_PV_MAX) multiPV = 1;
+
+    headless = true;
+    if (!initTransTable(&ownTT, hashMB > 0 ? hashMB : TT_DEFAULT_MB)) return 1;
+    searchTT = &ownTT;
+
+    const char **fens = fen ? &fen : BENCH_FENS;
+    int count = fen ? 1 : (int) (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]));
+    Uint64 totalNodes = 0, totalTicks = 0;
+    SearchStats total;
+    memset(&total, 0, sizeof(total));
+    TextBuffer text = {0};
+    for (int i = 0; i < count; i++) {
+        if (!loadFEN(fens[i])) {
+            fprintf(stderr, "Invalid FEN: %s\n", fens[i]);
+            freeTransTable(&ownTT);
+            return 1;
         }
-        // “Save PGN” button
-        if (SDL_PointInRect(&(SDL_Point){mx, my}, &savePGNButton)) {
-            savePGN("game.pgn");
-            return;
+        clearTransTable(&ownTT);
+        int score;
+        Uint64 start = SDL_GetPerformanceCounter();
+        Move m;
+        if (multiPV > 1 || uci) {
+            PVLine lines[MULTI_PV_MAX];
+            int n = analyzePosition(depth, multiPV, lines, uci ? printUCIInfo : printPVLines, NULL);
+            m = n ? unpackMove(lines[0].pv[0]) : (Move){0, 0, 0, 0, 0};
+            score = n ? lines[0].score : 0;
+        } else {
+            m = findBestMove(depth, &score);
+        }
+        Uint64 ticks = SDL_GetPerformanceCounter() - start;
+        totalNodes += searchNodes;
+        totalTicks += ticks;
+        SearchStats stats = searchStats; // before the move is encoded below
+        mergeSearchStats(&total, &stats);
+
+        char san[PGN_SAN_LEN] = "-";
+        bool legal = hasAnyLegalMove(currentTurn % 2);
+        if (legal) encodeSAN(m, san);
+        if (uci) {
+            char move[8] = "0000";
+            if (legal) formatUCIMove(m, move);
+            printf("bestmove %s\n", move);
+        }
+        printf("%-8s %7d %12llu nodes %9.1f ms  %s\n", san, score, (unsigned long long) searchNodes,
+               1000.0 * ticks / SDL_GetPerformanceFrequency(), fens[i]);
+        if (json) {
+            text.len = 0;
+            appendSearchStatsJSON(&text, &stats);
+            printf("%s\n", text.data);
         }
+    }
+    double secs = (double) totalTicks / SDL_GetPerformanceFrequency();
+    printf("depth %d: %llu nodes, %.3fs, %.0f nodes/s\n", depth, (unsigned long long) totalNodes, secs,
+           secs > 0 ? totalNodes / secs : 0.0);
+    printf("  %.1f%% qnodes, EBF %.2f, first-move cutoffs %.1f%%, TT hits %.1f%% of %llu probes, %llu stores, "
+           "%llu evals, %llu movegens\n", 100.0 * statRate(total.qnodes, total.nodes),
+           effectiveBranchingFactor(&total), 100.0 * statRate(total.firstMoveCutoffs, total.cutoffs),
+           100.0 * statRate(total.ttHits, total.ttProbes), (unsigned long long) total.ttProbes,
+           (unsigned long long) total.ttStores, (unsigned long long) total.evalCalls,
+           (unsigned long long) total.movegenCalls);
+    printf("  pawn hash hits %.1f%% of %llu probes\n", 100.0 * statRate(total.pawnHits, total.pawnProbes),
+           (unsigned long long) total.pawnProbes);
+    printf("  stages reached by %llu move pickers:", (unsigned long long) total.pickerNodes);
+    for (int i = 0; i < STAGE_DONE; i++) {
+        printf(" %s %.1f%%", MOVE_STAGE_NAMES[i], 100.0 * statRate(total.stageReached[i], total.pickerNodes));
+    }
+    printf("\n");
+    if (json) {
+        text.len = 0;
+        appendSearchStatsJSON(&text, &total);
+        printf("%s\n", text.data);
+    }
+    freeTextBuffer(&text);
+    freeTransTable(&ownTT);
+    searchTT = NULL;
+    return 0;
+}
 
-        int col = mx / TILE_SIZE;
-        int row = my / TILE_SIZE;
-        if (row < 0 || row >= BOARD_SIZE || col < 0 || col >= BOARD_SIZE) {
-            // clicked on side panel; ignore
-            return;
+// Fixed-depth search of BENCH_FENS, single thread, fresh table and default
+// options per position. The total node count is a signature of the search:
+// it changes exactly when the search or evaluation behaves differently.
+static int cmdBench(int argc, char *argv[]) {
+    int depth = BENCH_DEPTH, hashMB = TT_DEFAULT_MB;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) hashMB = atoi(argv[++i]);
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (depth < 1 || depth >= SEARCH_MAX_PLY) depth = BENCH_DEPTH;
+
+    headless = true;
+    if (!initTransTable(&ownTT, hashMB > 0 ? hashMB : TT_DEFAULT_MB)) return 1;
+    searchTT = &ownTT;
+    setSearchLimits(0, 0);
+    int count = (int) (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]));
+    Uint64 nodes = 0, ticks = 0;
+    for (int i = 0; i < count; i++) {
+        loadFEN(BENCH_FENS[i]);
+        clearTransTable(&ownTT);
+        int score;
+        Uint64 start = SDL_GetPerformanceCounter();
+        Move m = findBestMove(depth, &score);
+        ticks += SDL_GetPerformanceCounter() - start;
+        nodes += searchNodes;
+        char move[8] = "0000";
+        if (hasAnyLegalMove(currentTurn % 2)) formatUCIMove(m, move);
+        printf("Position %d/%d: %-6s %10llu nodes  %s\n", i + 1, count, move, (unsigned long long) searchNodes,
+               BENCH_FENS[i]);
+    }
+    freeTransTable(&ownTT);
+    searchTT = NULL;
+
+    double secs = (double) ticks / SDL_GetPerformanceFrequency();
+    printf("\nDepth           : %d\n", depth);
+    printf("Total time (ms) : %.0f\n", secs * 1000.0);
+    printf("Nodes searched  : %llu\n", (unsigned long long) nodes);
+    printf("Nodes/second    : %.0f\n", secs > 0 ? nodes / secs : 0.0);
+    return 0;
+}
+
+static volatile int benchSink;
+
+// Each operation runs reps times on the loaded position and returns how many
+// single operations that was.
+static Uint64 benchPseudoMoves(int reps) {
+    Move list[MAX_MOVES];
+    for (int i = 0; i < reps; i++) benchSink += generatePseudoMoves(currentTurn % 2, list);
+    return reps;
+}
+
+static Uint64 benchLegalMoves(int reps) {
+    Move list[MAX_MOVES];
+    for (int i = 0; i < reps; i++) benchSink += generateLegalMoves(currentTurn % 2, list);
+    return reps;
+}
+
+static Uint64 benchInCheck(int reps) {
+    for (int i = 0; i < reps; i++) benchSink += isKingInCheck(0) + isKingInCheck(1);
+    return 2 * (Uint64) reps;
+}
+
+static Uint64 benchMakeUnmake(int reps) {
+    Move list[MAX_MOVES];
+    int n = generatePseudoMoves(currentTurn % 2, list);
+    for (int i = 0; i < reps; i++) {
+        for (int j = 0; j < n; j++) {
+            Undo u;
+            makeMove(list[j], &u);
+            unmakeMove(&u);
         }
+    }
+    return (Uint64) reps * n;
+}
 
-        if (!pieceSelected) {
-            // Select a piece
-            char p = board[row][col];
-            if (p != ' ' &&
-                ((currentTurn % 2 == 0 && isWhitePiece(p)) ||
-                 (currentTurn % 2 == 1 && !isWhitePiece(p)))) {
-                selectedRow = row;
-                selectedCol = col;
-                pieceSelected = true;
-                computeValidMoves(row, col);
+static Uint64 benchEvaluate(int reps) {
+    for (int i = 0; i < reps; i++) benchSink += evaluate(currentTurn % 2);
+    return reps;
+}
+
+static Uint64 benchPawnStructure(int reps) {
+    PawnHashEntry e;
+    for (int i = 0; i < reps; i++) {
+        evaluatePawnStructure(&e);
+        benchSink += e.score;
+    }
+    return reps;
+}
+
+static Uint64 benchSEE(int reps) {
+    Move list[MAX_MOVES];
+    int n = generateLegalMoves(currentTurn % 2, list), k = 0;
+    for (int j = 0; j < n; j++) {
+        if (isCapture(list[j])) list[k++] = list[j];
+    }
+    for (int i = 0; i < reps; i++) {
+        for (int j = 0; j < k; j++) benchSink += see(list[j]);
+    }
+    return (Uint64) reps * k;
+}
+
+static Uint64 benchSANEncode(int reps) {
+    Move list[MAX_MOVES];
+    char san[PGN_SAN_LEN];
+    int n = generateLegalMoves(currentTurn % 2, list);
+    for (int i = 0; i < reps; i++) {
+        for (int j = 0; j < n; j++) benchSink += encodeSAN(list[j], san);
+    }
+    return (Uint64) reps * n;
+}
+
+static Uint64 benchSANDecode(int reps) {
+    Move list[MAX_MOVES];
+    static _Thread_local char san[MAX_MOVES][PGN_SAN_LEN];
+    int n = generateLegalMoves(currentTurn % 2, list);
+    for (int j = 0; j < n; j++) encodeSAN(list[j], san[j]);
+    for (int i = 0; i < reps; i++) {
+        for (int j = 0; j < n; j++) {
+            Move m;
+            benchSink += decodeSAN(san[j], currentTurn % 2, &m);
+        }
+    }
+    return (Uint64) reps * n;
+}
+
+static const struct {
+    const char *name;
+    Uint64 (*op)(int reps);
+} MICRO_BENCHES[] = {
+    {"pseudo-legal movegen", benchPseudoMoves},
+    {"legal movegen", benchLegalMoves},
+    {"isKingInCheck", benchInCheck},
+    {"make/unmake", benchMakeUnmake},
+    {"evaluate", benchEvaluate},
+    {"pawn structure (miss)", benchPawnStructure},
+    {"see", benchSEE},
+    {"SAN encode", benchSANEncode},
+    {"SAN decode", benchSANDecode},
+};
+
+static bool countBenchGame(const PGNGame *game, void *ctx) {
+    *(long *) ctx += game->plyCount;
+    return true;
+}
+
+// Times the hot paths on the BENCH_FENS positions, each for about millis
+// milliseconds, then PGN parsing of an in-memory file and a depth 5 search.
+static int cmdMicrobench(int argc, char *argv[]) {
+    int millis = MICROBENCH_MS;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--ms") == 0) millis = atoi(argv[i + 1]);
+    }
+    if (millis < 1) millis = MICROBENCH_MS;
+    headless = true;
+
+    Uint64 freq = SDL_GetPerformanceFrequency(), budget = freq * millis / 1000;
+    int positions = (int) (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]));
+    for (size_t b = 0; b < sizeof(MICRO_BENCHES) / sizeof(MICRO_BENCHES[0]); b++) {
+        Uint64 ops = 0, ticks = 0;
+        while (ticks < budget) {
+            for (int i = 0; i < positions; i++) {
+                loadFEN(BENCH_FENS[i]);
+                Uint64 start = SDL_GetPerformanceCounter();
+                ops += MICRO_BENCHES[b].op(MICROBENCH_REPS);
+                ticks += SDL_GetPerformanceCounter() - start;
             }
-        } else {
-            // Already have a piece selected
-            if (validMoves[row][col]) {
-                // Do the human move
-                char mv[6] = {
-                    (char) ('a' + selectedCol),
-                    (char) ('8' - selectedRow),
-                    (char) ('a' + col),
-                    (char) ('8' - row),
-                    '\0'
-                };
-                movePieceStoringLog(mv);
+        }
+        double secs = (double) ticks / freq;
+        printf("%-22s %10.1f ns/op %14.0f ops/s\n", MICRO_BENCHES[b].name, ops ? secs * 1e9 / ops : 0.0,
+               secs > 0 ? ops / secs : 0.0);
+    }
 
-                // Redraw after human move
-                SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255);
-                SDL_RenderClear(renderer);
-                renderBoardWithBack();
-                SDL_Delay(200);
+    // PGN parsing: one game text repeated into a buffer of about 4 MB
+    static const char game[] =
+        "[Event \"Opera\"]\n[White \"Morphy\"]\n[Result \"1-0\"]\n\n"
+        "1. e4 e5 2. Nf3 d6 3. d4 Bg4 {a comment} 4. dxe5 Bxf3 5. Qxf3 dxe5 6. Bc4 Nf6 7. Qb3 Qe7\n"
+        "8. Nc3 c6 9. Bg5 b5 10. Nxb5 cxb5 11. Bxb5+ Nbd7 (11... Kd8 12. O-O-O) 12. O-O-O Rd8\n"
+        "13. Rxd7 Rxd7 14. Rd1 Qe6 15. Bxd7+ Nxd7 16. Qb8+ Nxb8 17. Rd8# 1-0\n\n";
+    size_t copies = (4 << 20) / (sizeof(game) - 1), len = copies * (sizeof(game) - 1);
+    char *text = malloc(len);
+    if (!text) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < copies; i++) memcpy(text + i * (sizeof(game) - 1), game, sizeof(game) - 1);
+    long plies = 0, games = 0;
+    Uint64 ticks = 0;
+    int passes = 0;
+    while (ticks < budget) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        games += parsePGNBuffer(text, len, countBenchGame, &plies);
+        ticks += SDL_GetPerformanceCounter() - start;
+        passes++;
+    }
+    free(text);
+    double secs = (double) ticks / freq;
+    printf("%-22s %10.1f ns/game %12.1f MB/s\n", "PGN parse", games ? secs * 1e9 / games : 0.0,
+           secs > 0 ? (double) len * passes / secs / (1 << 20) : 0.0);
+
+    if (!initTransTable(&ownTT, TT_DEFAULT_MB)) return 1;
+    searchTT = &ownTT;
+    Uint64 nodes = 0;
+    ticks = 0;
+    for (int i = 0; i < positions; i++) {
+        loadFEN(BENCH_FENS[i]);
+        clearTransTable(&ownTT);
+        int score;
+        Uint64 start = SDL_GetPerformanceCounter();
+        findBestMove(5, &score);
+        ticks += SDL_GetPerformanceCounter() - start;
+        nodes += searchNodes;
+    }
+    freeTransTable(&ownTT);
+    searchTT = NULL;
+    secs = (double) ticks / freq;
+    printf("%-22s %10.1f ns/node %12.0f nodes/s\n", "search (depth 5)", nodes ? secs * 1e9 / nodes : 0.0,
+           secs > 0 ? nodes / secs : 0.0);
+    return 0;
+}
 
-                if (playWithBot && currentTurn % 2 == botPlaysColor) {
-                    SDL_Delay(300);
-                    engineMove(1);
-                }
+static void printPercentiles(const char *label, double *millis, int count) {
+    if (count == 0) return;
+    qsort(millis, count, sizeof(double), compareDoubles);
+    printf("  %-17s p50 %7.2f ms  p90 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n", label, millis[count / 2],
+           millis[count * 9 / 10], millis[count * 99 / 100], millis[count - 1]);
+}
+
+// Replays each recording (one scenario per file) on an offscreen window-sized
+// renderer and reports input-to-present latency and frame-time percentiles.
+static int cmdReplay(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    initHeadless();
+    if (TTF_Init() == -1) {
+        fprintf(stderr, "TTF init error: %s\n", TTF_GetError());
+        cleanupHeadless();
+        return 1;
+    }
+    loadFonts();
+    headless = true;
+    int status = 0;
+    if (initOffscreenRenderer(WINDOW_WIDTH, WINDOW_HEIGHT)) {
+        for (int i = 0; i < argc; i++) {
+            ReplayTimings t;
+            if (!replayInputRecording(argv[i], &t)) {
+                status = 1;
+                continue;
             }
-            // Clear selection
-            pieceSelected = false;
-            memset(validMoves, 0, sizeof(validMoves));
+            printf("%s: %d inputs, %d frames\n", argv[i], t.inputs, t.frames);
+            printPercentiles("input to present", t.inputMillis, t.inputs);
+            printPercentiles("frame time", t.frameMillis, t.frames);
+            freeReplayTimings(&t);
+        }
+        cleanupOffscreenRenderer();
+    } else {
+        status = 1;
+    }
+    stopAnalysisWorker();
+    TTF_CloseFont(smallFont);
+    TTF_CloseFont(font);
+    smallFont = font = NULL;
+    TTF_Quit();
+    cleanupHeadless();
+    return status;
+}
+
+// Game result in EPD operations or a PGN result tag: 1-0, 0-1, 1/2-1/2, or the
+// [1.0], [0.5] and [0.0] of common tuning sets. -1 if there is none.
+static float parseTuneResult(const char *s) {
+    if (strstr(s, "1/2-1/2") || strstr(s, "[0.5]")) return 0.5f;
+    if (strstr(s, "1-0") || strstr(s, "[1.0]")) return 1.0f;
+    if (strstr(s, "0-1") || strstr(s, "[0.0]")) return 0.0f;
+    return -1.0f;
+}
+
+typedef struct {
+    TuneSet *set;
+    float result;
+    bool ok;
+} TuneGame;
+
+static void addTuneGamePly(int ply, void *ctx) {
+    TuneGame *g = ctx;
+    if (ply >= TUNE_MIN_PLY && g->ok) g->ok = addTunePosition(g->set, g->result);
+}
+
+static bool addTuneGame(const PGNGame *game, void *ctx) {
+    TuneGame g = {ctx, parseTuneResult(game->result), true};
+    if (g.result >= 0) replayPGNGame(game, -1, addTuneGamePly, &g);
+    return g.ok;
+}
+
+// Appends the EPD records that carry a result, or every position from ply
+// TUNE_MIN_PLY on of the finished games of a PGN file. Returns the number of
+// positions in the set, -1 if the file cannot be read.
+static int loadTuneSet(const char *path, TuneSet *set) {
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".pgn") == 0) {
+        return parsePGNFile(path, addTuneGame, set) < 0 ? -1 : set->count;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[512], fen[FEN_MAX_LEN];
+    const char *ops;
+    while (fgets(buf, sizeof(buf), f)) {
+        if (!parseEPDRecord(buf, fen, &ops)) continue;
+        float result = parseTuneResult(ops);
+        if (result >= 0 && loadFEN(fen) && !addTunePosition(set, result)) break;
+    }
+    fclose(f);
+    return set->count;
+}
+
+// Tunes every evaluation weight on the labelled positions of an EPD or PGN
+// file and writes the result as a header for EVAL_WEIGHTS_FILE.
+static int cmdTune(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    const char *outFile = "eval_weights.h";
+    int epochs = TUNE_EPOCHS, threads = 0;
+    double rate = TUNE_RATE;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--out") == 0) outFile = argv[i + 1];
+        else if (strcmp(argv[i], "--epochs") == 0) epochs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--rate") == 0) rate = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    }
+    if (threads < 1) threads = SDL_GetCPUCount();
+    headless = true;
+
+    TuneSet set;
+    memset(&set, 0, sizeof(set));
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (loadTuneSet(argv[0], &set) < 0) {
+        fprintf(stderr, "Could not open tuning positions: %s\n", argv[0]);
+        return 1;
+    }
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    printf("Loaded %d positions (%zu KB packed) in %.2fs\n", set.count, set.count * sizeof(PackedPosition) / 1024,
+           secs);
+
+    start = SDL_GetPerformanceCounter();
+    int mismatches = extractTuneFeatures(&set, threads);
+    secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    double rate1 = secs > 0 ? set.count / secs : 0.0;
+    printf("Traced %d quiet positions (%d dropped) in %.2fs: %.0f positions/s, %.0f per core\n", set.used,
+           set.count - set.used, secs, rate1, rate1 / threads);
+    if (mismatches) fprintf(stderr, "%d positions whose traced evaluation differs from evaluate()\n", mismatches);
+    if (set.used == 0) {
+        fprintf(stderr, "No positions to tune on\n");
+        freeTuneSet(&set);
+        return 1;
+    }
+
+    double weights[EVAL_WEIGHT_COUNT], moments[2 * EVAL_WEIGHT_COUNT] = {0};
+    for (int w = 0; w < EVAL_WEIGHT_COUNT; w++) weights[w] = ((const int *) &EVAL_WEIGHTS)[w];
+    double k = fitTuneScaling(&set, weights, threads);
+    double initial = tuneError(&set, weights, k, NULL, threads), error = initial;
+    printf("K = %.4f, error %.6f\n", k, initial);
+
+    start = SDL_GetPerformanceCounter();
+    for (int e = 1; e <= epochs; e++) {
+        error = tuneEpoch(&set, weights, moments, e, k, rate, threads);
+        if (e % 10 == 0 || e == epochs) printf("epoch %4d  error %.6f\n", e, error);
+    }
+    secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    double evals = (double) set.used * epochs;
+    printf("%d epochs in %.2fs: %.0f positions/s, %.0f per core (%d threads)\n", epochs, secs,
+           secs > 0 ? evals / secs : 0.0, secs > 0 ? evals / secs / threads : 0.0, threads);
+
+    char comment[160];
+    snprintf(comment, sizeof(comment), "%d positions, K %.4f, error %.6f -> %.6f", set.used, k, initial,
+             tuneError(&set, weights, k, NULL, threads));
+    bool written = writeTunedWeights(outFile, weights, comment);
+    if (written) printf("Tuned weights written to %s\n", outFile);
+    else fprintf(stderr, "Could not write %s\n", outFile);
+    freeTuneSet(&set);
+    return !written ? 1 : mismatches ? 2 : 0;
+}
+
+// Self-play games from random openings, kept positions streamed to shards.
+static int cmdDatagen(int argc, char *argv[]) {
+    if (argc < 1) {
+        printUsage();
+        return 1;
+    }
+    DatagenConfig cfg = {0};
+    cfg.games = 100;
+    cfg.randomPlies = DATAGEN_RANDOM_PLIES;
+    cfg.nodes = DATAGEN_NODES;
+    cfg.hashMB = 4;
+    cfg.seed = (Uint64) time(NULL);
+    Uint64 shardRecords = DATAGEN_SHARD_RECORDS;
+    const char *openingFile = NULL;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--games") == 0) cfg.games = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--nodes") == 0) cfg.nodes = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--random-plies") == 0) cfg.randomPlies = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--openings") == 0) openingFile = argv[i + 1];
+        else if (strcmp(argv[i], "--threads") == 0) cfg.threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--hash") == 0) cfg.hashMB = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--shard") == 0) shardRecords = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0) cfg.seed = strtoull(argv[i + 1], NULL, 10);
+    }
+    if (cfg.nodes == 0) {
+        fprintf(stderr, "No node limit\n");
+        return 1;
+    }
+    if (cfg.threads < 1) cfg.threads = SDL_GetCPUCount();
+    if (cfg.randomPlies < 0) cfg.randomPlies = 0;
+    headless = true;
+
+    OpeningList openings = {0};
+    if (openingFile && readOpenings(openingFile, &openings) <= 0) {
+        fprintf(stderr, "No openings in %s\n", openingFile);
+        free(openings.fens);
+        return 1;
+    }
+    cfg.openings = openings.fens;
+    cfg.openingCount = openings.count;
+
+    printf("Generating %d games, %llu nodes per move, %d random plies, seed %llu, %d threads\n", cfg.games,
+           (unsigned long long) cfg.nodes, cfg.randomPlies, (unsigned long long) cfg.seed, cfg.threads);
+    TrainingWriter w;
+    DatagenResult r;
+    initTrainingWriter(&w, argv[0], shardRecords);
+    bool ok = runDatagen(&cfg, &w, &r);
+    ok = closeTrainingWriter(&w) && ok;
+    double perSecond = r.seconds > 0 ? r.positions / r.seconds : 0.0;
+    printf("%d games, %llu positions (%llu skipped as not quiet) in %d shards, %.1fs: %.0f positions/s, %.0f per "
+           "thread\n",
+           r.games, (unsigned long long) r.positions, (unsigned long long) r.skipped, w.shards, r.seconds, perSecond,
+           perSecond / cfg.threads);
+    if (!ok) fprintf(stderr, "Could not write %s shards\n", argv[0]);
+    free(openings.fens);
+    return ok ? 0 : 1;
+}
+
+// Summary of training data shards; --dump N prints the first N records.
+static int cmdDatagenInfo(int argc, char *argv[]) {
+    int dump = 0, status = 0;
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--dump") == 0) dump = atoi(argv[i + 1]);
+    }
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--dump") == 0) {
+            i++;
+            continue;
+        }
+        TrainingData data;
+        if (!openTrainingData(&data, argv[i])) {
+            fprintf(stderr, "Not a training data file: %s\n", argv[i]);
+            status = 1;
+            continue;
         }
+        Uint64 results[3] = {0, 0, 0}, absScore = 0;
+        int maxPly = 0;
+        for (Uint64 k = 0; k < data.count; k++) {
+            const TrainingRecord *rec = &data.records[k];
+            if (rec->result <= 2) results[rec->result]++;
+            absScore += (Uint64) abs(rec->score);
+            if (rec->ply > maxPly) maxPly = rec->ply;
+        }
+        double n = data.count ? (double) data.count : 1.0;
+        printf("%s: %llu records  White %.1f%%  draw %.1f%%  Black %.1f%%  mean |score| %.0f  last ply %d\n",
+               argv[i], (unsigned long long) data.count, 100.0 * results[2] / n, 100.0 * results[1] / n,
+               100.0 * results[0] / n, absScore / n, maxPly);
+        for (Uint64 k = 0; k < data.count && k < (Uint64) dump; k++) {
+            static const char *RESULTS[3] = {"0-1", "1/2-1/2", "1-0"};
+            const TrainingRecord *rec = &data.records[k];
+            char fen[FEN_MAX_LEN];
+            unpackPosition(&rec->pos);
+            writeFEN(fen);
+            printf("  %s  %+d  %s  ply %d\n", fen, rec->score, rec->result <= 2 ? RESULTS[rec->result] : "?",
+                   rec->ply);
+        }
+        closeTrainingData(&data);
+    }
+    return status;
+}
+
+static int cmdDatagenShuffle(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+    Uint64 shardRecords = DATAGEN_SHARD_RECORDS, seed = (Uint64) time(NULL);
+    const char **inputs = malloc(argc * sizeof(char *));
+    int inputCount = 0;
+    if (!inputs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) shardRecords = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else inputs[inputCount++] = argv[i];
     }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    long long total = shuffleTrainingData(inputs, inputCount, argv[0], shardRecords, seed);
+    double secs = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    free(inputs);
+    if (total < 0) {
+        fprintf(stderr, "Could not shuffle into %s shards\n", argv[0]);
+        return 1;
+    }
+    printf("Shuffled %lld records from %d files in %.2fs (%.0f records/s)\n", total, inputCount, secs,
+           secs > 0 ? total / secs : 0.0);
+    return 0;
+}
+
+int runCommandLine(int argc, char *argv[]) {
+    if (strcmp(argv[1], "render") == 0) return cmdRender(argc - 2, argv + 2);
+    if (strcmp(argv[1], "render-batch") == 0) return cmdRenderBatch(argc - 2, argv + 2);
+    if (strcmp(argv[1], "pgn-scan") == 0) return cmdPGNScan(argc - 2, argv + 2);
+    if (strcmp(argv[1], "pgn-convert") == 0) return cmdPGNConvert(argc - 2, argv + 2);
+    if (strcmp(argv[1], "db-build") == 0) return cmdDBBuild(argc - 2, argv + 2);
+    if (strcmp(argv[1], "db-info") == 0) return cmdDBInfo(argc - 2, argv + 2);
+    if (strcmp(argv[1], "pos-index") == 0) return cmdPosIndex(argc - 2, argv + 2);
+    if (strcmp(argv[1], "pos-query") == 0) return cmdPosQuery(argc - 2, argv + 2);
+    if (strcmp(argv[1], "san-bench") == 0) return cmdSANBench(argc - 2, argv + 2);
+    if (strcmp(argv[1], "see") == 0) return cmdSEE(argc - 2, argv + 2);
+    if (strcmp(argv[1], "mate") == 0) return cmdMate(argc - 2, argv + 2);
+    if (strcmp(argv[1], "search") == 0) return cmdSearch(argc - 2, argv + 2);
+    if (strcmp(argv[1], "match") == 0) return cmdMatch(argc - 2, argv + 2);
+    if (strcmp(argv[1], "annotate") == 0) return cmdAnnotate(argc - 2, argv + 2);
+    if (strcmp(argv[1], "bench") == 0) return cmdBench(argc - 2, argv + 2);
+    if (strcmp(argv[1], "replay") == 0) return cmdReplay(argc - 2, argv + 2);
+    if (strcmp(argv[1], "microbench") == 0) return cmdMicrobench(argc - 2, argv + 2);
+    if (strcmp(argv[1], "tune") == 0) return cmdTune(argc - 2, argv + 2);
+    if (strcmp(argv[1], "datagen") == 0) return cmdDatagen(argc - 2, argv + 2);
+    if (strcmp(argv[1], "datagen-info") == 0) return cmdDatagenInfo(argc - 2, argv + 2);
+    if (strcmp(argv[1], "datagen-shuffle") == 0) return cmdDatagenShuffle(argc - 2, argv + 2);
+    printUsage();
+    return 1;
 }
 
 // -------------------------
@@ -1397,64 +9278,90 @@ void handleMouseClick(int mx, int my) {
 // -------------------------
 
 int main(int argc, char *argv[]) {
+    initAttackTables();
+    initZobrist();
+
+    // --trace <file> records the whole run, window or command, and writes it at exit
+    const char *traceFile = NULL;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            traceFile = argv[i + 1];
+            memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(char *));
+            argc -= 2;
+            break;
+        }
+    }
+    if (traceFile) startTracing();
+
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0) {
+        int status = runCommandLine(argc, argv);
+        if (traceFile) writeTrace(traceFile);
+        freeTracing();
+        return status;
+    }
+
+    const char *resumeFile = NULL, *recordFile = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (strcmp(argv[i], "--pgn") == 0 && i + 1 < argc) {
+            snprintf(pgnFilePath, sizeof(pgnFilePath), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resumeFile = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : SAVE_FILE;
+        } else if (strcmp(argv[i], "--journal-sync") == 0 && i + 1 < argc &&
+                   parseJournalSync(argv[i + 1], &journalSyncPolicy)) {
+            i++;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    // An explicit --resume wins over a journal left behind by a crash
+    if (resumeFile) {
+        if (!loadGame(resumeFile)) return 1;
+        currentState = CHESS_BOARD;
+        startJournal();
+    } else if (recoverJournal()) {
+        currentState = CHESS_BOARD;
+        startJournal();
+    }
+
     initSDL();
     loadPaths();
     loadFonts();
+    loadPieceAtlas();
     loadPieceTextures();
-
-    // As soon as we enter CHESS_BOARD, force an initial draw
-    bool firstBoardDrawn = false;
+    if (recordFile) startInputRecording(recordFile);
 
     SDL_Event e;
     bool running = true;
+    Uint64 lastFrame = SDL_GetPerformanceCounter();
     while (running) {
+        Uint64 frameZone = traceBegin();
+        Uint64 eventsZone = traceBegin();
         while (SDL_PollEvent(&e)) {
-            if (e.type == SDL_QUIT) {
+            if (!handleEvent(&e)) {
                 running = false;
                 break;
             }
-            if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT) {
-                handleMouseClick(e.button.x, e.button.y);
-            }
         }
+        traceEnd(eventsZone, "events");
 
-        // Render loop
-        SDL_SetRenderDrawColor(renderer, 255, 192, 203, 255);
-        SDL_RenderClear(renderer);
-
-        if (currentState == MAIN_MENU) {
-            renderMainMenu();
-        } else if (currentState == CHESS_BOARD) {
-            renderBoardWithBack();
-
-            // Always render promotion options if needed
-            if (awaitingPromotion) {
-                const char *options = "qrbn";
-                for (int i = 0; i < 4; i++) {
-                    char piece = (promoColor == 'w') ? toupper(options[i]) : tolower(options[i]);
-                    SDL_Rect optRect = {BOARD_WIDTH + 40 + i * 60, 200, 50, 50};
-                    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-                    SDL_RenderFillRect(renderer, &optRect);
-                    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-                    SDL_RenderDrawRect(renderer, &optRect);
-                    if (textures[(int) piece]) {
-                        SDL_RenderCopy(renderer, textures[(int) piece], NULL, &optRect);
-                    }
-                }
-            }
-
-            SDL_RenderPresent(renderer);
-
-            if (!firstBoardDrawn) {
-                renderBoardWithBack();
-                SDL_RenderPresent(renderer);
-                firstBoardDrawn = true;
-            }
-        }
+        drawFrame();
+        traceEnd(frameZone, "frame");
 
-        SDL_Delay(20);
+        Uint64 idle = traceBegin();
+        SDL_Delay(FRAME_DELAY_MS);
+        traceEnd(idle, "SDL_Delay");
+        Uint64 now = SDL_GetPerformanceCounter();
+        recordFrameTime(1000.0 * (now - lastFrame) / SDL_GetPerformanceFrequency());
+        lastFrame = now;
     }
 
+    stopInputRecording();
+    if (traceFile) writeTrace(traceFile);
+    freeTracing();
     cleanupSDL();
     return 0;
 }